@@ -0,0 +1,515 @@
+/*
+ * Copyright (c) 2016-2017,2019 Jason Graham <jgraham@compukix.net>
+ *
+ * This file is part of libsockets.
+ *
+ * libsockets is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * libsockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsockets.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+// Microbenchmarks of the library hot paths over loopback:
+//
+//   buffer     buffer_resize growth: an empty buffer grown to size bytes in
+//              64-byte appends (one op per buffer)
+//   send       one-way framed messages, client send to server recv
+//   rtt        round trip: the server echoes every message
+//   handshake  sock_client_connect, worker port negotiation included
+//
+// Operation counts are fixed per size (scaled with -n) so that runs are
+// comparable. Every size is run -r times after a warm-up; the median is
+// reported as tab separated lines:
+//
+//   bench size ops ns_per_op syscalls_per_op bytes_per_s
+//
+// syscalls_per_op counts the send and receive calls made by both ends (the
+// ntrans counters); it is nan where the library does not count them.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sockets_internal.h"
+
+#define BENCH_PORT 47100
+#define BENCH_APPEND 64 // Append size of the buffer benchmark
+#define BENCH_NSIZE_MAX 32
+
+// Session opened by the first message of a connection
+#define BENCH_SINK 'S' // Receive; answer an empty message with the receive call count
+#define BENCH_ECHO 'E' // Send every message back, empty ones with the call count
+#define BENCH_QUIT 'Q'
+
+typedef struct bench_s {
+        const char *name;
+        size_t (*ops)(size_t size_);
+        int (*run)(size_t size_, size_t ops_, double *ns_, double *ntrans_);
+        bool sized; // Swept over the message sizes
+} bench_t;
+
+static uint16_t port = BENCH_PORT;
+static double scale  = 1.0;
+static int nrep      = 5;
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+// LOCAL PROTOTYPES
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+static size_t ops_buffer(size_t size_);
+static size_t ops_send(size_t size_);
+static size_t ops_rtt(size_t size_);
+static size_t ops_handshake(size_t size_);
+static int run_buffer(size_t size_, size_t ops_, double *ns_, double *ntrans_);
+static int run_send(size_t size_, size_t ops_, double *ns_, double *ntrans_);
+static int run_rtt(size_t size_, size_t ops_, double *ns_, double *ntrans_);
+static int run_handshake(size_t size_, size_t ops_, double *ns_, double *ntrans_);
+
+static void *server_main(void *arg_);
+static int server_session(sock_server_t *server_);
+static int session_open(sock_client_t *client_, char mode_);
+static int session_count(sock_client_t *client_, size_t *ntrans_);
+static void session_close(sock_client_t *client_);
+
+static size_t clamp_ops(size_t bytes_, size_t size_, size_t min_, size_t max_);
+static double now_ns(void);
+static int cmp_double(const void *a_, const void *b_);
+static void bench_one(const bench_t *bench_, size_t size_);
+static void usage(const char *prog_);
+
+static const bench_t benches[] = {
+    {"buffer", ops_buffer, run_buffer, true},
+    {"send", ops_send, run_send, true},
+    {"rtt", ops_rtt, run_rtt, true},
+    {"handshake", ops_handshake, run_handshake, false},
+};
+#define NBENCH (sizeof(benches) / sizeof(benches[0]))
+
+//------------------------------------------------------------------------------
+// sock_bench [-p port] [-r reps] [-n scale] [-s size,...] [bench ...]
+//------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+        size_t size[BENCH_NSIZE_MAX] = {16, 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576};
+        size_t nsize                 = 9;
+        bool want[NBENCH];
+        sock_server_t master, worker;
+        pthread_t server;
+        sock_client_t client;
+        char *s, *end;
+        size_t i, j;
+        int opt, n, on = 1;
+
+        while ((opt = getopt(argc, argv, "p:r:n:s:h")) != -1) {
+                switch (opt) {
+                case 'p':
+                        port = strtoul(optarg, NULL, 10);
+                        break;
+                case 'r':
+                        nrep = atoi(optarg);
+                        break;
+                case 'n':
+                        scale = strtod(optarg, NULL);
+                        break;
+                case 's':
+                        for (nsize = 0, s = optarg; *s && nsize < BENCH_NSIZE_MAX; s = *end ? end + 1 : end) {
+                                size[nsize] = strtoul(s, &end, 0);
+                                if (end == s || size[nsize] == 0) {
+                                        usage(argv[0]);
+                                        return 1;
+                                }
+                                nsize++;
+                        }
+                        break;
+                default:
+                        usage(argv[0]);
+                        return opt != 'h';
+                }
+        }
+        if (nrep < 1 || scale <= 0 || nsize == 0) {
+                usage(argv[0]);
+                return 1;
+        }
+
+        for (i = 0; i < NBENCH; i++)
+                want[i] = optind == argc;
+        for (n = optind; n < argc; n++) {
+                for (i = 0; i < NBENCH && strcmp(benches[i].name, argv[n]) != 0; i++)
+                        ;
+                if (i == NBENCH) {
+                        fprintf(stderr, "%s: unknown benchmark %s\n", argv[0], argv[n]);
+                        return 1;
+                }
+                want[i] = true;
+        }
+
+        // Listening before the first connect; the worker listens on a port of
+        // its own, so every connect negotiates it
+        if (sock_server_ctor(&master, port, &worker) < 0 ||
+            setsockopt(master.fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 || // Back to back runs
+            sock_server_bind(&master) < 0 || sock_server_listen(&master) < 0) {
+                perror("bench server");
+                return 1;
+        }
+        if ((errno = pthread_create(&server, NULL, server_main, &master)) != 0) {
+                perror("pthread_create");
+                return 1;
+        }
+
+        printf("# libsockets bench: port %u, %d reps, scale %g\n", port, nrep, scale);
+        printf("bench\tsize\tops\tns_per_op\tsyscalls_per_op\tbytes_per_s\n");
+        fflush(stdout);
+
+        for (i = 0; i < NBENCH; i++) {
+                if (!want[i])
+                        continue;
+                for (j = 0; j < (benches[i].sized ? nsize : 1); j++)
+                        bench_one(&benches[i], benches[i].sized ? size[j] : 0);
+        }
+
+        // Stop the server
+        if (session_open(&client, BENCH_QUIT) == 0)
+                sock_client_dtor(&client);
+        pthread_join(server, NULL);
+        sock_server_dtor(&master);
+
+        return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Benchmarks
+////////////////////////////////////////////////////////////////////////////////
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static size_t ops_buffer(size_t size_) { return clamp_ops(256 << 20, size_, 20, 200000); }
+static size_t ops_send(size_t size_) { return clamp_ops(256 << 20, size_, 200, 200000); }
+static size_t ops_rtt(size_t size_) { return clamp_ops(64 << 20, size_, 100, 20000); }
+static size_t ops_handshake(size_t size_) { return clamp_ops(0, 0, 1000, 1000); }
+
+//------------------------------------------------------------------------------
+// Grow ops_ empty buffers to size_ bytes. The pool keeps the blocks, so this
+// measures the doubling and copying rather than the allocator.
+//------------------------------------------------------------------------------
+static int run_buffer(size_t size_, size_t ops_, double *ns_, double *ntrans_)
+{
+        unsigned char data[BENCH_APPEND];
+        buffer_t buf;
+        size_t i, k;
+        double t;
+
+        memset(data, 0xa5, sizeof(data));
+
+        t = now_ns();
+        for (i = 0; i < ops_; i++) {
+                memset(&buf, 0, sizeof(buf));
+                buffer_ctor(&buf, 0);
+                for (k = 0; k < size_; k += BENCH_APPEND)
+                        buffer_append(&buf, data, size_ - k < BENCH_APPEND ? size_ - k : BENCH_APPEND);
+                if (buffer_dtor(&buf) < 0) {
+                        errno = EFAULT;
+                        return -1;
+                }
+        }
+        *ns_     = now_ns() - t;
+        *ntrans_ = NAN;
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Send ops_ messages, then wait for the server to have received them all
+//------------------------------------------------------------------------------
+static int run_send(size_t size_, size_t ops_, double *ns_, double *ntrans_)
+{
+        sock_client_t client;
+        void *msg;
+        size_t i, ntrans = 0, nserver;
+        double t;
+        int rc = -1;
+
+        if ((msg = calloc(1, size_)) == NULL)
+                return -1;
+        if (session_open(&client, BENCH_SINK) < 0)
+                goto fini;
+
+        t = now_ns();
+        for (i = 0; i < ops_; i++) {
+                if (sock_client_send(&client, msg, size_) < 0)
+                        goto close;
+                ntrans += client.ntrans;
+        }
+        if (session_count(&client, &nserver) < 0)
+                goto close;
+        *ns_     = now_ns() - t;
+        *ntrans_ = ntrans + nserver;
+        rc       = 0;
+
+close:
+        session_close(&client);
+fini:
+        free(msg);
+        return rc;
+}
+
+//------------------------------------------------------------------------------
+// ops_ round trips of a size_ byte message
+//------------------------------------------------------------------------------
+static int run_rtt(size_t size_, size_t ops_, double *ns_, double *ntrans_)
+{
+        sock_client_t client;
+        void *msg, *reply;
+        size_t i, len, ntrans = 0, nserver;
+        double t;
+        int rc = -1;
+
+        if ((msg = calloc(1, size_)) == NULL)
+                return -1;
+        if (session_open(&client, BENCH_ECHO) < 0)
+                goto fini;
+
+        t = now_ns();
+        for (i = 0; i < ops_; i++) {
+                if (sock_client_send(&client, msg, size_) < 0)
+                        goto close;
+                ntrans += client.ntrans;
+                if (sock_client_recv(&client, &reply, &len) < 0)
+                        goto close;
+                ntrans += client.ntrans;
+        }
+        *ns_ = now_ns() - t;
+
+        if (session_count(&client, &nserver) < 0)
+                goto close;
+        *ntrans_ = ntrans + nserver;
+        rc       = 0;
+
+close:
+        session_close(&client);
+fini:
+        free(msg);
+        return rc;
+}
+
+//------------------------------------------------------------------------------
+// Connect ops_ times; only the connect (and its worker port round trip and
+// second connect) is timed
+//------------------------------------------------------------------------------
+static int run_handshake(size_t size_, size_t ops_, double *ns_, double *ntrans_)
+{
+        sock_client_t client;
+        size_t i;
+        double t;
+        int n;
+
+        *ns_ = 0;
+        for (i = 0; i < ops_; i++) {
+                if (sock_client_ctor(&client, "127.0.0.1", port) < 0)
+                        return -1;
+                t = now_ns();
+                n = sock_client_connect(&client, 0);
+                *ns_ += now_ns() - t;
+                sock_client_dtor(&client);
+                if (n < 0)
+                        return -1;
+        }
+        *ntrans_ = NAN;
+
+        return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Server
+////////////////////////////////////////////////////////////////////////////////
+
+//------------------------------------------------------------------------------
+// Serve one connection at a time on the listening server arg_ until told to
+// quit
+//------------------------------------------------------------------------------
+static void *server_main(void *arg_)
+{
+        sock_server_t *master = arg_;
+        int n = 0;
+
+        while (n != BENCH_QUIT) {
+                if (sock_server_accept(master) < 0) {
+                        perror("bench server accept");
+                        exit(1);
+                }
+                n = server_session(master);
+
+                // As the parent of a forked worker would: the next connect
+                // gets a fresh worker port
+                comm_channel_close(master->worker->cc_client);
+                comm_channel_close(master->cc_client);
+                close(master->worker->fd);
+                master->worker->fd = 0;
+        }
+
+        return NULL;
+}
+
+//------------------------------------------------------------------------------
+// Returns the session mode once the client disconnects
+//------------------------------------------------------------------------------
+static int server_session(sock_server_t *server_)
+{
+        size_t len, ntrans = 0;
+        void *msg;
+        char mode;
+
+        if (sock_server_recv(server_, &msg, &len) < 0 || len != 1) // Handshake only
+                return 0;
+        mode = *(char *)msg;
+
+        while (mode != BENCH_QUIT && sock_server_recv(server_, &msg, &len) >= 0) {
+                ntrans += server_->worker->ntrans;
+                if (len == 0) {
+                        if (sock_server_send(server_, &ntrans, sizeof(ntrans)) < 0)
+                                break;
+                        ntrans = 0;
+                } else if (mode == BENCH_ECHO) {
+                        if (sock_server_send(server_, msg, len) < 0)
+                                break;
+                        ntrans += server_->worker->ntrans;
+                }
+        }
+        return mode;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static int session_open(sock_client_t *client_, char mode_)
+{
+        if (sock_client_ctor(client_, "127.0.0.1", port) < 0)
+                return -1;
+        if (sock_client_connect(client_, 0) < 0 || sock_client_send(client_, &mode_, 1) < 0) {
+                sock_client_dtor(client_);
+                return -1;
+        }
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Fetch (and reset) the number of transfers made by the server so far; the
+// request itself is not counted
+//------------------------------------------------------------------------------
+static int session_count(sock_client_t *client_, size_t *ntrans_)
+{
+        void *msg;
+        size_t len;
+
+        if (sock_client_send(client_, NULL, 0) < 0 || sock_client_recv(client_, &msg, &len) < 0)
+                return -1;
+        if (len != sizeof(*ntrans_)) {
+                errno = EPROTO;
+                return -1;
+        }
+        memcpy(ntrans_, msg, sizeof(*ntrans_));
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static void session_close(sock_client_t *client_) { sock_client_dtor(client_); }
+
+////////////////////////////////////////////////////////////////////////////////
+// Helper Procedures
+////////////////////////////////////////////////////////////////////////////////
+
+//------------------------------------------------------------------------------
+// Operations moving about bytes_ bytes in size_ byte pieces, within min_ and
+// max_ before scaling
+//------------------------------------------------------------------------------
+static size_t clamp_ops(size_t bytes_, size_t size_, size_t min_, size_t max_)
+{
+        size_t n = size_ ? bytes_ / size_ : max_;
+
+        if (n < min_)
+                n = min_;
+        if (n > max_)
+                n = max_;
+        n = n * scale;
+        return n ? n : 1;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static double now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static int cmp_double(const void *a_, const void *b_)
+{
+        double a = *(const double *)a_, b = *(const double *)b_;
+
+        return (a > b) - (a < b);
+}
+
+//------------------------------------------------------------------------------
+// Warm up, run nrep times and print the median
+//------------------------------------------------------------------------------
+static void bench_one(const bench_t *bench_, size_t size_)
+{
+        size_t ops = bench_->ops(size_);
+        double ns[nrep], ntrans[nrep], med, t, x;
+        int i;
+
+        if (bench_->run(size_, ops / 10 ? ops / 10 : 1, &t, &x) < 0) {
+                fprintf(stderr, "%s %zu: %s\n", bench_->name, size_, strerror(errno));
+                return;
+        }
+
+        for (i = 0; i < nrep; i++) {
+                if (bench_->run(size_, ops, &ns[i], &ntrans[i]) < 0) {
+                        fprintf(stderr, "%s %zu: %s\n", bench_->name, size_, strerror(errno));
+                        return;
+                }
+                ns[i] /= ops;
+                ntrans[i] /= ops;
+        }
+        qsort(ns, nrep, sizeof(ns[0]), cmp_double);
+        qsort(ntrans, nrep, sizeof(ntrans[0]), cmp_double);
+        med = ns[nrep / 2];
+
+        printf("%s\t%zu\t%zu\t%.1f\t%.2f\t%.0f\n", bench_->name, size_, ops, med, ntrans[nrep / 2],
+               size_ ? size_ * 1e9 / med : 0.0);
+        fflush(stdout);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static void usage(const char *prog_)
+{
+        fprintf(stderr,
+                "usage: %s [-p port] [-r reps] [-n scale] [-s size,...] [bench ...]\n"
+                "benchmarks: buffer send rtt handshake (default all)\n",
+                prog_);
+}
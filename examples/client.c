@@ -31,6 +31,8 @@
 #include "data_file.h"
 #include "global.h"
 
+#define ZEROCOPY_MIN (1024 * 1024) // Send messages from 1 MB up without copying the data
+
 size_t data_size = 0;
 size_t nelem     = 0;
 
@@ -43,6 +45,7 @@ void *send_data(void *args_)
         long int tid = (long int)args_;
         sock_client_t sock;
         data_file_t d;
+        struct iovec iov[2];
 
         char buffer[256];
         char *msg;
@@ -55,20 +58,28 @@ void *send_data(void *args_)
                 perror(buffer);
                 exit(errno);
         }
+        if (sock_client_zerocopy(&sock, ZEROCOPY_MIN) < 0)
+                perror("Zero-copy send unavailable");
 
+        memset(&d, 0, sizeof(d));
         d.size = data_size;
 
         sprintf(d.name, "data-%ld.bin", tid);
-        memcpy(data, &d, sizeof(d));
+
+        // File header and data go out as one message without copying them together
+        iov[0].iov_base = &d;
+        iov[0].iov_len  = sizeof(d);
+        iov[1].iov_base = data;
+        iov[1].iov_len  = d.size;
 
         printf("thread %ld: writing %zd bytes to %s...\n", tid, sizeof(d) + d.size, d.name);
 
-        if ((n = sock_client_send(&sock, data, sizeof(d) + d.size)) < 0) {
+        if ((n = sock_client_sendv(&sock, iov, 2)) < 0) {
                 sprintf(buffer, "thread %ld: unable to send data file", tid);
                 perror(buffer);
                 goto fini;
         }
-        printf("thread %ld: %zd:%zd:required %zd sends.\n", tid, n, sizeof(d) + d.size + sizeof(sock_tcp_header_t),
+        printf("thread %ld: %zd:%zd:required %zd sends.\n", tid, n, sizeof(d) + d.size,
                sock.ntrans);
 
         // memset(buffer,0,256);
@@ -80,6 +91,8 @@ void *send_data(void *args_)
         n = sock_client_recv(&sock, (void **)&msg, &msg_len);
         printf("thread %ld: recv %zd bytes: %s\n", tid, n, msg);
 
+        // data is shared by all threads and freed by main; make sure the kernel is done with it
+        sock_client_zerocopy_reap(&sock, -1);
         sock_client_dtor(&sock);
 
 fini:
@@ -106,14 +119,14 @@ int main(int argc, char *argv[])
         data_size   = 1024 * strtol(argv[3], NULL, 10);
 
         nelem = data_size / sizeof(size_t);
-        data  = malloc(data_size + sizeof(data_file_t));
+        data  = malloc(data_size);
 
         threads = calloc(nthread, sizeof(*threads));
 
         printf("data_size = %zd\n", data_size);
-        v = (size_t *)((data_file_t *)data + 1);
+        v = (size_t *)data;
 
-        memset(data, 0, data_size + sizeof(data_file_t));
+        memset(data, 0, data_size);
         for (j       = 0; j < nelem; j++)
                 v[j] = j;
 
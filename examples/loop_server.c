@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2016-2017,2019 Jason Graham <jgraham@compukix.net>
+ *
+ * This file is part of libsockets.
+ *
+ * libsockets is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * libsockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsockets.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+// Event loop version of server.c: all clients are served by one process
+// without forking. An optional argument gives the number of acceptor threads
+// (0 for one per core); by default a single loop is used.
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libsockets/sockets.h>
+
+#include "data_file.h"
+#include "global.h"
+
+static sock_loop_t loop;
+static sock_mt_server_t mt_server;
+static size_t nthread = 1;
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+void sigterm_handler(int sig)
+{
+        if (nthread == 1)
+                sock_loop_stop(&loop);
+        else
+                sock_mt_server_stop(&mt_server);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int on_msg(sock_loop_t *loop_, sock_conn_t *conn_, void *msg_, size_t len_)
+{
+        data_file_t d;
+        char msg[512];
+
+        if (len_ < sizeof(d)) {
+                fprintf(stderr, "ERROR short message of %zd bytes\n", len_);
+                return -1;
+        }
+
+        memcpy(&d, msg_, sizeof(d));
+        d.name[sizeof(d.name) - 1] = '\0';
+
+        sprintf(msg, "creating file %s of %zd MB ...", d.name, d.size / 1024 / 1024);
+        if (sock_conn_send(conn_, msg, strlen(msg) + 1) < 0)
+                return -1;
+
+        FILE *fd = fopen(d.name, "wb");
+        if (fd) {
+                fwrite((data_file_t *)msg_ + 1, 1, len_ - sizeof(d), fd);
+                fclose(fd);
+        }
+
+        sprintf(msg, "%s done", d.name);
+        if (sock_conn_send(conn_, msg, strlen(msg) + 1) < 0)
+                return -1;
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+        signal(SIGINT, sigterm_handler);
+        signal(SIGTERM, sigterm_handler);
+        signal(SIGPIPE, SIG_IGN);
+
+        if (argc > 1)
+                nthread = strtoul(argv[1], NULL, 10);
+
+        if (nthread == 1) {
+                if (sock_loop_ctor(&loop, PORTNO, on_msg, NULL) < 0) {
+                        perror("ERROR unable to construct loop");
+                        exit(errno);
+                }
+
+                sock_loop_run(&loop);
+
+                printf("Shutting down with %zd open connections\n", loop.nconn);
+                sock_loop_dtor(&loop);
+        } else {
+                if (sock_mt_server_ctor(&mt_server, PORTNO, nthread, on_msg, NULL) < 0) {
+                        perror("ERROR unable to construct server");
+                        exit(errno);
+                }
+
+                printf("Serving on %zd threads\n", mt_server.nthread);
+                sock_mt_server_run(&mt_server);
+                sock_mt_server_dtor(&mt_server);
+        }
+
+        return 0;
+}
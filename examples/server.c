@@ -20,15 +20,16 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <unistd.h>
 
 #include <libsockets/sockets.h>
@@ -36,29 +37,12 @@
 #include "data_file.h"
 #include "global.h"
 
-#define MAX_WORKER 7
+#define NUM_WORKER 7
 
-volatile sig_atomic_t wrk_count = 0;
-volatile sig_atomic_t run       = 1;
+static sock_prefork_t pool;
 
-static sock_server_t server;
-
-void fini();
-void wait_all();
-void reset_worker_counter();
-void worker_counter_error(const char *msg_);
 void sigterm_handler(int sig);
-void sigchld_handler(int sig);
-
-//------------------------------------------------------------------------------
-//
-//------------------------------------------------------------------------------
-void fini()
-{
-        if (server.flags & SOCK_SF_PARENT)
-                wait_all();
-        sock_server_dtor(&server);
-}
+int handle_client(sock_server_t *server_, void *arg_);
 
 //------------------------------------------------------------------------------
 //
@@ -76,64 +60,13 @@ bool check_data(size_t n_, const void *data_)
         return true;
 }
 
-//------------------------------------------------------------------------------
-//
-//------------------------------------------------------------------------------
-void wait_all()
-{
-        pid_t pid;
-        while (1) {
-                if ((pid = waitpid(-1, NULL, 0)) == -1)
-                        break;
-        }
-}
-
-//------------------------------------------------------------------------------
-//
-//------------------------------------------------------------------------------
-void reset_worker_counter()
-{
-        signal(SIGCHLD, SIG_IGN);
-        wait_all();
-        wrk_count = 0;
-        signal(SIGCHLD, sigchld_handler);
-}
-
-//------------------------------------------------------------------------------
-//
-//------------------------------------------------------------------------------
-void worker_counter_error(const char *msg_)
-{
-        fprintf(stderr, "ERROR in worker counter: %s: resetting counter\n", msg_);
-        reset_worker_counter();
-}
-
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
 void sigterm_handler(int sig)
 {
-        // Only the parent process respondes to signal
-        if (server.flags & SOCK_SF_PARENT) {
-                printf("Caught signal %d: finishing current jobs\n", sig);
-                fini();
-                exit(sig);
-        }
-}
-
-//------------------------------------------------------------------------------
-//
-//------------------------------------------------------------------------------
-void sigchld_handler(int sig)
-{
-        pid_t pid;
-        int status;
-        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-                wrk_count--;
-                printf("PID %d finished: wrk_count = %d\n", pid, wrk_count);
-                if (wrk_count < 0)
-                        worker_counter_error("worker_count < 0");
-        }
+        // Workers finish their current job before exiting
+        sock_prefork_stop(&pool);
 }
 
 void sys_error(const char *msg_)
@@ -143,99 +76,92 @@ void sys_error(const char *msg_)
 }
 
 //------------------------------------------------------------------------------
-//
+// Runs in a pool worker for each client connection
 //------------------------------------------------------------------------------
-int main(int argc, char *argv[])
+int handle_client(sock_server_t *server_, void *arg_)
 {
-
-        pid_t cpid;
+        pid_t cpid = getpid();
         size_t len;
         ssize_t n;
 
-        void *buffer;
-        char msg[256];
+        char msg[512];
 
         data_file_t d;
-        void *data;
-
-        sock_server_t worker;
+        void *data = MAP_FAILED;
+        int fd     = -1;
+        int rc     = -1;
 
-        signal(SIGCHLD, sigchld_handler);
-        signal(SIGINT, sigterm_handler);
-        signal(SIGTERM, sigterm_handler);
-        signal(SIGHUP, SIG_IGN);
-        // signal(SIGPIPE, SIG_IGN);
-
-        if (sock_server_ctor(&server, PORTNO, &worker) < 0)
-                sys_error("ERROR unable to construct server");
-        if (sock_server_bind(&server) < 0)
-                sys_error("ERROR unable to bind server");
-        if (sock_server_listen(&server) < 0)
-                sys_error("ERROR unable to listen on server");
+        printf("PID %d: receiving 1...\n", cpid);
 
-        while (1) {
-
-                if (sock_server_accept(&server) < 0)
-                        sys_error("ERROR unable to accept connection");
-
-                while (wrk_count == MAX_WORKER) {
-                        printf("Maximum workers reached: waiting...\n");
-                        sleep(5);
-                }
-
-                wrk_count++;
-                if (wrk_count > MAX_WORKER) {
-                        worker_counter_error("worker_count > MAX_WORKER");
-                }
-                pid_t fpid = sock_server_fork(&server);
-
-                if (fpid == 0) { // Child
-
-                        cpid = getpid();
+        // Receive the file header; the file data follows in the same message
+        n = sock_server_peek(server_, &len);
+        if (n < 0 || len < sizeof(d) || sock_server_recv_payload(server_, &d, sizeof(d)) < 0) {
+                printf("PID %d: ERROR %d recieving data\n", cpid, errno);
+                return -1;
+        }
+        d.name[sizeof(d.name) - 1] = '\0';
 
-                        printf("PID %d: receiving 1...\n", cpid);
+        printf("Here is the file name: %s\n", d.name);
 
-                        n = sock_server_recv(&server, &buffer, &len);
-                        if (n < 0) { // Error occured
-                                printf("PID %d: ERROR %d recieving data\n", cpid, errno);
-                                goto fini;
-                        }
+        sprintf(msg, "PID %d creating file %s of %zd MB ...", cpid, d.name, d.size / 1024 / 1024);
 
-                        memcpy(&d, buffer, sizeof(d));
-                        data = (void *)((data_file_t *)buffer + 1);
+        printf("PID %d sending 1...\n", cpid);
+        n = sock_server_send(server_, (void *)msg, strlen(msg) + 1);
+        if (n < 0) { // Error occured
+                printf("PID %d: ERROR %d sending data\n", cpid, errno);
+                goto fini;
+        }
 
-                        assert(check_data(d.size / sizeof(size_t), data));
+        // Stream the data straight into the file
+        if ((fd = open(d.name, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 ||
+            (len > sizeof(d) && sock_server_recv_to_fd(server_, fd, 0) < 0)) {
+                printf("PID %d: ERROR %d recieving data\n", cpid, errno);
+                goto fini;
+        }
 
-                        printf("Received %zd bytes in %zd transfers\n", len, server.worker->ntrans);
-                        printf("Here is the file name: %s\n", d.name);
+        printf("Received %zd bytes in %zd transfers\n", len, server_->worker->ntrans);
 
-                        sprintf(msg, "PID %d creating file %s of %zd MB ...", cpid, d.name, d.size / 1024 / 1024);
+        if (d.size > 0) {
+                data = mmap(NULL, d.size, PROT_READ, MAP_SHARED, fd, 0);
+                assert(data != MAP_FAILED);
+                assert(check_data(d.size / sizeof(size_t), data));
+        }
 
-                        printf("PID %d sending 1...\n", cpid);
-                        n = sock_server_send(&server, (void *)msg, strlen(msg) + 1);
-                        if (n < 0) { // Error occured
-                                printf("PID %d: ERROR %d sending data\n", cpid, errno);
-                                goto fini;
-                        }
+        printf("PID %d sending 2...\n", cpid);
+        sprintf(msg, "PID %d done", cpid);
+        n = sock_server_send(server_, (void *)msg, strlen(msg) + 1);
+        if (n < 0) { // Error occured
+                printf("PID %d: ERROR %d sending data\n", cpid, errno);
+                goto fini;
+        }
+        rc = 0;
+
+fini:
+        if (data != MAP_FAILED)
+                munmap(data, d.size);
+        if (fd >= 0)
+                close(fd);
+        return rc;
+}
 
-                        FILE *fd = fopen(d.name, "wb");
-                        fwrite(data, 1, d.size, fd);
-                        fclose(fd);
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+        signal(SIGINT, sigterm_handler);
+        signal(SIGTERM, sigterm_handler);
+        signal(SIGHUP, SIG_IGN);
+        // signal(SIGPIPE, SIG_IGN);
 
-                        printf("PID %d sending 2...\n", cpid);
-                        sprintf(msg, "PID %d done", cpid);
-                        n = sock_server_send(&server, (void *)msg, strlen(msg) + 1);
-                        if (n < 0) { // Error occured
-                                printf("PID %d: ERROR %d sending data\n", cpid, errno);
-                                goto fini;
-                        }
+        if (sock_prefork_ctor(&pool, PORTNO, NUM_WORKER, handle_client, NULL) < 0)
+                sys_error("ERROR unable to construct server");
 
-                fini:
-                        break;
-                }
-        }
+        if (sock_prefork_run(&pool) < 0)
+                perror("ERROR running server");
 
-        fini();
+        printf("Server finished: %zd workers started\n", pool.nspawn);
+        sock_prefork_dtor(&pool);
 
         return 0;
 }
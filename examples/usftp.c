@@ -20,25 +20,24 @@
 
 #define _MULTI_THREADED
 #define _GNU_SOURCE
-#include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <pthread.h>
-#include <signal.h>
-#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <unistd.h>
 
+#include <libsockets/sockets.h>
+
 #include "data_file.h"
 #include "global.h"
-#include "sock.h"
 
 int main(int argc, char *argv[])
 {
 
         sock_client_t sock;
         data_file_t header;
+        struct iovec iov;
+        struct stat st;
 
         char *server_name = NULL;
         char *file_name   = NULL;
@@ -46,18 +45,12 @@ int main(int argc, char *argv[])
         server_name = argv[1];
         file_name   = argv[2];
 
-        FILE *fd = fopen(file_name, "rb");
-        assert(fd);
-        fseek(fd, 0L, SEEK_END);
-        size_t file_len = ftell(fd);
-        fclose(fd);
-
         int fp = open(file_name, O_RDONLY);
-
-        void *data      = NULL;
-        int pagesize    = getpagesize();
-        size_t data_len = pagesize;
-        size_t read_len = 0;
+        if (fp < 0 || fstat(fp, &st) < 0) {
+                perror(file_name);
+                exit(errno);
+        }
+        size_t file_len = st.st_size;
 
         ssize_t n;
         char buffer[256];
@@ -78,30 +71,18 @@ int main(int argc, char *argv[])
 
         printf("writing file (%zd bytes) to %s on %s...\n", sizeof(header) + file_len, header.name, server_name);
 
-        if ((n = sock_client_send(&sock, &header, sizeof(header))) < 0) {
-                sprintf(buffer, "unable to send file header");
+        // The file header goes in front of the file contents, which are sent
+        // straight from the page cache
+        iov.iov_base = &header;
+        iov.iov_len  = sizeof(header);
+
+        if ((n = sock_client_sendfilev(&sock, &iov, 1, fp, 0, file_len)) < 0) {
+                sprintf(buffer, "unable to send data file");
                 perror(buffer);
                 goto fini;
         }
-#define min(a, b) ((a) < (b) ? (a) : (b))
-
-        int i = 0;
-        while (1) {
-                printf("i = %d", i++);
-                // Map one page at a time
-                data = mmap(data, file_len, PROT_READ, MAP_PRIVATE, fp, 0);
-                assert(data);
-
-                if ((n = sock_client_send(&sock, data, file_len)) < 0) {
-                        sprintf(buffer, "unable to send data file");
-                        perror(buffer);
-                        goto fini;
-                }
-                munmap(data, file_len);
-                read_len += data_len;
-        }
 
-        printf("%zd:%zd:required %zd sends.\n", sizeof(header) + file_len, sizeof(sock_tcp_header_t), sock.ntrans);
+        printf("%zd:%zd:required %zd sends.\n", n, sizeof(header) + file_len, sock.ntrans);
 
         // memset(buffer,0,256);
         n = sock_client_recv(&sock, (void **)&msg, &msg_len);
@@ -125,7 +106,7 @@ int main(int argc, char *argv[])
 
 fini:
 
-        munmap(data, data_len);
+        close(fp);
 
         return 0;
 }
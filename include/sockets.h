@@ -26,31 +26,108 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <signal.h>
+#include <pthread.h>
 #include <sys/types.h> 
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 
 #include <stdint.h>
 
 #define SOCK_OPTS_REQ_WPORT 0b0001
 #define SOCK_OPTS_SIGTERM   0b0010
+#define SOCK_OPTS_CHUNK     0b0100 // Message is one chunk of a stream
+#define SOCK_OPTS_EOS       0b1000 // Last chunk of a stream
+#define SOCK_OPTS_HDR_V2    0b10000 // Worker port request/reply: use the v2 wire header
+#define SOCK_OPTS_SHM       0b100000 // Worker port request/reply: move the data to shared memory rings
+#define SOCK_OPTS_COMP      0b1000000 // Payload is compressed; worker port request/reply: compression agreed
+#define SOCK_OPTS_CRC       0b10000000 // Worker port request/reply: CRC32C trailers agreed
+
+#define SOCK_HF_SID 0b0100 // Header carries a stream id (v2 header only)
+#define SOCK_HF_CRC 0b1000 // Payload is followed by its CRC32C (v2 header only)
+
+#define SOCK_UNIX_PREFIX "unix:" // Unix domain address: "unix:/path" or "unix:@abstract-name"
+#define SOCK_SHM_PREFIX "shm:"   // Same, with the data going through shared memory: "shm:/path"
+
+#define SOCK_MSG_MAX ((uint64_t)1 << 30) // Default limit on a received payload held in memory
+
+#define SOCK_BUF_AUTO (-1) // sock_opts_t buffer: size from the bandwidth-delay product
+
+#define SOCK_CODEC_LZ 1 // Id of the built-in "lz" codec
 
 #define SOCK_SF_PARENT 0b0001
 #define SOCK_SF_MASTER 0b0010
 #define SOCK_SF_WORKER 0b0100
 
+#define SOCK_WS_START 0 // Pre-forked worker starting up
+#define SOCK_WS_IDLE  1 // Pre-forked worker waiting for a connection
+#define SOCK_WS_BUSY  2 // Pre-forked worker serving a connection
+
+#define SOCK_ASYNC_SEND 1 // Completed sock_async_send
+#define SOCK_ASYNC_RECV 2 // Completed sock_async_recv
+
 // Forward declarations
 typedef struct comm_channel_s comm_channel_t;
+typedef struct sock_conn_s sock_conn_t;
+typedef struct sock_loop_s sock_loop_t;
+typedef struct sock_mux_stream_s sock_mux_stream_t;
+typedef struct sock_async_op_s sock_async_op_t;
+
+// Event loop message handler; called once for every complete message received
+// on conn_. A negative return value closes the connection.
+typedef int (*sock_loop_fn_t)(sock_loop_t *loop_, sock_conn_t *conn_, void *msg_, size_t len_);
+
+// Name resolution completion handler; addr_ is NULL and err_ the errno value
+// if name_ could not be resolved
+typedef void (*sock_resolve_fn_t)(const char *name_, const struct in_addr *addr_, int err_, void *arg_);
 
+// Message header. This is the decoded form; on the wire it is either the v1
+// header (32-bit length, 4GB limit) or, when both ends agree to it in the
+// worker port handshake, the compact v2 header.
 typedef struct sock_tcp_header_s {
-	uint32_t msg_len; // Length of message (limited to 4GB)
-	unsigned char opts; // Bit vector of options
+	uint64_t msg_len;    // Length of message
+	unsigned char opts;  // Bit vector of options
+	unsigned char flags; // SOCK_HF_* bits (v2 only)
+	uint32_t stream_id;  // Stream id if flags has SOCK_HF_SID
 } sock_tcp_header_t;
 
+// Socket address of either transport
+typedef union sock_addr_u {
+	struct sockaddr sa;
+	struct sockaddr_in in; // TCP
+	struct sockaddr_un un; // Unix domain (path or abstract name)
+} sock_addr_t;
+
+// Socket tuning profile (see sock_opts_profile); zero fields keep the system
+// setting
+typedef struct sock_opts_s {
+	bool nodelay;        // TCP_NODELAY
+	int sndbuf;          // SO_SNDBUF bytes, or SOCK_BUF_AUTO
+	int rcvbuf;          // SO_RCVBUF bytes, or SOCK_BUF_AUTO
+	uint64_t rate;       // Path bandwidth (bytes/s) SOCK_BUF_AUTO buffers are sized for
+	int notsent_lowat;   // TCP_NOTSENT_LOWAT bytes
+	int keepalive;       // SO_KEEPALIVE with this idle time (s)
+	int backlog;         // Listen backlog (0: the server's default)
+	char congestion[16]; // TCP_CONGESTION algorithm ("" keeps the default)
+} sock_opts_t;
+
+// Message compression codec. Both functions return the output length, or -1
+// if the output would not fit in cap_ bytes (compress) or in_ is corrupt
+// (decompress).
+typedef struct sock_codec_s {
+	const char *name;
+	unsigned char id;    // Wire id (1..255), the same at both ends
+	ssize_t (*compress)(const void *in_, size_t len_, void *out_, size_t cap_);
+	ssize_t (*decompress)(const void *in_, size_t len_, void *out_, size_t cap_);
+} sock_codec_t;
+
 typedef struct sock_server_s {
 	unsigned char flags;
 	int fd;
-	struct sockaddr_in addr;
+	sock_addr_t addr;
+	socklen_t addr_len;
 	comm_channel_t *cc_client;
 	size_t ntrans;
 	struct sock_server_s *worker;
@@ -58,12 +135,118 @@ typedef struct sock_server_s {
 
 typedef struct sock_client_s {
 	char *server_name;
-	struct hostent *server_host;
+	sock_addr_t server_addr;
+	socklen_t server_addr_len;
+	bool shm;               // Offer the shared memory transport (SOCK_SHM_PREFIX address)
 	comm_channel_t *cc_master;
 	comm_channel_t *cc_worker;
 	size_t ntrans;
 } sock_client_t;
 
+typedef struct sock_client_pool_s {
+	sock_client_t *client;  // Pooled clients
+	unsigned char *state;   // Connection state of each client
+	uint32_t *next;         // Idle stack links (slot + 1; 0 ends the stack)
+	uint64_t head;          // Idle stack top: update tag << 32 | (slot + 1)
+	size_t nclient;         // Pool size
+} sock_client_pool_t;
+
+struct sock_loop_s {
+	int epfd;                    // epoll instance
+	int wakefd;                  // eventfd used to interrupt epoll_wait
+	sock_server_t server;        // Listening socket
+	sock_loop_fn_t on_msg;       // Message handler
+	void *arg;                   // User data for the handler
+	size_t nconn;                // Number of open connections
+	sock_conn_t *conn;           // List of open connections
+	uint64_t msg_max;            // Longest message accepted (0: SOCK_MSG_MAX)
+	int spare_fd;                // Reserve descriptor, given up to turn clients away when out of them
+	bool paused;                 // Listener out of epoll until a connection closes
+	volatile sig_atomic_t run;   // Cleared by sock_loop_stop
+};
+
+typedef struct sock_mt_server_s {
+	size_t nthread;       // Number of acceptor threads
+	sock_loop_t *loop;    // One event loop (and SO_REUSEPORT listener) per thread
+	pthread_t *thread;    // Threads running loop[1..nthread-1]
+	unsigned short port;  // Listening port shared by all loops
+} sock_mt_server_t;
+
+// Pre-forked worker connection handler; server_ is the worker's view of the
+// connection and is used with sock_server_send/sock_server_recv. The
+// connection is closed when the handler returns.
+typedef int (*sock_prefork_fn_t)(sock_server_t *server_, void *arg_);
+
+typedef struct sock_prefork_worker_s {
+	pid_t pid;  // Worker process (0 if the slot is empty)
+	int fd;     // Master end of the control socket (-1 once closed)
+	int state;  // SOCK_WS_* state
+} sock_prefork_worker_t;
+
+typedef struct sock_prefork_s {
+	sock_server_t server;           // Listening socket; connection view in workers
+	unsigned short port;            // Listening port
+	size_t nworker;                 // Pool size
+	sock_prefork_worker_t *worker;  // Worker slots (master only)
+	size_t nidle;                   // Workers waiting for a connection
+	size_t nbusy;                   // Workers serving a connection
+	size_t nspawn;                  // Workers started, including restarts
+	sock_prefork_fn_t handler;      // Connection handler run in the workers
+	void *arg;                      // User data for the handler
+	volatile sig_atomic_t run;      // Cleared by sock_prefork_stop
+} sock_prefork_t;
+
+typedef struct sock_mux_s {
+	comm_channel_t *cc;             // Shared connection (owned by the client/server)
+	size_t frag_len;                // Largest fragment sent at once
+	uint32_t next_id;               // Next id given out by sock_mux_open
+	pthread_mutex_t tx_lock;
+	pthread_cond_t tx_cond;
+	uint64_t tx_ticket;             // Next send ticket to hand out
+	uint64_t tx_serving;            // Ticket allowed to send its fragment
+	pthread_mutex_t rx_lock;        // Protects the stream table and ready list
+	pthread_cond_t rx_cond;         // Signalled after every frame read
+	bool rx_reading;                // A receiving thread is reading the socket
+	int rx_err;                     // errno of a failed read (connection unusable)
+	sock_mux_stream_t **table;      // Streams by id (chained hash table)
+	size_t table_len;               // Number of buckets (power of 2)
+	size_t nstream;                 // Streams in the table
+	sock_mux_stream_t *ready;       // Streams with complete messages, oldest first
+	sock_mux_stream_t *ready_tail;
+} sock_mux_t;
+
+// Completion of an asynchronous operation
+typedef struct sock_async_cqe_s {
+	void *tag;  // Tag given when the operation was submitted
+	int op;     // SOCK_ASYNC_SEND or SOCK_ASYNC_RECV
+	int err;    // 0 on success, else the errno value of the failure
+	void *data; // Received message (SOCK_ASYNC_RECV)
+	size_t len; // Length of the message sent or received
+} sock_async_cqe_t;
+
+typedef struct sock_async_s {
+	comm_channel_t *cc;             // Connection (owned by the client)
+	int efd;                        // eventfd readable while completions are queued
+	size_t depth;                   // Most operations submitted and not yet reaped
+	sock_async_op_t *ops;           // Operation slots
+	sock_async_op_t *free_ops;      // Unused slots
+	pthread_mutex_t lock;           // Protects the queues
+	pthread_cond_t tx_cond;         // Signalled when a send is queued
+	pthread_cond_t rx_cond;         // Signalled when a receive is queued
+	pthread_t tx_thread;            // Performs the sends in order
+	pthread_t rx_thread;            // Performs the receives in order
+	sock_async_op_t *tx_head;       // Queued sends
+	sock_async_op_t *tx_tail;
+	sock_async_op_t *rx_head;       // Queued receives
+	sock_async_op_t *rx_tail;
+	sock_async_op_t *cq_head;       // Completions, oldest first
+	sock_async_op_t *cq_tail;
+	bool tx_busy;                   // A send is in progress
+	bool rx_busy;                   // A receive is in progress
+	bool stop;                      // Set by sock_async_dtor
+	int err;                        // errno of the failure that broke the connection
+} sock_async_t;
+
 //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 /// sock_server_t
 //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
@@ -73,6 +256,17 @@ typedef struct sock_client_s {
 //------------------------------------------------------------------------------
 int sock_server_ctor( sock_server_t *this_, unsigned short port_, sock_server_t *worker_ );
 
+//------------------------------------------------------------------------------
+// Construct a server on the Unix domain address addr_ ("unix:/path", or
+// "unix:@name" in the abstract namespace). Clients connect with the same
+// address string. There is no worker port: the worker takes over the
+// connection accepted by the master. A path is unlinked before binding and
+// when the (parent) master is destroyed. Clients connecting with the
+// "shm:" form of the address have their messages carried by a pair of
+// shared memory rings instead of the socket.
+//------------------------------------------------------------------------------
+int sock_server_ctor_unix( sock_server_t *this_, const char *addr_, sock_server_t *worker_ );
+
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
@@ -103,11 +297,194 @@ int sock_server_fork( sock_server_t *this_ );
 //------------------------------------------------------------------------------
 ssize_t sock_server_send( sock_server_t *this_, const void *msg_, size_t len_ );
 
+//------------------------------------------------------------------------------
+// Send the iovec segments as a single message; the header and all segments go
+// out in one sendmsg whenever the socket accepts them
+//------------------------------------------------------------------------------
+ssize_t sock_server_sendv( sock_server_t *this_, const struct iovec *iov_, int iovcnt_ );
+
+//------------------------------------------------------------------------------
+// Batch small sends: messages shorter than len_ bytes (header included) are
+// queued and sent together with one sendmsg when the next would take the
+// batch past len_ bytes, when the oldest has waited ms_ ms (checked on each
+// send; 0 for no limit), on sock_server_flush, or before a receive waits.
+// An idle sender polls with sock_server_batch_timeout to keep the age limit.
+// cork_ sends each batch with TCP_CORK set. A len_ of 0 turns batching off.
+// Returns -1 if flushing the current batch fails.
+//------------------------------------------------------------------------------
+int sock_server_batch( sock_server_t *this_, size_t len_, int ms_, bool cork_ );
+
+//------------------------------------------------------------------------------
+// Send the batched messages now
+//------------------------------------------------------------------------------
+ssize_t sock_server_flush( sock_server_t *this_ );
+
+//------------------------------------------------------------------------------
+// Milliseconds until the oldest batched message reaches the age limit: 0 if
+// it has, -1 if nothing is batched or there is no limit. Usable as a poll(2)
+// timeout, after which sock_server_flush is due.
+//------------------------------------------------------------------------------
+int sock_server_batch_timeout( const sock_server_t *this_ );
+
+//------------------------------------------------------------------------------
+// Send len_ bytes of the file fd_ starting at offset_ as a single message; the
+// file data is moved with sendfile and never copied through user space. The
+// file offset of fd_ is not changed.
+//------------------------------------------------------------------------------
+ssize_t sock_server_sendfile( sock_server_t *this_, int fd_, off_t offset_, size_t len_ );
+
+//------------------------------------------------------------------------------
+// As sock_server_sendfile, with the iovec segments sent ahead of the file data
+// in the same message (e.g. a file description header)
+//------------------------------------------------------------------------------
+ssize_t sock_server_sendfilev( sock_server_t *this_, const struct iovec *iov_, int iovcnt_,
+			   int fd_, off_t offset_, size_t len_ );
+
+//------------------------------------------------------------------------------
+// Send messages with a payload of at least threshold_ bytes with MSG_ZEROCOPY
+// (0 disables). The kernel then reads the payload straight from the caller's
+// memory after the send returns, so the buffers must not be modified or freed
+// until sock_server_zerocopy_reap reports them released. Not used with the
+// io_uring backend. Returns -1 if the kernel or socket lacks zero-copy.
+//------------------------------------------------------------------------------
+int sock_server_zerocopy( sock_server_t *this_, size_t threshold_ );
+
+//------------------------------------------------------------------------------
+// Collect zero-copy completions, waiting up to timeout_ ms for them (0 does not
+// wait, -1 waits until all are in). Returns the number of zero-copy sends
+// still holding caller memory; once 0, all sent buffers may be reused.
+//------------------------------------------------------------------------------
+ssize_t sock_server_zerocopy_reap( sock_server_t *this_, int timeout_ );
+
+//------------------------------------------------------------------------------
+// Give the following sends and receives until timeout_ ms from now to
+// complete; once it has passed they fail with errno ETIMEDOUT (a negative
+// timeout_ removes the deadline). The socket is polled rather than blocked
+// on. A message cut short leaves the connection out of step; it should then
+// be closed.
+//------------------------------------------------------------------------------
+int sock_server_deadline( sock_server_t *this_, int timeout_ );
+
+//------------------------------------------------------------------------------
+// Bytes sent and received since the last sock_server_deadline, including
+// those of a transfer that timed out
+//------------------------------------------------------------------------------
+size_t sock_server_nbytes( const sock_server_t *this_ );
+
+//------------------------------------------------------------------------------
+// Limit, for every connection accepted from now on, the wait for the header of
+// each incoming message to idle_ ms and each send and payload receive to xfer_
+// ms (0 for no limit). A limit that is exceeded fails the call with errno
+// ETIMEDOUT. A deadline set with sock_server_deadline takes precedence.
+//------------------------------------------------------------------------------
+int sock_server_timeouts( sock_server_t *this_, int idle_, int xfer_ );
+
+//------------------------------------------------------------------------------
+// Refuse, on every connection accepted from now on, to buffer a payload
+// longer than max_ bytes (0 restores SOCK_MSG_MAX): a receive into library
+// memory (recv, read_chunk, recv_batch, sock_mux_t, decompression) fails with
+// errno EMSGSIZE before anything is allocated, and the connection should be
+// closed. recv_to_fd and recv_into take any length.
+//------------------------------------------------------------------------------
+int sock_server_msg_max( sock_server_t *this_, uint64_t max_ );
+
+//------------------------------------------------------------------------------
+// Tune the listening socket(s) and every connection accepted from now on
+// with opts_ (by default the profile set with sock_opts_set_default). Call it
+// before sock_server_listen for the backlog to take effect. Returns -1 if a
+// setting was refused (e.g. an unavailable congestion algorithm); the others
+// are still applied.
+//------------------------------------------------------------------------------
+int sock_server_opts( sock_server_t *this_, const sock_opts_t *opts_ );
+
+//------------------------------------------------------------------------------
+// Compress the messages sent on connections accepted from now on with the
+// registered codec codec_ (NULL disables it) when they are at least min_
+// bytes and the client agreed to compression in the handshake. Compressed
+// messages are received transparently either way. Fails with EINVAL for an
+// unknown codec.
+//------------------------------------------------------------------------------
+int sock_server_compress( sock_server_t *this_, const char *codec_, size_t min_ );
+
+//------------------------------------------------------------------------------
+// Follow every non-empty message sent on connections accepted from now on
+// with the CRC32C of its payload, if the client agreed to it in the handshake
+// (which requires the v2 header). Trailers are verified whenever they are
+// received, a mismatch failing the receive with errno EBADMSG.
+//------------------------------------------------------------------------------
+int sock_server_checksum( sock_server_t *this_, bool on_ );
+
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
 ssize_t sock_server_recv( sock_server_t *this_, void **msg_, size_t *len_ );
 
+//------------------------------------------------------------------------------
+// Receive the next message into the caller's buffer data_ of cap_ bytes,
+// bypassing the internal buffer. *len_ is set to the message length. If the
+// message does not fit, -1 is returned with errno EMSGSIZE and only the
+// header has been consumed; the payload is then read with
+// sock_server_recv_payload.
+//------------------------------------------------------------------------------
+ssize_t sock_server_recv_into( sock_server_t *this_, void *data_, size_t cap_, size_t *len_ );
+
+//------------------------------------------------------------------------------
+// Receive up to n_ messages at once: the next message (waiting for it like
+// sock_server_recv) plus every further one that has already arrived. msg_[i]
+// is set to each message, which stays valid until the next receive. Returns
+// the number of messages. Chunked streams are read with
+// sock_server_read_chunk; a batch stops before them.
+//------------------------------------------------------------------------------
+ssize_t sock_server_recv_batch( sock_server_t *this_, struct iovec *msg_, size_t n_ );
+
+//------------------------------------------------------------------------------
+// Read the header of the next message and set *len_ to its payload length
+// without reading the payload (repeated calls return the same message)
+//------------------------------------------------------------------------------
+ssize_t sock_server_peek( sock_server_t *this_, size_t *len_ );
+
+//------------------------------------------------------------------------------
+// Read the next len_ bytes of the peeked message payload into data_; may be
+// called repeatedly until the whole payload has been read
+//------------------------------------------------------------------------------
+ssize_t sock_server_recv_payload( sock_server_t *this_, void *data_, size_t len_ );
+
+//------------------------------------------------------------------------------
+// Start sending a stream: a logical message of unbounded length sent as a
+// sequence of chunks, each received separately. Only chunks may be sent until
+// sock_server_stream_end.
+//------------------------------------------------------------------------------
+int sock_server_stream_begin( sock_server_t *this_ );
+
+//------------------------------------------------------------------------------
+// Send the next chunk of the stream (chunks over 4GB are split)
+//------------------------------------------------------------------------------
+ssize_t sock_server_write_chunk( sock_server_t *this_, const void *data_, size_t len_ );
+
+//------------------------------------------------------------------------------
+// Mark the end of the stream
+//------------------------------------------------------------------------------
+ssize_t sock_server_stream_end( sock_server_t *this_ );
+
+//------------------------------------------------------------------------------
+// Iterate over the chunks of an incoming stream: returns 1 with the next chunk
+// in *data_ (valid until the next receive) and its length in *len_, 0 at the
+// end of the stream and -1 on error. A plain message is returned as a stream
+// of one chunk.
+//------------------------------------------------------------------------------
+int sock_server_read_chunk( sock_server_t *this_, void **data_, size_t *len_ );
+
+//------------------------------------------------------------------------------
+// Write the payload of the next message, or what remains of a peeked one, to
+// the file fd_ at offset_ without buffering it in user memory (splice through
+// a pipe). The file is pre-allocated for the payload. If fd_ was opened with
+// O_DIRECT (offset_ must then be block aligned), the data is received into
+// two aligned buffers which are written in turn while the next one fills.
+// Returns the number of bytes received. Note that once a peeked payload has
+// been fully read, the next message is received.
+//------------------------------------------------------------------------------
+ssize_t sock_server_recv_to_fd( sock_server_t *this_, int fd_, off_t offset_ );
+
 
 ////////////////////////////////////////////////////////////////////////////////
 /// sock_client_t
@@ -148,15 +525,526 @@ int sock_client_reconnect( sock_client_t *this_ );
 //------------------------------------------------------------------------------
 ssize_t sock_client_send( sock_client_t *this_, const void *msg_, size_t len_ );
 
+//------------------------------------------------------------------------------
+// Send the iovec segments as a single message; the header and all segments go
+// out in one sendmsg whenever the socket accepts them
+//------------------------------------------------------------------------------
+ssize_t sock_client_sendv( sock_client_t *this_, const struct iovec *iov_, int iovcnt_ );
+
+//------------------------------------------------------------------------------
+// Batch small sends: messages shorter than len_ bytes (header included) are
+// queued and sent together with one sendmsg when the next would take the
+// batch past len_ bytes, when the oldest has waited ms_ ms (checked on each
+// send; 0 for no limit), on sock_client_flush, or before a receive waits.
+// An idle sender polls with sock_client_batch_timeout to keep the age limit.
+// cork_ sends each batch with TCP_CORK set. A len_ of 0 turns batching off.
+// May be set before connecting.
+// Returns -1 if flushing the current batch fails.
+//------------------------------------------------------------------------------
+int sock_client_batch( sock_client_t *this_, size_t len_, int ms_, bool cork_ );
+
+//------------------------------------------------------------------------------
+// Send the batched messages now
+//------------------------------------------------------------------------------
+ssize_t sock_client_flush( sock_client_t *this_ );
+
+//------------------------------------------------------------------------------
+// Milliseconds until the oldest batched message reaches the age limit: 0 if
+// it has, -1 if nothing is batched or there is no limit. Usable as a poll(2)
+// timeout, after which sock_client_flush is due.
+//------------------------------------------------------------------------------
+int sock_client_batch_timeout( const sock_client_t *this_ );
+
+//------------------------------------------------------------------------------
+// Send len_ bytes of the file fd_ starting at offset_ as a single message; the
+// file data is moved with sendfile and never copied through user space. The
+// file offset of fd_ is not changed.
+//------------------------------------------------------------------------------
+ssize_t sock_client_sendfile( sock_client_t *this_, int fd_, off_t offset_, size_t len_ );
+
+//------------------------------------------------------------------------------
+// As sock_client_sendfile, with the iovec segments sent ahead of the file data
+// in the same message (e.g. a file description header)
+//------------------------------------------------------------------------------
+ssize_t sock_client_sendfilev( sock_client_t *this_, const struct iovec *iov_, int iovcnt_,
+			   int fd_, off_t offset_, size_t len_ );
+
+//------------------------------------------------------------------------------
+// Send messages with a payload of at least threshold_ bytes with MSG_ZEROCOPY
+// (0 disables). The kernel then reads the payload straight from the caller's
+// memory after the send returns, so the buffers must not be modified or freed
+// until sock_client_zerocopy_reap reports them released. Not used with the
+// io_uring backend. May be set before connecting. Returns -1 if the kernel or
+// socket lacks zero-copy.
+//------------------------------------------------------------------------------
+int sock_client_zerocopy( sock_client_t *this_, size_t threshold_ );
+
+//------------------------------------------------------------------------------
+// Collect zero-copy completions, waiting up to timeout_ ms for them (0 does not
+// wait, -1 waits until all are in). Returns the number of zero-copy sends
+// still holding caller memory; once 0, all sent buffers may be reused.
+//------------------------------------------------------------------------------
+ssize_t sock_client_zerocopy_reap( sock_client_t *this_, int timeout_ );
+
+//------------------------------------------------------------------------------
+// Give the following sends and receives until timeout_ ms from now to
+// complete; once it has passed they fail with errno ETIMEDOUT (a negative
+// timeout_ removes the deadline). The deadline is cleared when the
+// connection is closed. A message cut short leaves the connection out of
+// step; it should then be reconnected.
+//------------------------------------------------------------------------------
+int sock_client_deadline( sock_client_t *this_, int timeout_ );
+
+//------------------------------------------------------------------------------
+// Bytes sent and received since the last sock_client_deadline, including
+// those of a transfer that timed out
+//------------------------------------------------------------------------------
+size_t sock_client_nbytes( const sock_client_t *this_ );
+
+//------------------------------------------------------------------------------
+// Tune the client sockets with opts_ (by default the profile set with
+// sock_opts_set_default); they are reapplied on reconnect and SOCK_BUF_AUTO
+// buffers are sized on every connect. Returns -1 if a setting was refused;
+// the others are still applied.
+//------------------------------------------------------------------------------
+int sock_client_opts( sock_client_t *this_, const sock_opts_t *opts_ );
+
+//------------------------------------------------------------------------------
+// Compress the messages sent to the server with the registered codec codec_
+// (NULL disables it) when they are at least min_ bytes and the server agreed
+// to compression in the handshake. Fails with EINVAL for an unknown codec.
+//------------------------------------------------------------------------------
+int sock_client_compress( sock_client_t *this_, const char *codec_, size_t min_ );
+
+//------------------------------------------------------------------------------
+// Follow every non-empty message sent to the server with the CRC32C of its
+// payload, if the server agreed to it in the handshake. See
+// sock_server_checksum.
+//------------------------------------------------------------------------------
+int sock_client_checksum( sock_client_t *this_, bool on_ );
+
+//------------------------------------------------------------------------------
+// Refuse messages from the server with a payload longer than max_ bytes (0
+// restores SOCK_MSG_MAX). See sock_server_msg_max.
+//------------------------------------------------------------------------------
+int sock_client_msg_max( sock_client_t *this_, uint64_t max_ );
+
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
 ssize_t sock_client_recv( sock_client_t *this_, void **msg_, size_t *len_ );
 
+//------------------------------------------------------------------------------
+// Receive the next message into the caller's buffer data_ of cap_ bytes,
+// bypassing the internal buffer. *len_ is set to the message length. If the
+// message does not fit, -1 is returned with errno EMSGSIZE and only the
+// header has been consumed; the payload is then read with
+// sock_client_recv_payload.
+//------------------------------------------------------------------------------
+ssize_t sock_client_recv_into( sock_client_t *this_, void *data_, size_t cap_, size_t *len_ );
+
+//------------------------------------------------------------------------------
+// Receive up to n_ messages at once: the next message (waiting for it like
+// sock_client_recv) plus every further one that has already arrived. msg_[i]
+// is set to each message, which stays valid until the next receive. Returns
+// the number of messages. Chunked streams are read with
+// sock_client_read_chunk; a batch stops before them.
+//------------------------------------------------------------------------------
+ssize_t sock_client_recv_batch( sock_client_t *this_, struct iovec *msg_, size_t n_ );
+
+//------------------------------------------------------------------------------
+// Read the header of the next message and set *len_ to its payload length
+// without reading the payload (repeated calls return the same message)
+//------------------------------------------------------------------------------
+ssize_t sock_client_peek( sock_client_t *this_, size_t *len_ );
+
+//------------------------------------------------------------------------------
+// Read the next len_ bytes of the peeked message payload into data_; may be
+// called repeatedly until the whole payload has been read
+//------------------------------------------------------------------------------
+ssize_t sock_client_recv_payload( sock_client_t *this_, void *data_, size_t len_ );
+
+//------------------------------------------------------------------------------
+// Start sending a stream: a logical message of unbounded length sent as a
+// sequence of chunks, each received separately. Only chunks may be sent until
+// sock_client_stream_end.
+//------------------------------------------------------------------------------
+int sock_client_stream_begin( sock_client_t *this_ );
+
+//------------------------------------------------------------------------------
+// Send the next chunk of the stream (chunks over 4GB are split)
+//------------------------------------------------------------------------------
+ssize_t sock_client_write_chunk( sock_client_t *this_, const void *data_, size_t len_ );
+
+//------------------------------------------------------------------------------
+// Mark the end of the stream
+//------------------------------------------------------------------------------
+ssize_t sock_client_stream_end( sock_client_t *this_ );
+
+//------------------------------------------------------------------------------
+// Iterate over the chunks of an incoming stream: returns 1 with the next chunk
+// in *data_ (valid until the next receive) and its length in *len_, 0 at the
+// end of the stream and -1 on error. A plain message is returned as a stream
+// of one chunk.
+//------------------------------------------------------------------------------
+int sock_client_read_chunk( sock_client_t *this_, void **data_, size_t *len_ );
+
+//------------------------------------------------------------------------------
+// Write the payload of the next message, or what remains of a peeked one, to
+// the file fd_ at offset_ without buffering it in user memory (splice through
+// a pipe). The file is pre-allocated for the payload. If fd_ was opened with
+// O_DIRECT (offset_ must then be block aligned), the data is received into
+// two aligned buffers which are written in turn while the next one fills.
+// Returns the number of bytes received. Note that once a peeked payload has
+// been fully read, the next message is received.
+//------------------------------------------------------------------------------
+ssize_t sock_client_recv_to_fd( sock_client_t *this_, int fd_, off_t offset_ );
+
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
 int sock_client_send_sigterm( sock_client_t *this_ );
 
+////////////////////////////////////////////////////////////////////////////////
+/// sock_client_pool_t
+///
+/// Fixed set of clients connected to one server and shared by any number of
+/// threads. Check-out and return are lock free; connections are made on first
+/// use and remade when the server has closed them, so established worker
+/// connections are reused across requests.
+////////////////////////////////////////////////////////////////////////////////
+
+//------------------------------------------------------------------------------
+// Construct nclient_ clients for the server; none is connected yet
+//------------------------------------------------------------------------------
+int sock_client_pool_ctor( sock_client_pool_t *this_, const char *server_host_, unsigned short server_port_,
+			   size_t nclient_ );
+
+//------------------------------------------------------------------------------
+// Destroy all clients; none may be checked out
+//------------------------------------------------------------------------------
+int sock_client_pool_dtor( sock_client_pool_t *this_ );
+
+//------------------------------------------------------------------------------
+// Check out a connected client for exclusive use by the caller. Returns NULL
+// with errno EAGAIN if all clients are in use, or with the connect error if
+// the connection could not be (re)made.
+//------------------------------------------------------------------------------
+sock_client_t *sock_client_pool_get( sock_client_pool_t *this_ );
+
+//------------------------------------------------------------------------------
+// Return a client checked out with sock_client_pool_get. The whole reply must
+// have been read; otherwise the client is reconnected before its next use.
+//------------------------------------------------------------------------------
+int sock_client_pool_put( sock_client_pool_t *this_, sock_client_t *client_ );
+
+////////////////////////////////////////////////////////////////////////////////
+/// Name resolution
+///
+/// Host names are resolved with getaddrinfo and cached process wide for a
+/// limited time, so clients constructed for the same server share a single
+/// lookup. All functions are thread safe.
+////////////////////////////////////////////////////////////////////////////////
+
+//------------------------------------------------------------------------------
+// Resolve name_ to an IPv4 address, from the cache if possible; concurrent
+// callers for the same name wait for one lookup. Fails with ENOENT if the
+// name does not exist.
+//------------------------------------------------------------------------------
+int sock_resolve( const char *name_, struct in_addr *addr_ );
+
+//------------------------------------------------------------------------------
+// Resolve name_ in the background and report the result to fn_ (called at
+// once on a cache hit, otherwise from a helper thread). fn_ may be NULL to
+// just warm the cache ahead of sock_client_ctor.
+//------------------------------------------------------------------------------
+int sock_resolve_async( const char *name_, sock_resolve_fn_t fn_, void *arg_ );
+
+//------------------------------------------------------------------------------
+// Set how long (seconds) resolved names are cached; 0 disables caching
+//------------------------------------------------------------------------------
+void sock_resolve_ttl( unsigned ttl_ );
+
+//------------------------------------------------------------------------------
+// Drop all cached names
+//------------------------------------------------------------------------------
+void sock_resolve_flush( void );
+
+////////////////////////////////////////////////////////////////////////////////
+/// Socket tuning
+///
+/// Every socket the library creates or accepts is tuned with a sock_opts_t
+/// profile: the process default, or the one given to sock_server_opts or
+/// sock_client_opts. Settings that cannot be applied to a new connection are
+/// skipped silently.
+////////////////////////////////////////////////////////////////////////////////
+
+//------------------------------------------------------------------------------
+// Fill this_ with the built-in profile name_: "default" (system settings),
+// "latency" (TCP_NODELAY, short unsent queue), "bulk" (buffers sized for the
+// bandwidth-delay product of a 10 Gbit/s path) or "wan" (as bulk for
+// 1 Gbit/s, with BBR and keepalive). Fails with EINVAL for other names.
+//------------------------------------------------------------------------------
+int sock_opts_profile( sock_opts_t *this_, const char *name_ );
+
+//------------------------------------------------------------------------------
+// Set the profile used by servers and clients constructed from now on (NULL
+// restores "default"). Not thread safe; set it at start-up.
+//------------------------------------------------------------------------------
+void sock_opts_set_default( const sock_opts_t *opts_ );
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+const sock_opts_t *sock_opts_default( void );
+
+////////////////////////////////////////////////////////////////////////////////
+/// Compression
+///
+/// Messages can be compressed per message: the header carries SOCK_OPTS_COMP
+/// and the payload starts with the codec id and the uncompressed length. A
+/// message is sent uncompressed when compression does not pay off. Custom
+/// codecs must be registered under the same id at both ends.
+////////////////////////////////////////////////////////////////////////////////
+
+//------------------------------------------------------------------------------
+// Make codec_ available for sock_*_compress and for decoding. Fails with
+// EINVAL for id 0 and EEXIST if another codec has the id. Not thread safe;
+// register codecs at start-up.
+//------------------------------------------------------------------------------
+int sock_codec_register( const sock_codec_t *codec_ );
+
+//------------------------------------------------------------------------------
+// Registered codec called name_ ("lz" is built in), or NULL
+//------------------------------------------------------------------------------
+const sock_codec_t *sock_codec_find( const char *name_ );
+
+//------------------------------------------------------------------------------
+// CRC32C of len_ bytes at data_, continuing from crc_ (0 to start), computed
+// with the crc32c instruction where the CPU has one. The checksum of
+// SOCK_HF_CRC trailers.
+//------------------------------------------------------------------------------
+uint32_t sock_crc32c( uint32_t crc_, const void *data_, size_t len_ );
+
+////////////////////////////////////////////////////////////////////////////////
+/// sock_loop_t
+///
+/// Single threaded, epoll based server. Connections are non-blocking and are
+/// driven by per-connection read/write state machines, so no process or
+/// worker socket is created per client. Clients connect with the regular
+/// sock_client_t API; the worker port request is answered with the loop port
+/// so the client reuses its master connection.
+////////////////////////////////////////////////////////////////////////////////
+
+//------------------------------------------------------------------------------
+// Construct the loop and start listening on port_
+//------------------------------------------------------------------------------
+int sock_loop_ctor( sock_loop_t *this_, unsigned short port_, sock_loop_fn_t on_msg_, void *arg_ );
+
+//------------------------------------------------------------------------------
+// Close all connections and the listening socket
+//------------------------------------------------------------------------------
+int sock_loop_dtor( sock_loop_t *this_ );
+
+//------------------------------------------------------------------------------
+// Dispatch events until sock_loop_stop is called (returns immediately if the
+// loop has already been stopped)
+//------------------------------------------------------------------------------
+int sock_loop_run( sock_loop_t *this_ );
+
+//------------------------------------------------------------------------------
+// Request sock_loop_run to return; safe to call from a signal handler
+//------------------------------------------------------------------------------
+void sock_loop_stop( sock_loop_t *this_ );
+
+//------------------------------------------------------------------------------
+// Close connections that send a message longer than max_ bytes (0 restores
+// SOCK_MSG_MAX) instead of buffering it; the other connections carry on
+//------------------------------------------------------------------------------
+int sock_loop_msg_max( sock_loop_t *this_, uint64_t max_ );
+
+//------------------------------------------------------------------------------
+// Queue a message on the connection; sent without blocking as the socket
+// becomes writable
+//------------------------------------------------------------------------------
+ssize_t sock_conn_send( sock_conn_t *conn_, const void *msg_, size_t len_ );
+
+//------------------------------------------------------------------------------
+// Close the connection once its queued messages have been sent
+//------------------------------------------------------------------------------
+int sock_conn_close( sock_conn_t *conn_ );
+
+////////////////////////////////////////////////////////////////////////////////
+/// sock_mt_server_t
+///
+/// Multi-threaded server: one sock_loop_t per thread, each with its own
+/// SO_REUSEPORT listener on the same port, so the kernel spreads incoming
+/// connections over the threads. Each connection stays on the thread that
+/// accepted it; the message handler is called concurrently from all threads.
+////////////////////////////////////////////////////////////////////////////////
+
+//------------------------------------------------------------------------------
+// Construct nthread_ loops listening on port_; nthread_ = 0 uses one per
+// core the process may run on (its affinity mask)
+//------------------------------------------------------------------------------
+int sock_mt_server_ctor( sock_mt_server_t *this_, unsigned short port_, size_t nthread_,
+			 sock_loop_fn_t on_msg_, void *arg_ );
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_mt_server_dtor( sock_mt_server_t *this_ );
+
+//------------------------------------------------------------------------------
+// Start the acceptor threads and run the first loop in the calling thread
+// until sock_mt_server_stop is called
+//------------------------------------------------------------------------------
+int sock_mt_server_run( sock_mt_server_t *this_ );
+
+//------------------------------------------------------------------------------
+// Stop all loops; safe to call from a signal handler
+//------------------------------------------------------------------------------
+void sock_mt_server_stop( sock_mt_server_t *this_ );
+
+//------------------------------------------------------------------------------
+// sock_loop_msg_max for every loop
+//------------------------------------------------------------------------------
+int sock_mt_server_msg_max( sock_mt_server_t *this_, uint64_t max_ );
+
+////////////////////////////////////////////////////////////////////////////////
+/// sock_prefork_t
+///
+/// Pool of pre-forked worker processes. The master accepts connections and
+/// passes each one to an idle worker over a Unix socket (SCM_RIGHTS); the
+/// worker answers the client request on that connection, so no worker port
+/// or extra connect is needed, and runs the handler. Workers report back when
+/// idle and are restarted by the master if they exit.
+////////////////////////////////////////////////////////////////////////////////
+
+//------------------------------------------------------------------------------
+// Construct the pool listening on port_; workers are started by
+// sock_prefork_run
+//------------------------------------------------------------------------------
+int sock_prefork_ctor( sock_prefork_t *this_, unsigned short port_, size_t nworker_,
+		       sock_prefork_fn_t handler_, void *arg_ );
+
+//------------------------------------------------------------------------------
+// Stop the workers (if in the master) and close the listening socket
+//------------------------------------------------------------------------------
+int sock_prefork_dtor( sock_prefork_t *this_ );
+
+//------------------------------------------------------------------------------
+// Run the master until sock_prefork_stop is called; the workers exit from
+// within this call and never return
+//------------------------------------------------------------------------------
+int sock_prefork_run( sock_prefork_t *this_ );
+
+//------------------------------------------------------------------------------
+// Request sock_prefork_run to return; safe to call from a signal handler.
+// Workers finish their current connection before exiting.
+//------------------------------------------------------------------------------
+void sock_prefork_stop( sock_prefork_t *this_ );
+
+////////////////////////////////////////////////////////////////////////////////
+/// sock_mux_t
+///
+/// Independent logical streams over one client/worker connection. Frames
+/// carry a stream id in the v2 header, so the connection must have agreed to
+/// it in the handshake. Messages are sent as fragments of at most frag_len
+/// bytes and concurrent senders take turns per fragment, so a large message
+/// does not hold up the other streams. Receiving threads share the socket:
+/// whichever is idle reads frames for all of them.
+////////////////////////////////////////////////////////////////////////////////
+
+//------------------------------------------------------------------------------
+// Multiplex the worker connection of a connected client (stream ids given out
+// by this end are odd). Fails with ENOTSUP without the v2 header.
+//------------------------------------------------------------------------------
+int sock_mux_ctor_client( sock_mux_t *this_, sock_client_t *client_ );
+
+//------------------------------------------------------------------------------
+// Multiplex the accepted client connection of a server (stream ids given out
+// by this end are even). Fails with ENOTSUP without the v2 header.
+//------------------------------------------------------------------------------
+int sock_mux_ctor_server( sock_mux_t *this_, sock_server_t *server_ );
+
+//------------------------------------------------------------------------------
+// Free all streams and queued messages; the connection is left open
+//------------------------------------------------------------------------------
+int sock_mux_dtor( sock_mux_t *this_ );
+
+//------------------------------------------------------------------------------
+// Return a new stream id (0 if out of memory). Streams opened by the peer
+// need no setup: they appear when their first message arrives.
+//------------------------------------------------------------------------------
+uint32_t sock_mux_open( sock_mux_t *this_ );
+
+//------------------------------------------------------------------------------
+// Drop the stream and any messages queued on it. Frames the peer sends on it
+// afterwards are dropped too, as are frames for ids of this end that were
+// never opened. A closed peer stream keeps a small entry until sock_mux_dtor.
+//------------------------------------------------------------------------------
+int sock_mux_close( sock_mux_t *this_, uint32_t sid_ );
+
+//------------------------------------------------------------------------------
+// Send a message on stream sid_; safe to call from several threads
+//------------------------------------------------------------------------------
+ssize_t sock_mux_send( sock_mux_t *this_, uint32_t sid_, const void *msg_, size_t len_ );
+
+//------------------------------------------------------------------------------
+// Receive the next message on stream *sid_, or on any stream if *sid_ is 0
+// (*sid_ is then set to the stream it came from). *msg_ is allocated and
+// must be freed by the caller. Returns the message length.
+//------------------------------------------------------------------------------
+ssize_t sock_mux_recv( sock_mux_t *this_, uint32_t *sid_, void **msg_, size_t *len_ );
+
+////////////////////////////////////////////////////////////////////////////////
+/// sock_async_t
+///
+/// Asynchronous operations on a connected client. Sends and receives are
+/// submitted without blocking and carried out in submission order by a
+/// sender and a receiver thread, so any number of requests can be in flight
+/// before the first reply arrives (pipelining). Replies are matched to
+/// receives in order. Completions are collected with sock_async_reap; the
+/// eventfd of sock_async_fd is readable while any are waiting, so it can be
+/// watched with poll/epoll. The client must not be used directly meanwhile.
+////////////////////////////////////////////////////////////////////////////////
+
+//------------------------------------------------------------------------------
+// Start asynchronous operation on the connected client_, with at most depth_
+// operations submitted and not yet reaped
+//------------------------------------------------------------------------------
+int sock_async_ctor( sock_async_t *this_, sock_client_t *client_, size_t depth_ );
+
+//------------------------------------------------------------------------------
+// Stop the threads and drop operations not yet reaped. If a transfer is in
+// progress the connection is shut down to stop it and must be reconnected.
+//------------------------------------------------------------------------------
+int sock_async_dtor( sock_async_t *this_ );
+
+//------------------------------------------------------------------------------
+// Submit the message msg_ of len_ bytes; it must stay unchanged until the
+// send completes. Fails with EAGAIN if depth operations are outstanding, and
+// with the error that broke the connection once a transfer has failed.
+//------------------------------------------------------------------------------
+int sock_async_send( sock_async_t *this_, const void *msg_, size_t len_, void *tag_ );
+
+//------------------------------------------------------------------------------
+// Submit a receive of the next message into buf_ (cap_ bytes). With buf_
+// NULL the message is allocated and the completion's data must be freed by
+// the caller. A message longer than cap_ is dropped and completes with
+// EMSGSIZE and its length.
+//------------------------------------------------------------------------------
+int sock_async_recv( sock_async_t *this_, void *buf_, size_t cap_, void *tag_ );
+
+//------------------------------------------------------------------------------
+// Descriptor to poll for completions (POLLIN)
+//------------------------------------------------------------------------------
+int sock_async_fd( const sock_async_t *this_ );
+
+//------------------------------------------------------------------------------
+// Take up to n_ completions into cqe_ without waiting; returns their number
+//------------------------------------------------------------------------------
+int sock_async_reap( sock_async_t *this_, sock_async_cqe_t *cqe_, size_t n_ );
 
 #endif // __SOCKETS_H__
@@ -0,0 +1,435 @@
+/*
+ * Copyright (c) 2016-2017,2019 Jason Graham <jgraham@compukix.net>
+ *
+ * This file is part of libsockets.
+ *
+ * libsockets is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * libsockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsockets.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+// Asynchronous client. Submitted sends and receives are queued and carried
+// out in order by one sender and one receiver thread, so sends go out while
+// earlier replies are still on their way. Finished operations are moved to a
+// completion queue whose eventfd is readable whenever it is not empty.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "sockets_internal.h"
+
+struct sock_async_op_s {
+        sock_async_op_t *next;
+        sock_async_cqe_t cqe;
+        const void *msg; // Message to send
+        void *buf;       // Caller's receive buffer (NULL: allocate)
+        size_t cap;      // Length of buf
+};
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+// LOCAL PROTOTYPES
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+static int async_submit(sock_async_t *this_, int op_, const void *msg_, void *buf_, size_t len_, void *tag_);
+static void async_complete(sock_async_t *this_, sock_async_op_t *op_, int err_);
+static void async_fail(sock_async_t *this_, int err_);
+static void *async_tx_main(void *arg_);
+static void *async_rx_main(void *arg_);
+static int async_recv(sock_async_t *this_, sock_async_op_t *op_);
+
+static void queue_push(sock_async_op_t **head_, sock_async_op_t **tail_, sock_async_op_t *op_);
+static sock_async_op_t *queue_pop(sock_async_op_t **head_, sock_async_op_t **tail_);
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+/// sock_async_t
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_async_ctor(sock_async_t *this_, sock_client_t *client_, size_t depth_)
+{
+        comm_channel_t *cc = client_->cc_worker;
+        size_t i;
+        int err;
+
+        memset(this_, 0, sizeof(*this_));
+        this_->efd = -1;
+
+        if (!cc || cc->fd <= 0 || depth_ == 0) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if ((this_->ops = calloc(depth_, sizeof(*this_->ops))) == NULL)
+                return -1;
+        for (i = 0; i < depth_; i++)
+                queue_push(&this_->free_ops, NULL, &this_->ops[i]);
+
+        if ((this_->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+                goto err;
+
+        // Sent on and received from by different threads
+#ifdef HAVE_IO_URING
+        sock_uring_free(&cc->ring);
+#endif
+        cc->shared = true;
+
+        this_->cc    = cc;
+        this_->depth = depth_;
+
+        pthread_mutex_init(&this_->lock, NULL);
+        pthread_cond_init(&this_->tx_cond, NULL);
+        pthread_cond_init(&this_->rx_cond, NULL);
+
+        if ((errno = pthread_create(&this_->tx_thread, NULL, async_tx_main, this_)) != 0)
+                goto err_sync;
+        if ((errno = pthread_create(&this_->rx_thread, NULL, async_rx_main, this_)) != 0) {
+                err = errno;
+                pthread_mutex_lock(&this_->lock);
+                this_->stop = true;
+                pthread_cond_broadcast(&this_->tx_cond);
+                pthread_mutex_unlock(&this_->lock);
+                pthread_join(this_->tx_thread, NULL);
+                errno = err;
+                goto err_sync;
+        }
+
+        return 0;
+
+err_sync:
+        err = errno;
+        pthread_cond_destroy(&this_->rx_cond);
+        pthread_cond_destroy(&this_->tx_cond);
+        pthread_mutex_destroy(&this_->lock);
+        cc->shared = false;
+        errno      = err;
+err:
+        err = errno;
+        if (this_->efd >= 0)
+                close(this_->efd);
+        free(this_->ops);
+        memset(this_, 0, sizeof(*this_));
+        errno = err;
+        return -1;
+}
+
+//------------------------------------------------------------------------------
+// Operations that have not completed are dropped. If a receive is in progress
+// the connection is shut down to stop it, and the client must reconnect.
+//------------------------------------------------------------------------------
+int sock_async_dtor(sock_async_t *this_)
+{
+        sock_async_op_t *op;
+
+        if (!this_->ops)
+                return 0;
+
+        pthread_mutex_lock(&this_->lock);
+        this_->stop = true;
+        if (this_->tx_busy || this_->rx_busy)
+                shutdown(this_->cc->fd, SHUT_RDWR);
+        pthread_cond_broadcast(&this_->tx_cond);
+        pthread_cond_broadcast(&this_->rx_cond);
+        pthread_mutex_unlock(&this_->lock);
+
+        pthread_join(this_->tx_thread, NULL);
+        pthread_join(this_->rx_thread, NULL);
+
+        // Received messages nobody reaped
+        while ((op = queue_pop(&this_->cq_head, &this_->cq_tail))) {
+                if (op->cqe.op == SOCK_ASYNC_RECV && !op->buf)
+                        free(op->cqe.data);
+        }
+
+        this_->cc->shared = false;
+
+        pthread_cond_destroy(&this_->rx_cond);
+        pthread_cond_destroy(&this_->tx_cond);
+        pthread_mutex_destroy(&this_->lock);
+        close(this_->efd);
+        free(this_->ops);
+
+        memset(this_, 0, sizeof(*this_));
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_async_send(sock_async_t *this_, const void *msg_, size_t len_, void *tag_)
+{
+        return async_submit(this_, SOCK_ASYNC_SEND, msg_, NULL, len_, tag_);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_async_recv(sock_async_t *this_, void *buf_, size_t cap_, void *tag_)
+{
+        return async_submit(this_, SOCK_ASYNC_RECV, NULL, buf_, buf_ ? cap_ : 0, tag_);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_async_fd(const sock_async_t *this_) { return this_->efd; }
+
+//------------------------------------------------------------------------------
+// Completions are taken in the order the operations finished; the eventfd is
+// cleared once the queue is empty
+//------------------------------------------------------------------------------
+int sock_async_reap(sock_async_t *this_, sock_async_cqe_t *cqe_, size_t n_)
+{
+        sock_async_op_t *op;
+        uint64_t v;
+        size_t i = 0;
+
+        pthread_mutex_lock(&this_->lock);
+        while (i < n_ && (op = queue_pop(&this_->cq_head, &this_->cq_tail))) {
+                cqe_[i++] = op->cqe;
+                queue_push(&this_->free_ops, NULL, op);
+        }
+        if (!this_->cq_head && read(this_->efd, &v, sizeof(v)) < 0 && errno != EAGAIN) {
+                pthread_mutex_unlock(&this_->lock);
+                return -1;
+        }
+        pthread_mutex_unlock(&this_->lock);
+
+        return (int)i;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Helper Procedures
+////////////////////////////////////////////////////////////////////////////////
+
+//------------------------------------------------------------------------------
+// Queue an operation. Fails with EAGAIN when depth operations are already
+// submitted and not yet reaped, and with the errno of the failure once the
+// connection has broken.
+//------------------------------------------------------------------------------
+static int async_submit(sock_async_t *this_, int op_, const void *msg_, void *buf_, size_t len_, void *tag_)
+{
+        sock_async_op_t *op;
+
+        pthread_mutex_lock(&this_->lock);
+        if (this_->err) {
+                errno = this_->err;
+                goto err;
+        }
+        if ((op = queue_pop(&this_->free_ops, NULL)) == NULL) {
+                errno = EAGAIN;
+                goto err;
+        }
+
+        memset(op, 0, sizeof(*op));
+        op->cqe.op  = op_;
+        op->cqe.tag = tag_;
+        op->cqe.len = len_;
+        op->msg     = msg_;
+        op->buf     = buf_;
+        op->cap     = len_;
+
+        if (op_ == SOCK_ASYNC_SEND) {
+                queue_push(&this_->tx_head, &this_->tx_tail, op);
+                pthread_cond_signal(&this_->tx_cond);
+        } else {
+                queue_push(&this_->rx_head, &this_->rx_tail, op);
+                pthread_cond_signal(&this_->rx_cond);
+        }
+        pthread_mutex_unlock(&this_->lock);
+
+        return 0;
+
+err:
+        pthread_mutex_unlock(&this_->lock);
+        return -1;
+}
+
+//------------------------------------------------------------------------------
+// Move op_ to the completion queue; called with the lock held
+//------------------------------------------------------------------------------
+static void async_complete(sock_async_t *this_, sock_async_op_t *op_, int err_)
+{
+        uint64_t one = 1;
+
+        op_->cqe.err = err_;
+        if (!this_->cq_head && write(this_->efd, &one, sizeof(one)) < 0) {
+                // Only fails if the counter would overflow, so it is readable anyway
+        }
+        queue_push(&this_->cq_head, &this_->cq_tail, op_);
+}
+
+//------------------------------------------------------------------------------
+// The connection is broken: fail everything queued in both directions (the
+// operation each thread is working on is completed by that thread). Called
+// with the lock held.
+//------------------------------------------------------------------------------
+static void async_fail(sock_async_t *this_, int err_)
+{
+        sock_async_op_t *op;
+
+        if (!this_->err)
+                this_->err = err_;
+        while ((op = queue_pop(&this_->tx_head, &this_->tx_tail)))
+                async_complete(this_, op, this_->err);
+        while ((op = queue_pop(&this_->rx_head, &this_->rx_tail)))
+                async_complete(this_, op, this_->err);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static void *async_tx_main(void *arg_)
+{
+        sock_async_t *this_ = (sock_async_t *)arg_;
+        sock_async_op_t *op;
+        struct iovec iov;
+        ssize_t n;
+        int err;
+
+        pthread_mutex_lock(&this_->lock);
+        while (1) {
+                while (!this_->tx_head && !this_->stop)
+                        pthread_cond_wait(&this_->tx_cond, &this_->lock);
+                if (this_->stop)
+                        break;
+
+                op             = queue_pop(&this_->tx_head, &this_->tx_tail);
+                this_->tx_busy = true;
+                pthread_mutex_unlock(&this_->lock);
+
+                iov.iov_base = (void *)op->msg;
+                iov.iov_len  = op->cap;
+                n            = comm_channel_sendv(this_->cc, NULL, &iov, 1, NULL);
+                err          = n < 0 ? errno : 0;
+
+                pthread_mutex_lock(&this_->lock);
+                this_->tx_busy = false;
+                async_complete(this_, op, err);
+                if (err)
+                        async_fail(this_, err);
+        }
+        pthread_mutex_unlock(&this_->lock);
+
+        return NULL;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static void *async_rx_main(void *arg_)
+{
+        sock_async_t *this_ = (sock_async_t *)arg_;
+        sock_async_op_t *op;
+        int err;
+
+        pthread_mutex_lock(&this_->lock);
+        while (1) {
+                while (!this_->rx_head && !this_->stop)
+                        pthread_cond_wait(&this_->rx_cond, &this_->lock);
+                if (this_->stop)
+                        break;
+
+                op             = queue_pop(&this_->rx_head, &this_->rx_tail);
+                this_->rx_busy = true;
+                pthread_mutex_unlock(&this_->lock);
+
+                err = async_recv(this_, op);
+
+                pthread_mutex_lock(&this_->lock);
+                this_->rx_busy = false;
+                async_complete(this_, op, err);
+                if (err && err != EMSGSIZE)
+                        async_fail(this_, err);
+        }
+        pthread_mutex_unlock(&this_->lock);
+
+        return NULL;
+}
+
+//------------------------------------------------------------------------------
+// Receive the next message for op_. A message too long for the caller's
+// buffer is read and dropped, and completes with EMSGSIZE and its length.
+// Returns 0 or the errno value.
+//------------------------------------------------------------------------------
+static int async_recv(sock_async_t *this_, sock_async_op_t *op_)
+{
+        comm_channel_t *cc = this_->cc;
+        void *data;
+        size_t len, cap;
+
+        if (comm_channel_recv_hdr(cc, NULL, NULL) < 0)
+                return errno;
+        len = cc->rx_pending;
+
+        if (op_->buf && len > op_->cap) {
+                if ((data = sock_bufpool_get(len, &cap)) == NULL)
+                        return errno;
+                if (comm_channel_recv_payload(cc, data, len, NULL) < 0) {
+                        sock_bufpool_put(data, cap);
+                        return errno;
+                }
+                sock_bufpool_put(data, cap);
+                op_->cqe.len = len;
+                return EMSGSIZE;
+        }
+
+        if ((data = op_->buf) == NULL && (data = malloc(len ? len : 1)) == NULL)
+                return errno;
+        if (comm_channel_recv_payload(cc, data, len, NULL) < 0) {
+                if (data != op_->buf)
+                        free(data);
+                return errno;
+        }
+
+        op_->cqe.data = data;
+        op_->cqe.len  = len;
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Append op_ to a list; without a tail_ it is pushed at the head (free list)
+//------------------------------------------------------------------------------
+static void queue_push(sock_async_op_t **head_, sock_async_op_t **tail_, sock_async_op_t *op_)
+{
+        if (!tail_) {
+                op_->next = *head_;
+                *head_    = op_;
+                return;
+        }
+
+        op_->next = NULL;
+        if (*tail_)
+                (*tail_)->next = op_;
+        else
+                *head_ = op_;
+        *tail_ = op_;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static sock_async_op_t *queue_pop(sock_async_op_t **head_, sock_async_op_t **tail_)
+{
+        sock_async_op_t *op = *head_;
+
+        if (op) {
+                *head_ = op->next;
+                if (tail_ && !*head_)
+                        *tail_ = NULL;
+        }
+        return op;
+}
@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2016-2017,2019 Jason Graham <jgraham@compukix.net>
+ *
+ * This file is part of libsockets.
+ *
+ * libsockets is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * libsockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsockets.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+// Size-class pool for message buffers. Blocks are powers of two from
+// SOCK_BUFPOOL_MIN to SOCK_BUFPOOL_MAX bytes and are never zeroed. Freed
+// blocks go to a small per-thread cache first; the cache spills half of a
+// full class to a process wide depot and refills from it in batches, so
+// channels on different threads recycle each other's buffers without taking
+// a lock for every message. Larger blocks are plain malloc/free.
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <limits.h>
+
+#include "sockets_internal.h"
+
+#define SOCK_BUFPOOL_MIN_SHIFT 6  // 64 bytes
+#define SOCK_BUFPOOL_MAX_SHIFT 24 // 16 MB
+#define SOCK_BUFPOOL_NCLASS (SOCK_BUFPOOL_MAX_SHIFT - SOCK_BUFPOOL_MIN_SHIFT + 1)
+#define SOCK_BUFPOOL_MIN ((size_t)1 << SOCK_BUFPOOL_MIN_SHIFT)
+#define SOCK_BUFPOOL_MAX ((size_t)1 << SOCK_BUFPOOL_MAX_SHIFT)
+
+#define SOCK_BUFPOOL_TCACHE (1 << 20) // Bytes a thread keeps per class (at least 2, at most 64 blocks)
+#define SOCK_BUFPOOL_DEPOT (32 << 20) // Bytes the depot keeps per class (at least 4, at most 1024 blocks)
+
+typedef struct bufpool_list_s {
+        void *head;     // Free blocks linked through their first word
+        unsigned count; // Number of blocks in the list
+} bufpool_list_t;
+
+typedef struct bufpool_cache_s {
+        bufpool_list_t list[SOCK_BUFPOOL_NCLASS];
+        bool registered; // Destructor registered with cache_key
+} bufpool_cache_t;
+
+typedef struct bufpool_depot_s {
+        pthread_mutex_t lock;
+        bufpool_list_t list;
+} bufpool_depot_t;
+
+static __thread bufpool_cache_t tcache;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static bufpool_depot_t depot[SOCK_BUFPOOL_NCLASS] = {
+    [0 ... SOCK_BUFPOOL_NCLASS - 1] = {PTHREAD_MUTEX_INITIALIZER, {NULL, 0}}};
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+// LOCAL PROTOTYPES
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+static int class_of(size_t len_);
+static unsigned cache_limit(int c_);
+static unsigned depot_limit(int c_);
+static void list_push(bufpool_list_t *this_, void *block_);
+static void *list_pop(bufpool_list_t *this_);
+static void depot_put(int c_, bufpool_list_t *from_, unsigned n_);
+static void depot_get(int c_, bufpool_list_t *to_, unsigned n_);
+static void cache_register(void);
+static void cache_key_create(void);
+static void cache_flush(void *cache_);
+
+//------------------------------------------------------------------------------
+// Get a block of at least len_ bytes; its capacity is stored in *cap_ and must
+// be passed back to sock_bufpool_put. The contents are undefined. Returns NULL
+// if memory is exhausted.
+//------------------------------------------------------------------------------
+void *sock_bufpool_get(size_t len_, size_t *cap_)
+{
+        bufpool_list_t *list;
+        void *block;
+        int c;
+
+        if (len_ > SOCK_BUFPOOL_MAX) {
+                if ((block = malloc(len_)))
+                        *cap_ = len_;
+                return block;
+        }
+
+        c    = class_of(len_);
+        list = &tcache.list[c];
+
+        if (list->count == 0) {
+                cache_register();
+                depot_get(c, list, cache_limit(c) / 2);
+        }
+
+        if ((block = list_pop(list)) == NULL)
+                block = malloc(SOCK_BUFPOOL_MIN << c);
+
+        if (block)
+                *cap_ = SOCK_BUFPOOL_MIN << c;
+        return block;
+}
+
+//------------------------------------------------------------------------------
+// Return a block obtained from sock_bufpool_get with capacity cap_
+//------------------------------------------------------------------------------
+void sock_bufpool_put(void *data_, size_t cap_)
+{
+        bufpool_list_t *list;
+        int c;
+
+        if (!data_)
+                return;
+
+        if (cap_ > SOCK_BUFPOOL_MAX) {
+                free(data_);
+                return;
+        }
+
+        c    = class_of(cap_);
+        list = &tcache.list[c];
+        assert((SOCK_BUFPOOL_MIN << c) == cap_);
+
+        if (list->count >= cache_limit(c)) {
+                cache_register();
+                depot_put(c, list, list->count / 2);
+        }
+        list_push(list, data_);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Helper Procedures
+////////////////////////////////////////////////////////////////////////////////
+
+//------------------------------------------------------------------------------
+// Index of the smallest class holding len_ bytes (len_ <= SOCK_BUFPOOL_MAX)
+//------------------------------------------------------------------------------
+static int class_of(size_t len_)
+{
+        if (len_ <= SOCK_BUFPOOL_MIN)
+                return 0;
+        return (int)(sizeof(unsigned long) * CHAR_BIT) - __builtin_clzl(len_ - 1) - SOCK_BUFPOOL_MIN_SHIFT;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static unsigned cache_limit(int c_)
+{
+        size_t n = SOCK_BUFPOOL_TCACHE >> (SOCK_BUFPOOL_MIN_SHIFT + c_);
+        return n < 2 ? 2 : n > 64 ? 64 : (unsigned)n;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static unsigned depot_limit(int c_)
+{
+        size_t n = SOCK_BUFPOOL_DEPOT >> (SOCK_BUFPOOL_MIN_SHIFT + c_);
+        return n < 4 ? 4 : n > 1024 ? 1024 : (unsigned)n;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static void list_push(bufpool_list_t *this_, void *block_)
+{
+        *(void **)block_ = this_->head;
+        this_->head      = block_;
+        this_->count++;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static void *list_pop(bufpool_list_t *this_)
+{
+        void *block = this_->head;
+
+        if (block) {
+                this_->head = *(void **)block;
+                this_->count--;
+        }
+        return block;
+}
+
+//------------------------------------------------------------------------------
+// Move n_ blocks of class c_ from from_ to the depot; blocks the depot has no
+// room for are freed
+//------------------------------------------------------------------------------
+static void depot_put(int c_, bufpool_list_t *from_, unsigned n_)
+{
+        bufpool_depot_t *d = &depot[c_];
+        unsigned limit     = depot_limit(c_);
+        void *block;
+
+        pthread_mutex_lock(&d->lock);
+        while (n_-- > 0 && (block = list_pop(from_))) {
+                if (d->list.count < limit)
+                        list_push(&d->list, block);
+                else
+                        free(block);
+        }
+        pthread_mutex_unlock(&d->lock);
+}
+
+//------------------------------------------------------------------------------
+// Move up to n_ blocks of class c_ from the depot to to_
+//------------------------------------------------------------------------------
+static void depot_get(int c_, bufpool_list_t *to_, unsigned n_)
+{
+        bufpool_depot_t *d = &depot[c_];
+        void *block;
+
+        pthread_mutex_lock(&d->lock);
+        while (n_-- > 0 && (block = list_pop(&d->list)))
+                list_push(to_, block);
+        pthread_mutex_unlock(&d->lock);
+}
+
+//------------------------------------------------------------------------------
+// Have the calling thread's cache returned to the depot when the thread exits
+//------------------------------------------------------------------------------
+static void cache_register(void)
+{
+        if (tcache.registered)
+                return;
+
+        pthread_once(&cache_once, cache_key_create);
+        pthread_setspecific(cache_key, &tcache);
+        tcache.registered = true;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static void cache_key_create(void)
+{
+        pthread_key_create(&cache_key, cache_flush);
+}
+
+//------------------------------------------------------------------------------
+// Thread exit: hand every cached block to the depot
+//------------------------------------------------------------------------------
+static void cache_flush(void *cache_)
+{
+        bufpool_cache_t *cache = (bufpool_cache_t *)cache_;
+        int c;
+
+        for (c = 0; c < SOCK_BUFPOOL_NCLASS; c++)
+                depot_put(c, &cache->list[c], cache->list[c].count);
+        cache->registered = false;
+}
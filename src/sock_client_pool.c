@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2016-2017,2019 Jason Graham <jgraham@compukix.net>
+ *
+ * This file is part of libsockets.
+ *
+ * libsockets is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * libsockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsockets.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+// Pool of connected clients. Idle slots are kept on a Treiber stack of slot
+// indices; the head word carries a tag that changes on every update, so a
+// compare-and-swap cannot succeed on a head that was popped and pushed back
+// in between (ABA).
+
+#define _GNU_SOURCE
+#include <errno.h>
+
+#include "sockets_internal.h"
+
+#define SOCK_PC_NEW 0  // Constructed, never connected
+#define SOCK_PC_LIVE 1 // Connected
+#define SOCK_PC_DEAD 2 // Must be reconnected before use
+
+#define POOL_SLOT(head_) ((uint32_t)(head_))  // Slot + 1 (0 if the stack is empty)
+#define POOL_TAG(head_) ((head_) >> 32)
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+// LOCAL PROTOTYPES
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+static sock_client_t *pool_pop(sock_client_pool_t *this_);
+static void pool_push(sock_client_pool_t *this_, sock_client_t *client_);
+static bool client_alive(const sock_client_t *client_);
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+/// sock_client_pool_t
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_client_pool_ctor(sock_client_pool_t *this_, const char *server_name_, uint16_t server_port_,
+                          size_t nclient_)
+{
+        size_t i;
+
+        memset(this_, 0, sizeof(*this_));
+
+        if (nclient_ == 0 || nclient_ >= UINT32_MAX) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        this_->client = calloc(nclient_, sizeof(*this_->client));
+        this_->state  = calloc(nclient_, sizeof(*this_->state));
+        this_->next   = calloc(nclient_, sizeof(*this_->next));
+        if (!this_->client || !this_->state || !this_->next)
+                goto err;
+
+        for (; this_->nclient < nclient_; this_->nclient++) {
+                if (sock_client_ctor(&this_->client[this_->nclient], server_name_, server_port_) < 0) {
+                        sock_client_dtor(&this_->client[this_->nclient]);
+                        goto err;
+                }
+        }
+
+        for (i = nclient_; i > 0; i--)
+                pool_push(this_, &this_->client[i - 1]);
+
+        return 0;
+
+err:
+        sock_client_pool_dtor(this_);
+        return -1;
+}
+
+//------------------------------------------------------------------------------
+// Must not be called while clients are checked out
+//------------------------------------------------------------------------------
+int sock_client_pool_dtor(sock_client_pool_t *this_)
+{
+        size_t i;
+
+        for (i = 0; i < this_->nclient; i++)
+                sock_client_dtor(&this_->client[i]);
+
+        free(this_->client);
+        free(this_->state);
+        free(this_->next);
+        memset(this_, 0, sizeof(*this_));
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Check out a client. Idle connections that the server has closed are
+// reconnected, and never used slots connected, before being handed out.
+//------------------------------------------------------------------------------
+sock_client_t *sock_client_pool_get(sock_client_pool_t *this_)
+{
+        sock_client_t *c;
+        size_t slot;
+        int n;
+
+        if ((c = pool_pop(this_)) == NULL) {
+                errno = EAGAIN;
+                return NULL;
+        }
+        slot = c - this_->client;
+
+        if (this_->state[slot] == SOCK_PC_LIVE && !client_alive(c))
+                this_->state[slot] = SOCK_PC_DEAD;
+
+        if (this_->state[slot] != SOCK_PC_LIVE) {
+                if (this_->state[slot] == SOCK_PC_NEW)
+                        n = sock_client_connect(c, 0);
+                else
+                        n = sock_client_reconnect(c);
+
+                if (n < 0) {
+                        n                  = errno;
+                        this_->state[slot] = SOCK_PC_DEAD;
+                        pool_push(this_, c);
+                        errno = n;
+                        return NULL;
+                }
+                this_->state[slot] = SOCK_PC_LIVE;
+        }
+
+        return c;
+}
+
+//------------------------------------------------------------------------------
+// Return a client to the pool. A client left in the middle of a message (or
+// chunked stream) is reconnected on its next checkout.
+//------------------------------------------------------------------------------
+int sock_client_pool_put(sock_client_pool_t *this_, sock_client_t *client_)
+{
+        comm_channel_t *cc = client_->cc_worker;
+
+        if (client_ < this_->client || client_ >= this_->client + this_->nclient) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (!cc || cc->rx_active || cc->rx_stream != SOCK_RX_NONE || cc->tx_stream)
+                this_->state[client_ - this_->client] = SOCK_PC_DEAD;
+
+        pool_push(this_, client_);
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static sock_client_t *pool_pop(sock_client_pool_t *this_)
+{
+        uint64_t head, next;
+        uint32_t slot;
+
+        head = __atomic_load_n(&this_->head, __ATOMIC_ACQUIRE);
+        do {
+                if ((slot = POOL_SLOT(head)) == 0)
+                        return NULL;
+                next = ((POOL_TAG(head) + 1) << 32) | __atomic_load_n(&this_->next[slot - 1], __ATOMIC_RELAXED);
+        } while (!__atomic_compare_exchange_n(&this_->head, &head, next, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+        return &this_->client[slot - 1];
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static void pool_push(sock_client_pool_t *this_, sock_client_t *client_)
+{
+        uint32_t slot = client_ - this_->client;
+        uint64_t head, next;
+
+        head = __atomic_load_n(&this_->head, __ATOMIC_RELAXED);
+        do {
+                __atomic_store_n(&this_->next[slot], POOL_SLOT(head), __ATOMIC_RELAXED);
+                next = ((POOL_TAG(head) + 1) << 32) | (slot + 1);
+        } while (!__atomic_compare_exchange_n(&this_->head, &head, next, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+//------------------------------------------------------------------------------
+// An idle connection has nothing to read; end of file or pending data (e.g. a
+// reply nobody collected) mean it cannot be reused as is
+//------------------------------------------------------------------------------
+static bool client_alive(const sock_client_t *client_)
+{
+        char c;
+        int err = errno;
+        ssize_t n;
+
+        if (client_->cc_worker->rpos < client_->cc_worker->ra.n) // Read ahead, never collected
+                return false;
+
+        n     = recv(client_->cc_worker->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        n     = n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        errno = err;
+
+        return n;
+}
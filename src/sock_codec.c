@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2016-2017,2019 Jason Graham <jgraham@compukix.net>
+ *
+ * This file is part of libsockets.
+ *
+ * libsockets is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * libsockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsockets.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+// Message compression codecs. Codecs are looked up by the id carried in
+// front of every compressed payload. The built-in "lz" codec is a byte
+// oriented LZ77 in the style of LZ4: sequences of a token (literal and match
+// length nibbles), the literals, and a 16-bit match offset. It trades ratio
+// for speed and skips quickly over data that does not compress.
+
+#define _GNU_SOURCE
+#include <errno.h>
+
+#include "sockets_internal.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5 // Input tail always sent as literals
+#define LZ_SKIP_SHIFT 6    // Search step grows by 1 for every 64 bytes without a match
+
+static ssize_t lz_compress(const void *in_, size_t len_, void *out_, size_t cap_);
+static ssize_t lz_decompress(const void *in_, size_t len_, void *out_, size_t cap_);
+
+static const sock_codec_t codec_lz = {"lz", SOCK_CODEC_LZ, lz_compress, lz_decompress};
+
+static const sock_codec_t *codec[256] = {[SOCK_CODEC_LZ] = &codec_lz};
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+// LOCAL PROTOTYPES
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+static inline uint32_t read32(const unsigned char *p_);
+static inline uint32_t lz_hash(uint32_t seq_);
+static unsigned char *lz_length(unsigned char *op_, size_t len_);
+static unsigned char *lz_emit(unsigned char *op_, const unsigned char *oend_, const unsigned char *lit_, size_t nlit_,
+                              size_t offset_, size_t mlen_);
+
+//------------------------------------------------------------------------------
+// Make codec_ available under its id. Fails with EINVAL for id 0 and with
+// EEXIST if the id is taken. Not synchronized: register codecs at start-up.
+//------------------------------------------------------------------------------
+int sock_codec_register(const sock_codec_t *codec_)
+{
+        if (codec_->id == 0 || !codec_->compress || !codec_->decompress) {
+                errno = EINVAL;
+                return -1;
+        }
+        if (codec[codec_->id] && codec[codec_->id] != codec_) {
+                errno = EEXIST;
+                return -1;
+        }
+        codec[codec_->id] = codec_;
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Registered codec called name_, or NULL
+//------------------------------------------------------------------------------
+const sock_codec_t *sock_codec_find(const char *name_)
+{
+        int i;
+
+        for (i = 1; i < 256; i++) {
+                if (codec[i] && strcmp(codec[i]->name, name_) == 0)
+                        return codec[i];
+        }
+        return NULL;
+}
+
+//------------------------------------------------------------------------------
+// Registered codec with wire id id_, or NULL
+//------------------------------------------------------------------------------
+const sock_codec_t *sock_codec_get(unsigned char id_) { return codec[id_]; }
+
+////////////////////////////////////////////////////////////////////////////////
+// Helper Procedures
+////////////////////////////////////////////////////////////////////////////////
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static inline uint32_t read32(const unsigned char *p_)
+{
+        uint32_t v;
+        memcpy(&v, p_, sizeof(v));
+        return v;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static inline uint32_t lz_hash(uint32_t seq_) { return (seq_ * 2654435761u) >> (32 - LZ_HASH_BITS); }
+
+//------------------------------------------------------------------------------
+// Write the extension bytes of a length of len_ beyond its 15 in the token
+//------------------------------------------------------------------------------
+static unsigned char *lz_length(unsigned char *op_, size_t len_)
+{
+        for (; len_ >= 255; len_ -= 255)
+                *op_++ = 255;
+        *op_++ = len_;
+        return op_;
+}
+
+//------------------------------------------------------------------------------
+// Write a sequence of nlit_ literals followed by a match (mlen_ 0 for the
+// final, literal only sequence). Returns NULL if it does not fit before
+// oend_.
+//------------------------------------------------------------------------------
+static unsigned char *lz_emit(unsigned char *op_, const unsigned char *oend_, const unsigned char *lit_, size_t nlit_,
+                              size_t offset_, size_t mlen_)
+{
+        size_t ml = mlen_ ? mlen_ - LZ_MIN_MATCH : 0;
+        unsigned char *token;
+
+        if ((size_t)(oend_ - op_) < 1 + nlit_ + nlit_ / 255 + 1 + 2 + ml / 255 + 1)
+                return NULL;
+
+        token  = op_++;
+        *token = (nlit_ < 15 ? nlit_ : 15) << 4;
+        if (nlit_ >= 15)
+                op_ = lz_length(op_, nlit_ - 15);
+        memcpy(op_, lit_, nlit_);
+        op_ += nlit_;
+
+        if (mlen_ == 0)
+                return op_;
+
+        *op_++ = offset_;
+        *op_++ = offset_ >> 8;
+        *token |= ml < 15 ? ml : 15;
+        if (ml >= 15)
+                op_ = lz_length(op_, ml - 15);
+        return op_;
+}
+
+//------------------------------------------------------------------------------
+// Compress len_ bytes from in_ into out_ (cap_ bytes). Returns the compressed
+// length, or -1 with errno ENOSPC if it would exceed cap_.
+//------------------------------------------------------------------------------
+static ssize_t lz_compress(const void *in_, size_t len_, void *out_, size_t cap_)
+{
+        const unsigned char *in = in_, *end = in + len_;
+        const unsigned char *ip = in, *anchor = in, *ref, *mp, *mend;
+        const unsigned char *limit = len_ > LZ_MIN_MATCH + LZ_LAST_LITERALS ? end - LZ_MIN_MATCH - LZ_LAST_LITERALS : in;
+        unsigned char *op = out_, *oend = op + cap_;
+        uint32_t table[1 << LZ_HASH_BITS];
+        uint32_t seq, h;
+
+        memset(table, 0, sizeof(table));
+        mend = end - LZ_LAST_LITERALS;
+
+        while (ip < limit) {
+                seq      = read32(ip);
+                h        = lz_hash(seq);
+                ref      = in + table[h];
+                table[h] = ip - in;
+
+                if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != seq) {
+                        ip += 1 + ((ip - anchor) >> LZ_SKIP_SHIFT);
+                        continue;
+                }
+
+                for (mp = ip + LZ_MIN_MATCH, ref += LZ_MIN_MATCH; mp < mend && *mp == *ref; mp++, ref++)
+                        ;
+
+                if ((op = lz_emit(op, oend, anchor, ip - anchor, mp - ref, mp - ip)) == NULL)
+                        goto nospace;
+
+                ip = anchor = mp;
+                if (ip - 2 > in) // Seed the table inside the match for the next search
+                        table[lz_hash(read32(ip - 2))] = ip - 2 - in;
+        }
+
+        if ((op = lz_emit(op, oend, anchor, end - anchor, 0, 0)) == NULL)
+                goto nospace;
+        return op - (unsigned char *)out_;
+
+nospace:
+        errno = ENOSPC;
+        return -1;
+}
+
+//------------------------------------------------------------------------------
+// Decompress len_ bytes from in_ into out_ (cap_ bytes). Returns the
+// decompressed length, or -1 with errno EPROTO for corrupt input.
+//------------------------------------------------------------------------------
+static ssize_t lz_decompress(const void *in_, size_t len_, void *out_, size_t cap_)
+{
+        const unsigned char *ip = in_, *iend = ip + len_, *ref;
+        unsigned char *op = out_, *oend = op + cap_;
+        size_t nlit, mlen, offset;
+        unsigned token, b;
+
+        while (ip < iend) {
+                token = *ip++;
+
+                nlit = token >> 4;
+                if (nlit == 15) {
+                        do {
+                                if (ip == iend)
+                                        goto corrupt;
+                                nlit += b = *ip++;
+                        } while (b == 255);
+                }
+                if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op))
+                        goto corrupt;
+                memcpy(op, ip, nlit);
+                op += nlit;
+                ip += nlit;
+
+                if (ip == iend) // Final sequence
+                        break;
+
+                if (iend - ip < 2)
+                        goto corrupt;
+                offset = ip[0] | ip[1] << 8;
+                ip += 2;
+                if (offset == 0 || offset > (size_t)(op - (unsigned char *)out_))
+                        goto corrupt;
+
+                mlen = token & 15;
+                if (mlen == 15) {
+                        do {
+                                if (ip == iend)
+                                        goto corrupt;
+                                mlen += b = *ip++;
+                        } while (b == 255);
+                }
+                mlen += LZ_MIN_MATCH;
+                if (mlen > (size_t)(oend - op))
+                        goto corrupt;
+
+                ref = op - offset;
+                if (offset >= mlen) {
+                        memcpy(op, ref, mlen);
+                        op += mlen;
+                } else { // Overlapping: repeats the last offset bytes
+                        while (mlen--)
+                                *op++ = *ref++;
+                }
+        }
+        return op - (unsigned char *)out_;
+
+corrupt:
+        errno = EPROTO;
+        return -1;
+}
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2016-2017,2019 Jason Graham <jgraham@compukix.net>
+ *
+ * This file is part of libsockets.
+ *
+ * libsockets is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * libsockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsockets.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+// CRC32C (Castagnoli) checksums. Where the CPU has a crc32c instruction
+// (SSE4.2, or the ARMv8 CRC extension when the build targets it) long inputs
+// are processed as three interleaved streams to hide its latency; the stream
+// CRCs are joined with tables that shift a CRC over a run of zero bytes.
+// Otherwise slicing-by-8 tables are used.
+
+#define _GNU_SOURCE
+#include <pthread.h>
+
+#include "sockets_internal.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC_HW
+#define CRC_HW_TARGET __attribute__((target("sse4.2")))
+#define crc_hw_u8(c, b) _mm_crc32_u8(c, b)
+#define crc_hw_u64(c, w) ((uint32_t)_mm_crc32_u64(c, w))
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC_HW
+#define CRC_HW_TARGET
+#define crc_hw_u8(c, b) __crc32cb(c, b)
+#define crc_hw_u64(c, w) __crc32cd(c, w)
+#endif
+
+#define CRC_POLY 0x82f63b78 // Castagnoli polynomial, bit reflected
+#define CRC_LONG 8192       // Bytes per stream of a long interleaved block
+#define CRC_SHORT 256       // Bytes per stream of a short one
+
+static uint32_t crc_table[8][256]; // Slicing-by-8: byte followed by 0-7 zero bytes
+#ifdef CRC_HW
+static uint32_t crc_long[4][256];  // Shift over CRC_LONG zero bytes, by register byte
+static uint32_t crc_short[4][256]; // Same over CRC_SHORT
+#endif
+
+static uint32_t (*crc_update)(uint32_t crc_, const unsigned char *p_, size_t len_);
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+// LOCAL PROTOTYPES
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+static void crc_init(void);
+static uint32_t crc_sw(uint32_t crc_, const unsigned char *p_, size_t len_);
+#ifdef CRC_HW
+static void crc_shift_init(uint32_t table_[4][256], size_t len_);
+static inline uint32_t crc_shift(uint32_t table_[4][256], uint32_t crc_);
+static uint32_t crc_hw(uint32_t crc_, const unsigned char *p_, size_t len_);
+#endif
+
+//------------------------------------------------------------------------------
+// CRC32C of len_ bytes at data_, continuing from crc_ (0 to start):
+// sock_crc32c(sock_crc32c(0, a, n), b, m) is the CRC of a followed by b
+//------------------------------------------------------------------------------
+uint32_t sock_crc32c(uint32_t crc_, const void *data_, size_t len_)
+{
+        pthread_once(&crc_once, crc_init);
+        return ~crc_update(~crc_, data_, len_);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Helper Procedures
+////////////////////////////////////////////////////////////////////////////////
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static void crc_init(void)
+{
+        uint32_t c;
+        int i, j;
+
+        for (i = 0; i < 256; i++) {
+                c = i;
+                for (j = 0; j < 8; j++)
+                        c = c & 1 ? (c >> 1) ^ CRC_POLY : c >> 1;
+                crc_table[0][i] = c;
+        }
+        for (i = 0; i < 256; i++) {
+                for (j = 1; j < 8; j++)
+                        crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^ crc_table[0][crc_table[j - 1][i] & 0xff];
+        }
+
+        crc_update = crc_sw;
+#ifdef CRC_HW
+#if defined(__x86_64__)
+        if (!__builtin_cpu_supports("sse4.2"))
+                return;
+#endif
+        crc_shift_init(crc_long, CRC_LONG);
+        crc_shift_init(crc_short, CRC_SHORT);
+        crc_update = crc_hw;
+#endif
+}
+
+//------------------------------------------------------------------------------
+// Table driven update of the (inverted) CRC register crc_
+//------------------------------------------------------------------------------
+static uint32_t crc_sw(uint32_t crc_, const unsigned char *p_, size_t len_)
+{
+        uint32_t lo;
+
+        for (; len_ >= 8; p_ += 8, len_ -= 8) {
+                lo   = crc_ ^ (p_[0] | p_[1] << 8 | p_[2] << 16 | (uint32_t)p_[3] << 24);
+                crc_ = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^ crc_table[5][(lo >> 16) & 0xff] ^
+                       crc_table[4][lo >> 24] ^ crc_table[3][p_[4]] ^ crc_table[2][p_[5]] ^ crc_table[1][p_[6]] ^
+                       crc_table[0][p_[7]];
+        }
+        while (len_--)
+                crc_ = crc_table[0][(crc_ ^ *p_++) & 0xff] ^ (crc_ >> 8);
+
+        return crc_;
+}
+
+#ifdef CRC_HW
+//------------------------------------------------------------------------------
+// Fill table_ with the operator that feeds len_ zero bytes through the CRC
+// register. It is linear, so it follows from the images of the 32 single
+// bit registers.
+//------------------------------------------------------------------------------
+static void crc_shift_init(uint32_t table_[4][256], size_t len_)
+{
+        uint32_t bit[32], c;
+        size_t n;
+        int i, j, k;
+
+        for (i = 0; i < 32; i++) {
+                c = (uint32_t)1 << i;
+                for (n = 0; n < len_; n++)
+                        c = crc_table[0][c & 0xff] ^ (c >> 8);
+                bit[i] = c;
+        }
+        for (k = 0; k < 4; k++) {
+                for (i = 0; i < 256; i++) {
+                        c = 0;
+                        for (j = 0; j < 8; j++) {
+                                if (i & (1 << j))
+                                        c ^= bit[8 * k + j];
+                        }
+                        table_[k][i] = c;
+                }
+        }
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static inline uint32_t crc_shift(uint32_t table_[4][256], uint32_t crc_)
+{
+        return table_[0][crc_ & 0xff] ^ table_[1][(crc_ >> 8) & 0xff] ^ table_[2][(crc_ >> 16) & 0xff] ^
+               table_[3][crc_ >> 24];
+}
+
+//------------------------------------------------------------------------------
+// Update with the crc32c instruction. Blocks of three streams are summed as
+// shift(shift(crc0) ^ crc1) ^ crc2, the CRC being linear in the register.
+//------------------------------------------------------------------------------
+CRC_HW_TARGET static uint32_t crc_hw(uint32_t crc_, const unsigned char *p_, size_t len_)
+{
+        uint32_t c0, c1, c2;
+        uint64_t w0, w1, w2;
+        const unsigned char *end;
+
+        while (len_ && ((uintptr_t)p_ & 7)) {
+                crc_ = crc_hw_u8(crc_, *p_++);
+                len_--;
+        }
+
+        while (len_ >= 3 * CRC_LONG) {
+                c0 = crc_;
+                c1 = c2 = 0;
+                for (end = p_ + CRC_LONG; p_ < end; p_ += 8) {
+                        memcpy(&w0, p_, 8);
+                        memcpy(&w1, p_ + CRC_LONG, 8);
+                        memcpy(&w2, p_ + 2 * CRC_LONG, 8);
+                        c0 = crc_hw_u64(c0, w0);
+                        c1 = crc_hw_u64(c1, w1);
+                        c2 = crc_hw_u64(c2, w2);
+                }
+                crc_ = crc_shift(crc_long, crc_shift(crc_long, c0) ^ c1) ^ c2;
+                p_ += 2 * CRC_LONG;
+                len_ -= 3 * CRC_LONG;
+        }
+
+        while (len_ >= 3 * CRC_SHORT) {
+                c0 = crc_;
+                c1 = c2 = 0;
+                for (end = p_ + CRC_SHORT; p_ < end; p_ += 8) {
+                        memcpy(&w0, p_, 8);
+                        memcpy(&w1, p_ + CRC_SHORT, 8);
+                        memcpy(&w2, p_ + 2 * CRC_SHORT, 8);
+                        c0 = crc_hw_u64(c0, w0);
+                        c1 = crc_hw_u64(c1, w1);
+                        c2 = crc_hw_u64(c2, w2);
+                }
+                crc_ = crc_shift(crc_short, crc_shift(crc_short, c0) ^ c1) ^ c2;
+                p_ += 2 * CRC_SHORT;
+                len_ -= 3 * CRC_SHORT;
+        }
+
+        for (; len_ >= 8; p_ += 8, len_ -= 8) {
+                memcpy(&w0, p_, 8);
+                crc_ = crc_hw_u64(crc_, w0);
+        }
+        while (len_--)
+                crc_ = crc_hw_u8(crc_, *p_++);
+
+        return crc_;
+}
+#endif
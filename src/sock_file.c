@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2016-2017,2019 Jason Graham <jgraham@compukix.net>
+ *
+ * This file is part of libsockets.
+ *
+ * libsockets is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * libsockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsockets.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+// Socket to file transfers. Data received for a file descriptor is either
+// spliced through a pipe (kernel pages are moved, never copied to user
+// space) or, for O_DIRECT files and checksummed payloads, received into two
+// aligned buffers that are written by a helper thread while the next one is
+// being filled.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "sockets_internal.h"
+
+#define SOCK_PIPE_SIZE (1 << 20)     // Requested pipe capacity for splice transfers
+#define SOCK_DIRECT_CHUNK (1 << 20)  // Size of each O_DIRECT write buffer
+#define SOCK_DIRECT_ALIGN 4096       // Buffer, offset and length alignment for O_DIRECT
+
+typedef struct direct_writer_s {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        int fd;        // Target file (opened with O_DIRECT)
+        void *data;    // Buffer being written (NULL when idle)
+        size_t len;    // Length of data
+        off_t offset;  // File offset of data
+        bool done;     // No more buffers follow
+        int err;       // errno of the first failed write
+} direct_writer_t;
+
+static ssize_t splice_all(int in_fd_, int out_fd_, off_t *offset_, size_t len_);
+static ssize_t recv_all(int fd_, void *data_, size_t len_, size_t *ntrans_, sock_deadline_t *dl_);
+static int pwrite_all(int fd_, const void *data_, size_t len_, off_t offset_);
+static int direct_write(int fd_, const void *data_, size_t len_, off_t offset_);
+static void *direct_writer_main(void *arg_);
+
+//------------------------------------------------------------------------------
+// Create the pipe used by trans_splice
+//------------------------------------------------------------------------------
+int trans_pipe(int pipe_[2])
+{
+        int n;
+
+        ERR_RET(n, pipe2(pipe_, O_CLOEXEC));
+        fcntl(pipe_[1], F_SETPIPE_SZ, SOCK_PIPE_SIZE); // Best effort; limited by pipe-max-size
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Move len_ bytes from socket fd_ to out_fd_ at offset_ through pipe_ with
+// splice. The first npre_ bytes have already been received into pre_ and are
+// written from there. The pipe is empty again on success; on failure it may
+// hold data and should be discarded. A non-blocking socket is waited on until
+// the deadline dl_ (if any).
+//------------------------------------------------------------------------------
+ssize_t trans_splice(int fd_, int pipe_[2], int out_fd_, off_t offset_, size_t len_, size_t *ntrans_,
+                     sock_deadline_t *dl_, const void *pre_, size_t npre_)
+{
+        ssize_t n;
+        size_t len = npre_;
+        size_t nt  = 0;
+
+        ssize_t rc = 0;
+
+        if (npre_ && pwrite_all(out_fd_, pre_, npre_, offset_) < 0)
+                return -1;
+        offset_ += npre_;
+
+        while (len < len_) {
+                nt++;
+                n = splice(fd_, NULL, pipe_[1], NULL, len_ - len, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN && trans_wait(fd_, POLLIN, dl_) == 0)
+                                continue;
+                        rc = n;
+                        goto fini;
+                } else if (n == 0) { // Peer disconnect (set as error)
+                        rc    = -1;
+                        errno = ECOMM;
+                        goto fini;
+                }
+                len += n;
+                if (dl_)
+                        dl_->nbytes += n;
+
+                // Drain the pipe into the file
+                if (splice_all(pipe_[0], out_fd_, &offset_, n) < 0) {
+                        rc = -1;
+                        goto fini;
+                }
+        }
+        rc = len;
+
+fini:
+        if (ntrans_)
+                *ntrans_ = nt;
+        return rc;
+}
+
+//------------------------------------------------------------------------------
+// Receive len_ bytes from socket fd_ into the file out_fd_ at offset_ (which
+// must be aligned if it is opened O_DIRECT). Two aligned buffers are used in
+// turn: one is filled from the socket while a writer thread writes the other,
+// so memory use is bounded no matter how large len_ is. The unaligned tail of
+// the transfer is written with O_DIRECT temporarily cleared. The first npre_
+// bytes have already been received into pre_. With crc_, the CRC32C of the
+// data is continued in *crc_ while each buffer is still in the cache.
+//------------------------------------------------------------------------------
+ssize_t trans_direct(int fd_, int out_fd_, off_t offset_, size_t len_, size_t *ntrans_, sock_deadline_t *dl_,
+                     const void *pre_, size_t npre_, uint32_t *crc_)
+{
+        direct_writer_t w;
+        pthread_t thread;
+        void *buf[2] = {NULL, NULL};
+        size_t len   = 0;
+        size_t nt = 0, _nt = 0;
+        size_t n, pre;
+        int i = 0, err = 0;
+
+        if (offset_ % SOCK_DIRECT_ALIGN && fcntl(out_fd_, F_GETFL) & O_DIRECT) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if ((errno = posix_memalign(&buf[0], SOCK_DIRECT_ALIGN, SOCK_DIRECT_CHUNK)) != 0 ||
+            (errno = posix_memalign(&buf[1], SOCK_DIRECT_ALIGN, SOCK_DIRECT_CHUNK)) != 0) {
+                free(buf[0]);
+                return -1;
+        }
+
+        memset(&w, 0, sizeof(w));
+        w.fd = out_fd_;
+        pthread_mutex_init(&w.lock, NULL);
+        pthread_cond_init(&w.cond, NULL);
+
+        if ((errno = pthread_create(&thread, NULL, direct_writer_main, &w)) != 0) {
+                err = errno;
+                goto fini;
+        }
+
+        while (len < len_) {
+                n = len_ - len < SOCK_DIRECT_CHUNK ? len_ - len : SOCK_DIRECT_CHUNK;
+
+                pre = len < npre_ ? npre_ - len : 0;
+                if (pre > n)
+                        pre = n;
+                if (pre)
+                        memcpy(buf[i], (const char *)pre_ + len, pre);
+
+                if (recv_all(fd_, (char *)buf[i] + pre, n - pre, &_nt, dl_) < 0)
+                        err = errno;
+                else if (crc_)
+                        *crc_ = sock_crc32c(*crc_, buf[i], n);
+                nt += _nt;
+
+                // Wait for the previous buffer to be written before queueing this one
+                pthread_mutex_lock(&w.lock);
+                while (w.data && !w.err)
+                        pthread_cond_wait(&w.cond, &w.lock);
+                if (!err)
+                        err = w.err;
+                if (!err) {
+                        w.data   = buf[i];
+                        w.len    = n;
+                        w.offset = offset_ + len;
+                        pthread_cond_broadcast(&w.cond);
+                }
+                pthread_mutex_unlock(&w.lock);
+
+                if (err)
+                        break;
+
+                len += n;
+                i ^= 1;
+        }
+
+        pthread_mutex_lock(&w.lock);
+        w.done = true;
+        pthread_cond_broadcast(&w.cond);
+        pthread_mutex_unlock(&w.lock);
+
+        pthread_join(thread, NULL);
+        if (!err)
+                err = w.err;
+
+fini:
+        pthread_cond_destroy(&w.cond);
+        pthread_mutex_destroy(&w.lock);
+        free(buf[0]);
+        free(buf[1]);
+
+        if (ntrans_)
+                *ntrans_ = nt;
+        if (err) {
+                errno = err;
+                return -1;
+        }
+        return len;
+}
+
+//------------------------------------------------------------------------------
+// Continue the CRC32C in *crc_ over len_ bytes of file fd_ from offset_, for
+// data that is sent without passing through user space. Reads are aligned,
+// so O_DIRECT files can be read as well.
+//------------------------------------------------------------------------------
+int trans_crc(int fd_, off_t offset_, size_t len_, uint32_t *crc_)
+{
+        void *buf;
+        off_t pos  = offset_ & ~((off_t)SOCK_DIRECT_ALIGN - 1);
+        size_t len = 0, skip = offset_ - pos, k;
+        ssize_t n;
+
+        if ((errno = posix_memalign(&buf, SOCK_DIRECT_ALIGN, SOCK_DIRECT_CHUNK)) != 0)
+                return -1;
+
+        while (len < len_) {
+                n = pread(fd_, buf, SOCK_DIRECT_CHUNK, pos);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= (ssize_t)skip) { // Error, or the file is shorter than len_
+                        if (n >= 0)
+                                errno = EIO;
+                        free(buf);
+                        return -1;
+                }
+                k = n - skip < len_ - len ? n - skip : len_ - len;
+                *crc_ = sock_crc32c(*crc_, (char *)buf + skip, k);
+                len += k;
+                pos += n;
+                skip = 0;
+        }
+
+        free(buf);
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static ssize_t splice_all(int in_fd_, int out_fd_, off_t *offset_, size_t len_)
+{
+        ssize_t n;
+        size_t len = 0;
+
+        while (len < len_) {
+                n = splice(in_fd_, NULL, out_fd_, offset_, len_ - len, SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                len += n;
+        }
+        return len;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static ssize_t recv_all(int fd_, void *data_, size_t len_, size_t *ntrans_, sock_deadline_t *dl_)
+{
+        ssize_t n;
+        size_t len = 0;
+        size_t nt  = 0;
+
+        while (len < len_) {
+                nt++;
+                n = recv(fd_, data_ + len, len_ - len, MSG_WAITALL);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN && trans_wait(fd_, POLLIN, dl_) == 0)
+                                continue;
+                        break;
+                } else if (n == 0) { // Peer disconnect (set as error)
+                        errno = ECOMM;
+                        break;
+                }
+                len += n;
+                if (dl_)
+                        dl_->nbytes += n;
+        }
+
+        *ntrans_ = nt;
+        return len == len_ ? (ssize_t)len : -1;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static int pwrite_all(int fd_, const void *data_, size_t len_, off_t offset_)
+{
+        ssize_t n;
+        size_t len = 0;
+
+        while (len < len_) {
+                n = pwrite(fd_, data_ + len, len_ - len, offset_ + len);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                len += n;
+        }
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Write with O_DIRECT as far as the alignment allows; any unaligned tail goes
+// through the page cache
+//------------------------------------------------------------------------------
+static int direct_write(int fd_, const void *data_, size_t len_, off_t offset_)
+{
+        size_t head = len_ & ~((size_t)SOCK_DIRECT_ALIGN - 1);
+        int flags, n;
+
+        if (head && pwrite_all(fd_, data_, head, offset_) < 0)
+                return -1;
+
+        if (head == len_)
+                return 0;
+
+        ERR_RET(flags, fcntl(fd_, F_GETFL));
+        ERR_RET(n, fcntl(fd_, F_SETFL, flags & ~O_DIRECT));
+        n = pwrite_all(fd_, data_ + head, len_ - head, offset_ + head);
+        fcntl(fd_, F_SETFL, flags);
+
+        return n;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static void *direct_writer_main(void *arg_)
+{
+        direct_writer_t *w = (direct_writer_t *)arg_;
+
+        pthread_mutex_lock(&w->lock);
+        while (1) {
+                while (!w->data && !w->done)
+                        pthread_cond_wait(&w->cond, &w->lock);
+                if (!w->data)
+                        break;
+
+                pthread_mutex_unlock(&w->lock);
+                int n = direct_write(w->fd, w->data, w->len, w->offset);
+                pthread_mutex_lock(&w->lock);
+
+                if (n < 0 && !w->err)
+                        w->err = errno;
+                w->data = NULL;
+                pthread_cond_broadcast(&w->cond);
+        }
+        pthread_mutex_unlock(&w->lock);
+
+        return NULL;
+}
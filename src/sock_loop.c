@@ -0,0 +1,552 @@
+/*
+ * Copyright (c) 2016-2017,2019 Jason Graham <jgraham@compukix.net>
+ *
+ * This file is part of libsockets.
+ *
+ * libsockets is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * libsockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsockets.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "sockets_internal.h"
+
+#define SOCK_LOOP_MAX_EVENTS 256
+#define SOCK_LOOP_MSG_BUDGET 16 // Messages dispatched per connection per wakeup
+
+// Connection read states
+enum { SOCK_CS_HDR, SOCK_CS_MSG };
+
+struct sock_conn_s {
+        comm_channel_t *cc;     // Non-blocking channel; cc->buf holds the message being read
+        sock_loop_t *loop;      // Owning loop
+        int state;              // Read state
+        size_t roff;            // Bytes read of the current header or message
+        unsigned char rhdr[SOCK_HDR_MAX]; // Wire header being read
+        sock_tcp_header_t hdr;  // Header of the message being read
+        buffer_t wbuf;          // Queued outgoing frames
+        size_t woff;            // Bytes of wbuf already sent
+        uint32_t events;        // Registered epoll events
+        bool closing;           // Close once wbuf is drained
+        sock_conn_t *prev;      // Loop connection list
+        sock_conn_t *next;
+};
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+// LOCAL PROTOTYPES
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+static int loop_accept(sock_loop_t *this_);
+static int loop_listen(sock_loop_t *this_, bool on_);
+
+static sock_conn_t *conn_alloc(sock_loop_t *loop_, int fd_);
+static void conn_free(sock_conn_t *this_);
+static int conn_read(sock_conn_t *this_);
+static int conn_flush(sock_conn_t *this_);
+static int conn_dispatch(sock_conn_t *this_);
+static ssize_t conn_queue(sock_conn_t *this_, const sock_tcp_header_t *hdr_, const void *msg_, size_t len_);
+static int conn_update_events(sock_conn_t *this_);
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+/// sock_loop_t
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_loop_ctor(sock_loop_t *this_, uint16_t port_, sock_loop_fn_t on_msg_, void *arg_)
+{
+        return sock_loop_init(this_, port_, on_msg_, arg_, false);
+}
+
+//------------------------------------------------------------------------------
+// Constructor body shared with sock_mt_server_t. With reuseport_ the listening
+// socket is bound with SO_REUSEPORT so that several loops can listen on the
+// same port and have the kernel balance incoming connections between them.
+// On failure everything created so far is released again.
+//------------------------------------------------------------------------------
+int sock_loop_init(sock_loop_t *this_, uint16_t port_, sock_loop_fn_t on_msg_, void *arg_, bool reuseport_)
+{
+        int backlog, err, on = 1;
+        socklen_t addr_len;
+        struct epoll_event ev;
+
+        memset(this_, 0, sizeof(*this_));
+
+        this_->on_msg = on_msg_;
+        this_->arg    = arg_;
+        this_->run    = 1;
+
+        if ((this_->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)
+                goto err;
+
+        if (sock_server_ctor(&this_->server, port_, NULL) < 0)
+                goto err;
+        if (reuseport_ && setsockopt(this_->server.fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+                goto err;
+        if (sock_server_bind(&this_->server) < 0)
+                goto err;
+        backlog = this_->server.cc_client->opts.backlog;
+        if (listen(this_->server.fd, backlog > 0 ? backlog : SOMAXCONN) < 0 ||
+            fcntl(this_->server.fd, F_SETFL, fcntl(this_->server.fd, F_GETFL) | O_NONBLOCK) < 0)
+                goto err;
+
+        // Resolve the bound port (port_ may be 0)
+        addr_len = sizeof(this_->server.addr);
+        if (getsockname(this_->server.fd, &this_->server.addr.sa, &addr_len) < 0)
+                goto err;
+
+        if ((this_->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+            (this_->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+                goto err;
+
+        if (loop_listen(this_, true) < 0)
+                goto err;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events   = EPOLLIN;
+        ev.data.ptr = &this_->wakefd;
+        if (epoll_ctl(this_->epfd, EPOLL_CTL_ADD, this_->wakefd, &ev) < 0)
+                goto err;
+
+        return 0;
+
+err:
+        err = errno;
+        sock_loop_dtor(this_);
+        errno = err;
+        return -1;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_loop_dtor(sock_loop_t *this_)
+{
+        int n;
+
+        while (this_->conn)
+                conn_free(this_->conn);
+
+        if (this_->wakefd > 0)
+                close(this_->wakefd);
+        if (this_->spare_fd > 0)
+                close(this_->spare_fd);
+        if (this_->epfd > 0)
+                close(this_->epfd);
+
+        ERR_RET(n, sock_server_dtor(&this_->server));
+
+        memset(this_, 0, sizeof(*this_));
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_loop_run(sock_loop_t *this_)
+{
+        struct epoll_event ev[SOCK_LOOP_MAX_EVENTS];
+        sock_conn_t *conn;
+        uint64_t val;
+        int i, n, rc;
+
+        while (this_->run) {
+                n = epoll_wait(this_->epfd, ev, SOCK_LOOP_MAX_EVENTS, -1);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+
+                for (i = 0; i < n; i++) {
+                        if (ev[i].data.ptr == &this_->server) {
+                                loop_accept(this_);
+                                continue;
+                        } else if (ev[i].data.ptr == &this_->wakefd) {
+                                while (read(this_->wakefd, &val, sizeof(val)) > 0)
+                                        ;
+                                continue;
+                        }
+
+                        conn = ev[i].data.ptr;
+                        rc   = 0;
+
+                        if (ev[i].events & EPOLLOUT)
+                                rc = conn_flush(conn);
+                        if (rc == 0 && ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                                rc = conn_read(conn);
+
+                        if (rc < 0 || (conn->closing && conn->wbuf.n == 0))
+                                conn_free(conn);
+                }
+        }
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+void sock_loop_stop(sock_loop_t *this_)
+{
+        uint64_t val = 1;
+        ssize_t n;
+
+        this_->run = 0;
+        n          = write(this_->wakefd, &val, sizeof(val));
+        (void)n;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_loop_msg_max(sock_loop_t *this_, uint64_t max_)
+{
+        this_->msg_max = max_;
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Accept all pending connections. Out of descriptors, the reserve one is
+// given up to accept and close the next client, which would otherwise keep
+// the (level triggered) listener readable; without a reserve the listener is
+// taken out of epoll until a connection closes.
+//------------------------------------------------------------------------------
+static int loop_accept(sock_loop_t *this_)
+{
+        int fd;
+        sock_addr_t addr;
+        socklen_t addr_len;
+        sock_conn_t *conn;
+
+        while (1) {
+                addr_len = sizeof(addr);
+                fd       = accept4(this_->server.fd, &addr.sa, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                return 0;
+                        if (errno != EMFILE && errno != ENFILE)
+                                return -1;
+
+                        if (this_->spare_fd > 0) {
+                                close(this_->spare_fd);
+                                if ((fd = accept4(this_->server.fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+                                        close(fd);
+                                this_->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                                if (fd >= 0)
+                                        continue;
+                        }
+                        return loop_listen(this_, false);
+                }
+
+                sock_opts_apply(&this_->server.cc_client->opts, fd);
+                sock_opts_autosize(&this_->server.cc_client->opts, fd);
+
+                if ((conn = conn_alloc(this_, fd)) == NULL) {
+                        close(fd);
+                        return -1;
+                }
+                conn->cc->addr     = addr;
+                conn->cc->addr_len = addr_len;
+        }
+}
+
+//------------------------------------------------------------------------------
+// Add the listening socket to (or remove it from) the epoll set
+//------------------------------------------------------------------------------
+static int loop_listen(sock_loop_t *this_, bool on_)
+{
+        struct epoll_event ev;
+        int n;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events   = EPOLLIN;
+        ev.data.ptr = &this_->server;
+        ERR_RET(n, epoll_ctl(this_->epfd, on_ ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, this_->server.fd, &ev));
+        this_->paused = !on_;
+
+        return 0;
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+/// sock_conn_t
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_conn_send(sock_conn_t *this_, const void *msg_, size_t len_)
+{
+        sock_tcp_header_t hdr;
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_len = len_;
+
+        return conn_queue(this_, &hdr, msg_, len_);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_conn_close(sock_conn_t *this_)
+{
+        this_->closing = true;
+        return conn_update_events(this_);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static sock_conn_t *conn_alloc(sock_loop_t *loop_, int fd_)
+{
+        struct epoll_event ev;
+        sock_conn_t *this_ = calloc(1, sizeof(*this_));
+
+        if (!this_)
+                return NULL;
+
+        this_->cc     = comm_channel_alloc(0);
+        this_->cc->fd = fd_;
+        this_->loop   = loop_;
+        this_->state  = SOCK_CS_HDR;
+        this_->events = EPOLLIN;
+        buffer_ctor(&this_->wbuf, 0);
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events   = this_->events;
+        ev.data.ptr = this_;
+        if (epoll_ctl(loop_->epfd, EPOLL_CTL_ADD, fd_, &ev) < 0) {
+                this_->cc->fd = 0;
+                comm_channel_free(&this_->cc);
+                buffer_dtor(&this_->wbuf);
+                free(this_);
+                return NULL;
+        }
+
+        // Link at the head of the connection list
+        this_->next = loop_->conn;
+        if (loop_->conn)
+                loop_->conn->prev = this_;
+        loop_->conn = this_;
+        loop_->nconn++;
+
+        return this_;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static void conn_free(sock_conn_t *this_)
+{
+        sock_loop_t *loop = this_->loop;
+
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, this_->cc->fd, NULL);
+        comm_channel_close(this_->cc);
+        comm_channel_free(&this_->cc);
+        buffer_dtor(&this_->wbuf);
+
+        if (this_->prev)
+                this_->prev->next = this_->next;
+        else
+                loop->conn = this_->next;
+        if (this_->next)
+                this_->next->prev = this_->prev;
+        loop->nconn--;
+
+        // A descriptor is free again
+        if (loop->paused)
+                loop_listen(loop, true);
+
+        free(this_);
+}
+
+//------------------------------------------------------------------------------
+// Read state machine: header -> message -> dispatch. Returns -1 if the
+// connection should be closed.
+//------------------------------------------------------------------------------
+static int conn_read(sock_conn_t *this_)
+{
+        comm_channel_t *cc    = this_->cc;
+        uint64_t loop_msg_max = this_->loop->msg_max;
+        int budget            = SOCK_LOOP_MSG_BUDGET;
+        ssize_t n;
+
+        while (budget > 0 && !this_->closing) {
+                if (this_->state == SOCK_CS_HDR) {
+                        n = recv(cc->fd, this_->rhdr + this_->roff,
+                                 sock_hdr_len(cc->hdr_v2, this_->rhdr, this_->roff) - this_->roff, 0);
+                } else {
+                        n = recv(cc->fd, cc->buf.data + this_->roff, this_->hdr.msg_len - this_->roff, 0);
+                }
+
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+                } else if (n == 0) { // Peer disconnect
+                        return -1;
+                }
+
+                this_->roff += n;
+
+                if (this_->state == SOCK_CS_HDR &&
+                    this_->roff == sock_hdr_len(cc->hdr_v2, this_->rhdr, this_->roff)) {
+                        if (sock_hdr_decode(&this_->hdr, cc->hdr_v2, this_->rhdr) < 0)
+                                return -1;
+                        if (this_->hdr.msg_len > (loop_msg_max ? loop_msg_max : SOCK_MSG_MAX)) {
+                                errno = EMSGSIZE;
+                                return -1;
+                        }
+                        if (buffer_resize(&cc->buf, this_->hdr.msg_len) < 0)
+                                return -1;
+                        cc->buf.n   = this_->hdr.msg_len;
+                        this_->roff = 0;
+                        this_->state = SOCK_CS_MSG;
+                }
+
+                // Zero length messages complete with the header
+                if (this_->state == SOCK_CS_MSG && this_->roff == this_->hdr.msg_len) {
+                        this_->roff  = 0;
+                        this_->state = SOCK_CS_HDR;
+                        budget--;
+
+                        if (conn_dispatch(this_) < 0)
+                                return -1;
+                }
+        }
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Write as much of the queued output as the socket accepts
+//------------------------------------------------------------------------------
+static int conn_flush(sock_conn_t *this_)
+{
+        buffer_t *wbuf = &this_->wbuf;
+        ssize_t n;
+
+        while (this_->woff < wbuf->n) {
+                n = send(this_->cc->fd, wbuf->data + this_->woff, wbuf->n - this_->woff, MSG_NOSIGNAL);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                                break;
+                        // Hard error: drop the output and let the loop reap the connection
+                        wbuf->n        = 0;
+                        this_->woff    = 0;
+                        this_->closing = true;
+                        return -1;
+                }
+                this_->woff += n;
+        }
+
+        if (this_->woff == wbuf->n) {
+                wbuf->n     = 0;
+                this_->woff = 0;
+        }
+
+        return conn_update_events(this_);
+}
+
+//------------------------------------------------------------------------------
+// Handle a complete message: worker port and SIGTERM requests are answered as
+// sock_server_accept does; everything else goes to the user handler
+//------------------------------------------------------------------------------
+static int conn_dispatch(sock_conn_t *this_)
+{
+        sock_loop_t *loop = this_->loop;
+        buffer_t *buf     = &this_->cc->buf;
+        sock_tcp_header_t hdr;
+        uint16_t wport;
+
+        if (this_->hdr.opts & SOCK_OPTS_REQ_WPORT) {
+                // Serve the client on this connection, switching header version
+                // once the reply is queued
+                wport = ntohs(loop->server.addr.in.sin_port);
+                sock_handshake_reply(&this_->hdr, &hdr, sizeof(wport));
+                this_->cc->hdr_v2 = false;
+                if (conn_queue(this_, &hdr, &wport, sizeof(wport)) < 0)
+                        return -1;
+                this_->cc->hdr_v2 = (hdr.opts & SOCK_OPTS_HDR_V2) != 0;
+                return 0;
+        } else if (this_->hdr.opts & SOCK_OPTS_SIGTERM) {
+                raise(SIGTERM);
+                return 0;
+        }
+
+        return loop->on_msg(loop, this_, buf->data, buf->n);
+}
+
+//------------------------------------------------------------------------------
+// Append a frame to the output queue and send what the socket accepts
+//------------------------------------------------------------------------------
+static ssize_t conn_queue(sock_conn_t *this_, const sock_tcp_header_t *hdr_, const void *msg_, size_t len_)
+{
+        unsigned char whdr[SOCK_HDR_MAX];
+        size_t whdr_len;
+
+        if (this_->closing) {
+                errno = EPIPE;
+                return -1;
+        }
+
+        if ((whdr_len = sock_hdr_encode(hdr_, this_->cc->hdr_v2, whdr)) == 0)
+                return -1;
+
+        if (buffer_resize(&this_->wbuf, this_->wbuf.n + whdr_len + len_) < 0) // The appends cannot fail
+                return -1;
+        buffer_append(&this_->wbuf, whdr, whdr_len);
+        buffer_append(&this_->wbuf, msg_, len_);
+
+        if (conn_flush(this_) < 0)
+                return -1;
+
+        return whdr_len + len_;
+}
+
+//------------------------------------------------------------------------------
+// Register interest in writability only while output is pending. A closing
+// connection with nothing pending is armed for EPOLLOUT so that the loop
+// reaps it on the next wakeup.
+//------------------------------------------------------------------------------
+static int conn_update_events(sock_conn_t *this_)
+{
+        struct epoll_event ev;
+        uint32_t events = 0;
+
+        if (!this_->closing)
+                events |= EPOLLIN;
+        if (this_->closing || this_->wbuf.n > this_->woff)
+                events |= EPOLLOUT;
+
+        if (events == this_->events)
+                return 0;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events     = events;
+        ev.data.ptr   = this_;
+        this_->events = events;
+
+        return epoll_ctl(this_->loop->epfd, EPOLL_CTL_MOD, this_->cc->fd, &ev);
+}
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2016-2017,2019 Jason Graham <jgraham@compukix.net>
+ *
+ * This file is part of libsockets.
+ *
+ * libsockets is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * libsockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsockets.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "sockets_internal.h"
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+// LOCAL PROTOTYPES
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+static void *mt_server_thread(void *loop_);
+static int mt_server_cpu(const cpu_set_t *set_, size_t k_);
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+/// sock_mt_server_t
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_mt_server_ctor(sock_mt_server_t *this_, uint16_t port_, size_t nthread_, sock_loop_fn_t on_msg_,
+                        void *arg_)
+{
+        cpu_set_t allowed;
+        size_t i;
+        int n;
+
+        memset(this_, 0, sizeof(*this_));
+
+        if (nthread_ == 0) {
+                n        = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ? CPU_COUNT(&allowed) : 0;
+                nthread_ = n > 0 ? n : 1;
+        }
+
+        this_->loop   = calloc(nthread_, sizeof(*this_->loop));
+        this_->thread = calloc(nthread_, sizeof(*this_->thread));
+        if (!this_->loop || !this_->thread) {
+                free(this_->loop);
+                free(this_->thread);
+                errno = ENOMEM;
+                return -1;
+        }
+
+        // The first loop resolves the port (port_ may be 0) for the others
+        this_->port = port_;
+        for (i = 0; i < nthread_; i++) {
+                n = sock_loop_init(this_->loop + i, this_->port, on_msg_, arg_, true);
+                if (n < 0) {
+                        sock_mt_server_dtor(this_);
+                        return n;
+                }
+                this_->nthread++;
+                this_->port = ntohs(this_->loop[i].server.addr.in.sin_port);
+        }
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_mt_server_msg_max(sock_mt_server_t *this_, uint64_t max_)
+{
+        size_t i;
+
+        for (i = 0; i < this_->nthread; i++)
+                sock_loop_msg_max(this_->loop + i, max_);
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_mt_server_dtor(sock_mt_server_t *this_)
+{
+        size_t i;
+        int n, rc = 0;
+
+        for (i = 0; i < this_->nthread; i++) {
+                if ((n = sock_loop_dtor(this_->loop + i)) < 0)
+                        rc = n;
+        }
+
+        free(this_->loop);
+        free(this_->thread);
+        memset(this_, 0, sizeof(*this_));
+
+        return rc;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_mt_server_run(sock_mt_server_t *this_)
+{
+        cpu_set_t allowed, cpus;
+        size_t i, nstarted;
+        int n, cpu, ncpu = 0, rc = 0;
+
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+                ncpu = CPU_COUNT(&allowed);
+
+        for (nstarted = 1; nstarted < this_->nthread; nstarted++) {
+                if ((n = pthread_create(this_->thread + nstarted, NULL, mt_server_thread,
+                                        this_->loop + nstarted)) != 0) {
+                        errno = n;
+                        rc    = -1;
+                        sock_mt_server_stop(this_);
+                        break;
+                }
+
+                // Keep each acceptor on its own core, out of those the process may
+                // use, while there are enough of them
+                if (ncpu > 0 && this_->nthread <= (size_t)ncpu && (cpu = mt_server_cpu(&allowed, nstarted)) >= 0) {
+                        CPU_ZERO(&cpus);
+                        CPU_SET(cpu, &cpus);
+                        pthread_setaffinity_np(this_->thread[nstarted], sizeof(cpus), &cpus);
+                }
+        }
+
+        if (rc == 0)
+                rc = sock_loop_run(this_->loop);
+
+        for (i = 1; i < nstarted; i++)
+                pthread_join(this_->thread[i], NULL);
+
+        return rc;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+void sock_mt_server_stop(sock_mt_server_t *this_)
+{
+        size_t i;
+
+        for (i = 0; i < this_->nthread; i++)
+                sock_loop_stop(this_->loop + i);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static void *mt_server_thread(void *loop_)
+{
+        sock_loop_run((sock_loop_t *)loop_);
+        return NULL;
+}
+
+//------------------------------------------------------------------------------
+// The k_-th CPU (counting from 0) in set_, or -1 if it has fewer
+//------------------------------------------------------------------------------
+static int mt_server_cpu(const cpu_set_t *set_, size_t k_)
+{
+        int cpu;
+
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, set_) && k_-- == 0)
+                        return cpu;
+        }
+        return -1;
+}
@@ -0,0 +1,573 @@
+/*
+ * Copyright (c) 2016-2017,2019 Jason Graham <jgraham@compukix.net>
+ *
+ * This file is part of libsockets.
+ *
+ * libsockets is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * libsockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsockets.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+// Multiplexed streams over one connection. Every frame carries a stream id in
+// its v2 header; messages are sent as fragments so that a large message on one
+// stream does not hold up the others, and fragments are reassembled per
+// stream on the receiving side.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+
+#include "sockets_internal.h"
+
+#define SOCK_MUX_FRAG_LEN (64 * 1024) // Default fragment length
+#define SOCK_MUX_TABLE_LEN 64         // Initial number of hash buckets
+#define SOCK_MUX_DISCARD_LEN 4096     // Piece size when skipping dropped frames
+
+typedef struct sock_mux_msg_s {
+        struct sock_mux_msg_s *next;
+        void *data;
+        size_t len;
+} sock_mux_msg_t;
+
+struct sock_mux_stream_s {
+        uint32_t id;
+        sock_mux_stream_t *next;   // Hash chain
+        sock_mux_stream_t *rprev;  // Ready list (streams with complete messages)
+        sock_mux_stream_t *rnext;
+        bool ready;                // On the ready list
+        bool busy;                 // A fragment is being read into rdata
+        bool closed;               // Closed: frames are dropped (see sock_mux_close)
+        void *rdata;               // Message being reassembled
+        size_t rlen;
+        size_t rcap;
+        sock_mux_msg_t *head;      // Complete messages
+        sock_mux_msg_t *tail;
+};
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+// LOCAL PROTOTYPES
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+static int mux_init(sock_mux_t *this_, comm_channel_t *cc_, uint32_t first_id_);
+static int mux_read_frame(sock_mux_t *this_);
+static int mux_discard(sock_mux_t *this_, uint64_t len_);
+static bool mux_local(const sock_mux_t *this_, uint32_t id_);
+static sock_mux_msg_t *mux_pop(sock_mux_t *this_, uint32_t *sid_);
+static void mux_tx_acquire(sock_mux_t *this_);
+static void mux_tx_release(sock_mux_t *this_);
+
+static sock_mux_stream_t *stream_find(sock_mux_t *this_, uint32_t id_, bool create_);
+static void stream_unlink(sock_mux_t *this_, sock_mux_stream_t *s_);
+static void stream_clear(sock_mux_stream_t *s_);
+static void stream_free(sock_mux_stream_t *s_);
+static void stream_ready(sock_mux_t *this_, sock_mux_stream_t *s_, bool ready_);
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+/// sock_mux_t
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_mux_ctor_client(sock_mux_t *this_, sock_client_t *client_)
+{
+        return mux_init(this_, client_->cc_worker, 1);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_mux_ctor_server(sock_mux_t *this_, sock_server_t *server_)
+{
+        return mux_init(this_, server_->worker->cc_client, 2);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_mux_dtor(sock_mux_t *this_)
+{
+        sock_mux_stream_t *s, *next;
+        size_t i;
+
+        for (i = 0; i < this_->table_len; i++) {
+                for (s = this_->table[i]; s; s = next) {
+                        next = s->next;
+                        stream_free(s);
+                }
+        }
+        free(this_->table);
+
+        pthread_cond_destroy(&this_->rx_cond);
+        pthread_mutex_destroy(&this_->rx_lock);
+        pthread_cond_destroy(&this_->tx_cond);
+        pthread_mutex_destroy(&this_->tx_lock);
+
+        memset(this_, 0, sizeof(*this_));
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Streams of this end are added to the table here, so a frame for one of our
+// ids without an entry is for a stream that was closed or never opened
+//------------------------------------------------------------------------------
+uint32_t sock_mux_open(sock_mux_t *this_)
+{
+        uint32_t id;
+
+        pthread_mutex_lock(&this_->tx_lock);
+        id = this_->next_id;
+        this_->next_id += 2;
+        pthread_mutex_unlock(&this_->tx_lock);
+
+        pthread_mutex_lock(&this_->rx_lock);
+        if (stream_find(this_, id, true) == NULL)
+                id = 0;
+        pthread_mutex_unlock(&this_->rx_lock);
+
+        return id;
+}
+
+//------------------------------------------------------------------------------
+// Our own streams leave the table (or are freed by the reader if busy). Peer
+// streams would be recreated by their next frame, so they stay as a closed
+// entry without buffers.
+//------------------------------------------------------------------------------
+int sock_mux_close(sock_mux_t *this_, uint32_t sid_)
+{
+        sock_mux_stream_t *s;
+        int rc = 0;
+
+        pthread_mutex_lock(&this_->rx_lock);
+        if (mux_local(this_, sid_)) {
+                if ((s = stream_find(this_, sid_, false))) {
+                        stream_unlink(this_, s);
+                        if (s->busy)
+                                s->closed = true;
+                        else
+                                stream_free(s);
+                }
+        } else if ((s = stream_find(this_, sid_, true))) {
+                stream_ready(this_, s, false);
+                s->closed = true;
+                if (!s->busy)
+                        stream_clear(s);
+        } else {
+                rc = -1;
+        }
+        pthread_mutex_unlock(&this_->rx_lock);
+
+        return rc;
+}
+
+//------------------------------------------------------------------------------
+// Send the message as fragments of at most frag_len bytes, taking a ticket
+// for each one so that concurrent senders alternate in arrival order
+//------------------------------------------------------------------------------
+ssize_t sock_mux_send(sock_mux_t *this_, uint32_t sid_, const void *msg_, size_t len_)
+{
+        sock_tcp_header_t hdr;
+        struct iovec iov;
+        ssize_t n = 0, _n;
+        size_t off = 0;
+        size_t ntrans;
+
+        if (sid_ == 0) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.flags     = SOCK_HF_SID;
+        hdr.stream_id = sid_;
+
+        do {
+                iov.iov_base = (void *)msg_ + off;
+                iov.iov_len  = len_ - off < this_->frag_len ? len_ - off : this_->frag_len;
+                off += iov.iov_len;
+
+                hdr.msg_len = iov.iov_len;
+                hdr.opts    = SOCK_OPTS_CHUNK | (off == len_ ? SOCK_OPTS_EOS : 0);
+
+                mux_tx_acquire(this_);
+                _n = comm_channel_sendv(this_->cc, &hdr, &iov, 1, &ntrans);
+                mux_tx_release(this_);
+
+                if (_n < 0)
+                        return _n;
+                n += _n;
+        } while (off < len_);
+
+        return n;
+}
+
+//------------------------------------------------------------------------------
+// Wait for a complete message on stream *sid_ (any stream if 0). Whichever
+// waiting thread finds the socket idle reads frames for everyone until its
+// own message is complete.
+//------------------------------------------------------------------------------
+ssize_t sock_mux_recv(sock_mux_t *this_, uint32_t *sid_, void **msg_, size_t *len_)
+{
+        sock_mux_msg_t *m;
+        int n;
+
+        pthread_mutex_lock(&this_->rx_lock);
+        while ((m = mux_pop(this_, sid_)) == NULL) {
+                if (this_->rx_err) {
+                        pthread_mutex_unlock(&this_->rx_lock);
+                        errno = this_->rx_err;
+                        return -1;
+                }
+                if (this_->rx_reading) {
+                        pthread_cond_wait(&this_->rx_cond, &this_->rx_lock);
+                        continue;
+                }
+
+                this_->rx_reading = true;
+                n                 = mux_read_frame(this_);
+                this_->rx_reading = false;
+                if (n < 0)
+                        this_->rx_err = errno;
+                pthread_cond_broadcast(&this_->rx_cond);
+        }
+        pthread_mutex_unlock(&this_->rx_lock);
+
+        *msg_ = m->data;
+        *len_ = m->len;
+        free(m);
+
+        return *len_;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static int mux_init(sock_mux_t *this_, comm_channel_t *cc_, uint32_t first_id_)
+{
+        memset(this_, 0, sizeof(*this_));
+
+        if (!cc_ || !cc_->hdr_v2) { // Stream ids need the v2 header
+                errno = ENOTSUP;
+                return -1;
+        }
+
+        if ((this_->table = calloc(SOCK_MUX_TABLE_LEN, sizeof(*this_->table))) == NULL)
+                return -1;
+
+#ifdef HAVE_IO_URING
+        sock_uring_free(&cc_->ring);
+#endif
+        cc_->shared = true;
+
+        this_->cc        = cc_;
+        this_->frag_len  = SOCK_MUX_FRAG_LEN;
+        this_->next_id   = first_id_;
+        this_->table_len = SOCK_MUX_TABLE_LEN;
+
+        pthread_mutex_init(&this_->tx_lock, NULL);
+        pthread_cond_init(&this_->tx_cond, NULL);
+        pthread_mutex_init(&this_->rx_lock, NULL);
+        pthread_cond_init(&this_->rx_cond, NULL);
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Read one frame into its stream; called with rx_lock held, which is released
+// while reading from the socket
+//------------------------------------------------------------------------------
+static int mux_read_frame(sock_mux_t *this_)
+{
+        sock_tcp_header_t hdr;
+        sock_mux_stream_t *s;
+        sock_mux_msg_t *m;
+        void *data;
+        size_t cap, ntrans;
+        ssize_t n;
+
+        pthread_mutex_unlock(&this_->rx_lock);
+        n = comm_channel_recv_hdr(this_->cc, &hdr, &ntrans);
+        pthread_mutex_lock(&this_->rx_lock);
+
+        if (n < 0)
+                return -1;
+        if (!(hdr.flags & SOCK_HF_SID) || hdr.stream_id == 0) {
+                errno = EPROTO;
+                return -1;
+        }
+
+        // Peer streams appear with their first frame; frames for closed streams
+        // or for ids of ours that were never opened are dropped
+        if ((s = stream_find(this_, hdr.stream_id, !mux_local(this_, hdr.stream_id))) == NULL) {
+                if (!mux_local(this_, hdr.stream_id))
+                        return -1;
+                return mux_discard(this_, hdr.msg_len);
+        }
+        if (s->closed)
+                return mux_discard(this_, hdr.msg_len);
+
+        if (comm_channel_msg_check(this_->cc, s->rlen + hdr.msg_len) < 0)
+                return -1;
+        if (s->rlen + hdr.msg_len > s->rcap) {
+                cap = s->rcap ? s->rcap : hdr.msg_len;
+                while (cap < s->rlen + hdr.msg_len)
+                        cap *= 2;
+                if ((data = realloc(s->rdata, cap)) == NULL)
+                        return -1;
+                s->rdata = data;
+                s->rcap  = cap;
+        }
+
+        s->busy = true;
+        pthread_mutex_unlock(&this_->rx_lock);
+        n = comm_channel_recv_payload(this_->cc, s->rdata + s->rlen, hdr.msg_len, &ntrans);
+        pthread_mutex_lock(&this_->rx_lock);
+        s->busy = false;
+
+        if (s->closed) { // While reading
+                if (mux_local(this_, s->id))
+                        stream_free(s);
+                else
+                        stream_clear(s);
+                return n < 0 ? -1 : 0;
+        }
+        if (n < 0)
+                return -1;
+
+        s->rlen += hdr.msg_len;
+        if (!(hdr.opts & SOCK_OPTS_EOS))
+                return 0;
+
+        // Message complete: hand the reassembly buffer over to the queue
+        if ((m = malloc(sizeof(*m))) == NULL)
+                return -1;
+        m->next  = NULL;
+        m->data  = s->rdata;
+        m->len   = s->rlen;
+        s->rdata = NULL;
+        s->rlen  = 0;
+        s->rcap  = 0;
+
+        if (s->tail)
+                s->tail->next = m;
+        else
+                s->head = m;
+        s->tail = m;
+        stream_ready(this_, s, true);
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Read and drop the payload of the current frame; called with rx_lock held,
+// which is released while reading
+//------------------------------------------------------------------------------
+static int mux_discard(sock_mux_t *this_, uint64_t len_)
+{
+        unsigned char buf[SOCK_MUX_DISCARD_LEN];
+        size_t k, ntrans;
+        ssize_t n = 0;
+
+        pthread_mutex_unlock(&this_->rx_lock);
+        do { // Once even for an empty frame, which completes it
+                k = len_ < sizeof(buf) ? len_ : sizeof(buf);
+                n = comm_channel_recv_payload(this_->cc, buf, k, &ntrans);
+                len_ -= k;
+        } while (len_ > 0 && n >= 0);
+        pthread_mutex_lock(&this_->rx_lock);
+
+        return n < 0 ? -1 : 0;
+}
+
+//------------------------------------------------------------------------------
+// Whether stream id_ was (or would be) given out by this end: the client's
+// ids are odd and the server's even
+//------------------------------------------------------------------------------
+static bool mux_local(const sock_mux_t *this_, uint32_t id_)
+{
+        return ((id_ ^ this_->next_id) & 1) == 0;
+}
+
+//------------------------------------------------------------------------------
+// Take the next complete message of stream *sid_, or of the first ready
+// stream if *sid_ is 0 (that stream then goes to the back of the list)
+//------------------------------------------------------------------------------
+static sock_mux_msg_t *mux_pop(sock_mux_t *this_, uint32_t *sid_)
+{
+        sock_mux_stream_t *s;
+        sock_mux_msg_t *m;
+
+        if (*sid_ == 0)
+                s = this_->ready;
+        else
+                s = stream_find(this_, *sid_, false);
+
+        if (!s || !s->head)
+                return NULL;
+
+        m = s->head;
+        if ((s->head = m->next) == NULL)
+                s->tail = NULL;
+
+        stream_ready(this_, s, false);
+        if (s->head)
+                stream_ready(this_, s, true);
+
+        *sid_ = s->id;
+        return m;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static void mux_tx_acquire(sock_mux_t *this_)
+{
+        uint64_t ticket;
+
+        pthread_mutex_lock(&this_->tx_lock);
+        ticket = this_->tx_ticket++;
+        while (ticket != this_->tx_serving)
+                pthread_cond_wait(&this_->tx_cond, &this_->tx_lock);
+        pthread_mutex_unlock(&this_->tx_lock);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static void mux_tx_release(sock_mux_t *this_)
+{
+        pthread_mutex_lock(&this_->tx_lock);
+        this_->tx_serving++;
+        pthread_cond_broadcast(&this_->tx_cond);
+        pthread_mutex_unlock(&this_->tx_lock);
+}
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+/// sock_mux_stream_t
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+//------------------------------------------------------------------------------
+// Look up a stream, adding it if create_ is set. The table doubles once it
+// holds more than two streams per bucket.
+//------------------------------------------------------------------------------
+static sock_mux_stream_t *stream_find(sock_mux_t *this_, uint32_t id_, bool create_)
+{
+        sock_mux_stream_t **table, *s, *next;
+        size_t i, len;
+
+        for (s = this_->table[id_ & (this_->table_len - 1)]; s; s = s->next) {
+                if (s->id == id_)
+                        return s;
+        }
+        if (!create_)
+                return NULL;
+
+        if (this_->nstream >= 2 * this_->table_len) {
+                len = 2 * this_->table_len;
+                if ((table = calloc(len, sizeof(*table)))) {
+                        for (i = 0; i < this_->table_len; i++) {
+                                for (s = this_->table[i]; s; s = next) {
+                                        next                   = s->next;
+                                        s->next                = table[s->id & (len - 1)];
+                                        table[s->id & (len - 1)] = s;
+                                }
+                        }
+                        free(this_->table);
+                        this_->table     = table;
+                        this_->table_len = len;
+                }
+        }
+
+        if ((s = calloc(1, sizeof(*s))) == NULL)
+                return NULL;
+        s->id                                     = id_;
+        s->next                                   = this_->table[id_ & (this_->table_len - 1)];
+        this_->table[id_ & (this_->table_len - 1)] = s;
+        this_->nstream++;
+
+        return s;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static void stream_unlink(sock_mux_t *this_, sock_mux_stream_t *s_)
+{
+        sock_mux_stream_t **p = &this_->table[s_->id & (this_->table_len - 1)];
+
+        while (*p != s_)
+                p = &(*p)->next;
+        *p = s_->next;
+        this_->nstream--;
+
+        stream_ready(this_, s_, false);
+}
+
+//------------------------------------------------------------------------------
+// Free the queued messages and the reassembly buffer
+//------------------------------------------------------------------------------
+static void stream_clear(sock_mux_stream_t *s_)
+{
+        sock_mux_msg_t *m, *next;
+
+        for (m = s_->head; m; m = next) {
+                next = m->next;
+                free(m->data);
+                free(m);
+        }
+        s_->head = s_->tail = NULL;
+
+        free(s_->rdata);
+        s_->rdata = NULL;
+        s_->rlen  = 0;
+        s_->rcap  = 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static void stream_free(sock_mux_stream_t *s_)
+{
+        stream_clear(s_);
+        free(s_);
+}
+
+//------------------------------------------------------------------------------
+// Add the stream to the back of, or remove it from, the ready list
+//------------------------------------------------------------------------------
+static void stream_ready(sock_mux_t *this_, sock_mux_stream_t *s_, bool ready_)
+{
+        if (s_->ready == ready_)
+                return;
+
+        if (ready_) {
+                s_->rnext = NULL;
+                s_->rprev = this_->ready_tail;
+                if (this_->ready_tail)
+                        this_->ready_tail->rnext = s_;
+                else
+                        this_->ready = s_;
+                this_->ready_tail = s_;
+        } else {
+                if (s_->rprev)
+                        s_->rprev->rnext = s_->rnext;
+                else
+                        this_->ready = s_->rnext;
+                if (s_->rnext)
+                        s_->rnext->rprev = s_->rprev;
+                else
+                        this_->ready_tail = s_->rprev;
+                s_->rprev = s_->rnext = NULL;
+        }
+        s_->ready = ready_;
+}
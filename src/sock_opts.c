@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2016-2017,2019 Jason Graham <jgraham@compukix.net>
+ *
+ * This file is part of libsockets.
+ *
+ * libsockets is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * libsockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsockets.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+// Socket tuning profiles. A profile is applied to every socket the library
+// creates or accepts; the buffers of a SOCK_BUF_AUTO profile are sized once
+// the connection is up, from the RTT measured by the handshake.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netinet/tcp.h>
+
+#include "sockets_internal.h"
+
+#define SOCK_OPTS_BUF_MAX (64 << 20) // Largest automatically sized socket buffer
+
+typedef struct opts_profile_s {
+        const char *name;
+        sock_opts_t opts;
+} opts_profile_t;
+
+static const opts_profile_t profile[] = {
+    {"default", {0}},
+    {"latency", {.nodelay = true, .notsent_lowat = 16 << 10, .backlog = SOMAXCONN}},
+    {"bulk",
+     {.sndbuf = SOCK_BUF_AUTO, .rcvbuf = SOCK_BUF_AUTO, .rate = 1250000000, .backlog = SOMAXCONN}}, // 10 Gbit/s
+    {"wan",
+     {.nodelay       = true,
+      .sndbuf        = SOCK_BUF_AUTO,
+      .rcvbuf        = SOCK_BUF_AUTO,
+      .rate          = 125000000, // 1 Gbit/s
+      .notsent_lowat = 128 << 10,
+      .keepalive     = 60,
+      .backlog       = SOMAXCONN,
+      .congestion    = "bbr"}},
+};
+
+static sock_opts_t opts_default; // "default": leave everything to the system
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+// LOCAL PROTOTYPES
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+static bool is_tcp(int fd_);
+static int set_int(int fd_, int level_, int name_, int val_);
+static int autosize_buf(int fd_, int name_, int force_, const char *tcp_mem_, const char *core_max_, uint64_t bdp_);
+static uint64_t sysctl_read(const char *path_, int field_);
+
+//------------------------------------------------------------------------------
+// Fill this_ with the built-in profile name_: "default" (system settings),
+// "latency" (no Nagle delay, short unsent queue), "bulk" (buffers sized for
+// a 10 Gbit/s bandwidth-delay product) or "wan" (as bulk for 1 Gbit/s, with
+// BBR and keepalive). Fails with EINVAL for any other name.
+//------------------------------------------------------------------------------
+int sock_opts_profile(sock_opts_t *this_, const char *name_)
+{
+        size_t i;
+
+        for (i = 0; i < sizeof(profile) / sizeof(profile[0]); i++) {
+                if (strcmp(profile[i].name, name_) == 0) {
+                        *this_ = profile[i].opts;
+                        return 0;
+                }
+        }
+        errno = EINVAL;
+        return -1;
+}
+
+//------------------------------------------------------------------------------
+// Set the profile copied by the servers and clients constructed from now on
+// (NULL restores "default"). Not synchronized: set it before creating them.
+//------------------------------------------------------------------------------
+void sock_opts_set_default(const sock_opts_t *opts_)
+{
+        if (opts_)
+                opts_default = *opts_;
+        else
+                memset(&opts_default, 0, sizeof(opts_default));
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+const sock_opts_t *sock_opts_default(void) { return &opts_default; }
+
+//------------------------------------------------------------------------------
+// Apply the fixed settings of this_ to socket fd_; TCP settings are skipped on
+// Unix domain sockets and SOCK_BUF_AUTO buffers are left to
+// sock_opts_autosize. Every setting is tried; the first failure is returned.
+//------------------------------------------------------------------------------
+int sock_opts_apply(const sock_opts_t *this_, int fd_)
+{
+        int rc = 0;
+
+        if (this_->sndbuf > 0 && set_int(fd_, SOL_SOCKET, SO_SNDBUF, this_->sndbuf) < 0)
+                rc = -1;
+        if (this_->rcvbuf > 0 && set_int(fd_, SOL_SOCKET, SO_RCVBUF, this_->rcvbuf) < 0)
+                rc = -1;
+
+        if (!is_tcp(fd_))
+                return rc;
+
+        if (this_->nodelay && set_int(fd_, IPPROTO_TCP, TCP_NODELAY, 1) < 0)
+                rc = -1;
+        if (this_->notsent_lowat > 0 && set_int(fd_, IPPROTO_TCP, TCP_NOTSENT_LOWAT, this_->notsent_lowat) < 0)
+                rc = -1;
+        if (this_->keepalive > 0 && (set_int(fd_, SOL_SOCKET, SO_KEEPALIVE, 1) < 0 ||
+                                     set_int(fd_, IPPROTO_TCP, TCP_KEEPIDLE, this_->keepalive) < 0))
+                rc = -1;
+        if (this_->congestion[0] && setsockopt(fd_, IPPROTO_TCP, TCP_CONGESTION, this_->congestion,
+                                               strnlen(this_->congestion, sizeof(this_->congestion))) < 0)
+                rc = -1;
+
+        return rc;
+}
+
+//------------------------------------------------------------------------------
+// Size the SOCK_BUF_AUTO buffers of the connected socket fd_ to the
+// bandwidth-delay product of this_->rate and the smoothed RTT. Setting a
+// buffer turns the kernel's autotuning off for it, so that is only done where
+// autotuning could not reach the product (see autosize_buf).
+//------------------------------------------------------------------------------
+int sock_opts_autosize(const sock_opts_t *this_, int fd_)
+{
+        struct tcp_info ti;
+        socklen_t len = sizeof(ti);
+        uint64_t bdp;
+        int rc = 0;
+
+        if ((this_->sndbuf != SOCK_BUF_AUTO && this_->rcvbuf != SOCK_BUF_AUTO) || !is_tcp(fd_))
+                return 0;
+
+        if (getsockopt(fd_, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0)
+                return -1;
+        if (ti.tcpi_rtt == 0) // Not measured yet
+                return 0;
+
+        bdp = this_->rate * ti.tcpi_rtt / 1000000; // tcpi_rtt is in us
+        if (bdp > SOCK_OPTS_BUF_MAX)
+                bdp = SOCK_OPTS_BUF_MAX;
+
+        if (this_->sndbuf == SOCK_BUF_AUTO &&
+            autosize_buf(fd_, SO_SNDBUF, SO_SNDBUFFORCE, "/proc/sys/net/ipv4/tcp_wmem", "/proc/sys/net/core/wmem_max",
+                         bdp) < 0)
+                rc = -1;
+        if (this_->rcvbuf == SOCK_BUF_AUTO &&
+            autosize_buf(fd_, SO_RCVBUF, SO_RCVBUFFORCE, "/proc/sys/net/ipv4/tcp_rmem", "/proc/sys/net/core/rmem_max",
+                         bdp) < 0)
+                rc = -1;
+
+        return rc;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Helper Procedures
+////////////////////////////////////////////////////////////////////////////////
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static bool is_tcp(int fd_)
+{
+        int domain;
+        socklen_t len = sizeof(domain);
+
+        if (getsockopt(fd_, SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0)
+                return false;
+        return domain == AF_INET || domain == AF_INET6;
+}
+
+//------------------------------------------------------------------------------
+// Set buffer name_ of fd_ to bdp_ bytes unless autotuning already gets there
+// (up to the third field of tcp_mem_) or the buffer is as large. Without the
+// privilege for the force_ variant the request is capped at core_max_; it is
+// skipped if that is no better than autotuning.
+//------------------------------------------------------------------------------
+static int autosize_buf(int fd_, int name_, int force_, const char *tcp_mem_, const char *core_max_, uint64_t bdp_)
+{
+        uint64_t cap;
+        socklen_t len = sizeof(int);
+        int cur;
+
+        if (bdp_ <= sysctl_read(tcp_mem_, 2))
+                return 0;
+        // The kernel reports (and grants) twice the requested size
+        if (getsockopt(fd_, SOL_SOCKET, name_, &cur, &len) == 0 && (uint64_t)cur / 2 >= bdp_)
+                return 0;
+
+        if (set_int(fd_, SOL_SOCKET, force_, (int)bdp_) == 0)
+                return 0;
+
+        if ((cap = sysctl_read(core_max_, 0)) != 0 && cap < bdp_) {
+                if (cap <= sysctl_read(tcp_mem_, 2))
+                        return 0;
+                bdp_ = cap;
+        }
+        return set_int(fd_, SOL_SOCKET, name_, (int)bdp_);
+}
+
+//------------------------------------------------------------------------------
+// Field field_ of the numeric sysctl file path_; 0 if it cannot be read
+//------------------------------------------------------------------------------
+static uint64_t sysctl_read(const char *path_, int field_)
+{
+        unsigned long long v = 0;
+        FILE *fp;
+        int i;
+
+        if ((fp = fopen(path_, "re")) == NULL)
+                return 0;
+        for (i = 0; i <= field_; i++) {
+                if (fscanf(fp, "%llu", &v) != 1) {
+                        v = 0;
+                        break;
+                }
+        }
+        fclose(fp);
+
+        return v;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static int set_int(int fd_, int level_, int name_, int val_)
+{
+        return setsockopt(fd_, level_, name_, &val_, sizeof(val_));
+}
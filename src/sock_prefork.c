@@ -0,0 +1,433 @@
+/*
+ * Copyright (c) 2016-2017,2019 Jason Graham <jgraham@compukix.net>
+ *
+ * This file is part of libsockets.
+ *
+ * libsockets is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * libsockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsockets.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+#include "sockets_internal.h"
+
+#define SOCK_PREFORK_READY 'R'    // Worker -> master: waiting for a connection
+#define SOCK_PREFORK_POLL_MS 1000 // Supervision interval
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+// LOCAL PROTOTYPES
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+static int prefork_spawn(sock_prefork_t *this_, sock_prefork_worker_t *w_);
+static void prefork_worker(sock_prefork_t *this_, int fd_) __attribute__((noreturn));
+static void prefork_supervise(sock_prefork_t *this_);
+static void prefork_control(sock_prefork_t *this_, sock_prefork_worker_t *w_);
+static void prefork_dispatch(sock_prefork_t *this_);
+static void prefork_detach(sock_prefork_t *this_, sock_prefork_worker_t *w_);
+static void prefork_shutdown(sock_prefork_t *this_);
+
+static int send_fd(int sock_, int fd_);
+static int recv_fd(int sock_);
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+/// sock_prefork_t
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_prefork_ctor(sock_prefork_t *this_, uint16_t port_, size_t nworker_, sock_prefork_fn_t handler_,
+                      void *arg_)
+{
+        int n, backlog;
+        size_t i;
+        socklen_t addr_len;
+
+        memset(this_, 0, sizeof(*this_));
+
+        this_->nworker = nworker_ ? nworker_ : 1;
+        this_->handler = handler_;
+        this_->arg     = arg_;
+        this_->run     = 1;
+
+        ERR_RET(n, sock_server_ctor(&this_->server, port_, NULL));
+        ERR_RET(n, sock_server_bind(&this_->server));
+        backlog = this_->server.cc_client->opts.backlog;
+        ERR_RET(n, listen(this_->server.fd, backlog > 0 ? backlog : SOMAXCONN));
+        ERR_RET(n, fcntl(this_->server.fd, F_SETFL, fcntl(this_->server.fd, F_GETFL) | O_NONBLOCK));
+
+        addr_len = sizeof(this_->server.addr);
+        ERR_RET(n, getsockname(this_->server.fd, &this_->server.addr.sa, &addr_len));
+        this_->port = ntohs(this_->server.addr.in.sin_port);
+
+        if ((this_->worker = calloc(this_->nworker, sizeof(*this_->worker))) == NULL) {
+                errno = ENOMEM;
+                return -1;
+        }
+        for (i = 0; i < this_->nworker; i++)
+                this_->worker[i].fd = -1;
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_prefork_dtor(sock_prefork_t *this_)
+{
+        int n;
+
+        if (this_->server.flags & SOCK_SF_PARENT)
+                prefork_shutdown(this_);
+
+        ERR_RET(n, sock_server_dtor(&this_->server));
+        free(this_->worker);
+
+        memset(this_, 0, sizeof(*this_));
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_prefork_run(sock_prefork_t *this_)
+{
+        struct pollfd *pfd;
+        size_t i;
+        int n, rc = 0;
+
+        // One slot per worker control socket plus the listening socket
+        if ((pfd = calloc(this_->nworker + 1, sizeof(*pfd))) == NULL) {
+                errno = ENOMEM;
+                return -1;
+        }
+
+        while (this_->run) {
+                prefork_supervise(this_);
+
+                for (i = 0; i < this_->nworker; i++) {
+                        pfd[i].fd     = this_->worker[i].fd;
+                        pfd[i].events = POLLIN;
+                }
+                // Only accept while a worker is free; pending connects wait in the backlog
+                pfd[i].fd     = this_->nidle > 0 ? this_->server.fd : -1;
+                pfd[i].events = POLLIN;
+
+                n = poll(pfd, this_->nworker + 1, SOCK_PREFORK_POLL_MS);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        rc = -1;
+                        break;
+                }
+
+                for (i = 0; i < this_->nworker; i++) {
+                        if (pfd[i].fd >= 0 && pfd[i].revents)
+                                prefork_control(this_, this_->worker + i);
+                }
+                if (pfd[i].fd >= 0 && pfd[i].revents & POLLIN)
+                        prefork_dispatch(this_);
+        }
+
+        free(pfd);
+        prefork_shutdown(this_);
+
+        return rc;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+void sock_prefork_stop(sock_prefork_t *this_) { this_->run = 0; }
+
+//------------------------------------------------------------------------------
+// Start a worker process in slot w_
+//------------------------------------------------------------------------------
+static int prefork_spawn(sock_prefork_t *this_, sock_prefork_worker_t *w_)
+{
+        int n, sv[2];
+        pid_t pid;
+        size_t i;
+
+        ERR_RET(n, socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv));
+
+        if ((pid = fork()) < 0) {
+                close(sv[0]);
+                close(sv[1]);
+                return -1;
+        }
+
+        if (pid == 0) { // Worker
+                close(sv[0]);
+                for (i = 0; i < this_->nworker; i++) {
+                        if (this_->worker[i].fd >= 0)
+                                close(this_->worker[i].fd);
+                }
+                prefork_worker(this_, sv[1]);
+        }
+
+        close(sv[1]);
+
+        w_->pid   = pid;
+        w_->fd    = sv[0];
+        w_->state = SOCK_WS_START;
+        this_->nspawn++;
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Worker main loop: report ready, receive a connection from the master, answer
+// the client request on it and run the handler
+//------------------------------------------------------------------------------
+static void prefork_worker(sock_prefork_t *this_, int fd_)
+{
+        sock_server_t *server = &this_->server;
+        char ready            = SOCK_PREFORK_READY;
+        int n;
+
+        // Workers never accept; the listening socket belongs to the master
+        close(server->fd);
+        server->fd = 0;
+        unset_bit(server->flags, SOCK_SF_PARENT | SOCK_SF_MASTER);
+
+        free(this_->worker);
+        this_->worker  = NULL;
+        this_->nworker = 0;
+
+        while (this_->run) {
+                if (send(fd_, &ready, sizeof(ready), MSG_NOSIGNAL) < 0)
+                        break;
+                if ((server->cc_client->fd = recv_fd(fd_)) < 0) { // Master closed the pool
+                        server->cc_client->fd = 0;
+                        break;
+                }
+
+                n = sock_server_handshake(server, this_->port);
+                if (n == SOCK_OPTS_REQ_WPORT)
+                        this_->handler(server, this_->arg);
+                else if (n == SOCK_OPTS_SIGTERM)
+                        kill(getppid(), SIGTERM);
+
+                comm_channel_close(server->cc_client);
+        }
+
+        close(fd_);
+        sock_server_dtor(server);
+        exit(0);
+}
+
+//------------------------------------------------------------------------------
+// Reap exited workers and restart empty slots
+//------------------------------------------------------------------------------
+static void prefork_supervise(sock_prefork_t *this_)
+{
+        sock_prefork_worker_t *w;
+        pid_t pid;
+        size_t i;
+
+        for (i = 0; i < this_->nworker; i++) {
+                w = this_->worker + i;
+
+                if (w->fd < 0 && w->pid > 0) {
+                        pid = waitpid(w->pid, NULL, WNOHANG);
+                        if (pid == w->pid || (pid < 0 && errno == ECHILD))
+                                w->pid = 0;
+                }
+
+                if (w->pid == 0 && this_->run)
+                        prefork_spawn(this_, w);
+        }
+}
+
+//------------------------------------------------------------------------------
+// Handle a message or hangup on a worker control socket
+//------------------------------------------------------------------------------
+static void prefork_control(sock_prefork_t *this_, sock_prefork_worker_t *w_)
+{
+        char msg;
+        ssize_t n;
+
+        n = recv(w_->fd, &msg, sizeof(msg), MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                return;
+
+        if (n <= 0) { // Worker exited
+                prefork_detach(this_, w_);
+                return;
+        }
+
+        if (msg == SOCK_PREFORK_READY && w_->state != SOCK_WS_IDLE) {
+                if (w_->state == SOCK_WS_BUSY)
+                        this_->nbusy--;
+                w_->state = SOCK_WS_IDLE;
+                this_->nidle++;
+        }
+}
+
+//------------------------------------------------------------------------------
+// Accept pending connections and hand each one to an idle worker
+//------------------------------------------------------------------------------
+static void prefork_dispatch(sock_prefork_t *this_)
+{
+        sock_prefork_worker_t *w;
+        size_t i = 0;
+        int fd;
+
+        while (this_->nidle > 0) {
+                if ((fd = accept4(this_->server.fd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return;
+                }
+                sock_opts_apply(&this_->server.cc_client->opts, fd);
+                sock_opts_autosize(&this_->server.cc_client->opts, fd);
+
+                for (; i < this_->nworker; i++) {
+                        w = this_->worker + i;
+                        if (w->state != SOCK_WS_IDLE)
+                                continue;
+
+                        this_->nidle--;
+                        if (send_fd(w->fd, fd) < 0) {
+                                w->state = SOCK_WS_START;
+                                prefork_detach(this_, w);
+                                continue;
+                        }
+                        w->state = SOCK_WS_BUSY;
+                        this_->nbusy++;
+                        break;
+                }
+
+                // The worker holds its own reference now (or none could take it)
+                close(fd);
+        }
+}
+
+//------------------------------------------------------------------------------
+// Forget a worker whose control socket hung up; it is reaped and restarted by
+// prefork_supervise
+//------------------------------------------------------------------------------
+static void prefork_detach(sock_prefork_t *this_, sock_prefork_worker_t *w_)
+{
+        if (w_->state == SOCK_WS_IDLE)
+                this_->nidle--;
+        else if (w_->state == SOCK_WS_BUSY)
+                this_->nbusy--;
+
+        close(w_->fd);
+        w_->fd    = -1;
+        w_->state = SOCK_WS_START;
+}
+
+//------------------------------------------------------------------------------
+// Close all control sockets and wait for the workers; idle workers exit at
+// once and busy ones after finishing their connection
+//------------------------------------------------------------------------------
+static void prefork_shutdown(sock_prefork_t *this_)
+{
+        sock_prefork_worker_t *w;
+        size_t i;
+
+        for (i = 0; i < this_->nworker; i++) {
+                w = this_->worker + i;
+                if (w->fd >= 0)
+                        prefork_detach(this_, w);
+        }
+
+        for (i = 0; i < this_->nworker; i++) {
+                w = this_->worker + i;
+                while (w->pid > 0 && waitpid(w->pid, NULL, 0) < 0 && errno == EINTR)
+                        ;
+                w->pid = 0;
+        }
+}
+
+//------------------------------------------------------------------------------
+// Pass a file descriptor over a Unix socket
+//------------------------------------------------------------------------------
+static int send_fd(int sock_, int fd_)
+{
+        char byte = 0;
+        struct iovec iov;
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        union {
+                struct cmsghdr align;
+                char buf[CMSG_SPACE(sizeof(int))];
+        } ctl;
+
+        iov.iov_base = &byte;
+        iov.iov_len  = sizeof(byte);
+
+        memset(&msg, 0, sizeof(msg));
+        memset(&ctl, 0, sizeof(ctl));
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+
+        cmsg             = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd_, sizeof(int));
+
+        return sendmsg(sock_, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+//------------------------------------------------------------------------------
+// Receive a file descriptor passed with send_fd
+//------------------------------------------------------------------------------
+static int recv_fd(int sock_)
+{
+        char byte;
+        int fd;
+        ssize_t n;
+        struct iovec iov;
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        union {
+                struct cmsghdr align;
+                char buf[CMSG_SPACE(sizeof(int))];
+        } ctl;
+
+        iov.iov_base = &byte;
+        iov.iov_len  = sizeof(byte);
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+
+        while ((n = recvmsg(sock_, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+                ;
+        if (n <= 0)
+                return -1;
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                errno = EPROTO;
+                return -1;
+        }
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+        return fd;
+}
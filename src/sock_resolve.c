@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2016-2017,2019 Jason Graham <jgraham@compukix.net>
+ *
+ * This file is part of libsockets.
+ *
+ * libsockets is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * libsockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsockets.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+// Host name resolution with getaddrinfo. Results are kept in a process wide
+// cache for a fixed time to live. Concurrent lookups of the same name wait
+// for the one already in flight instead of each querying the resolver.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <time.h>
+
+#include "sockets_internal.h"
+
+#define SOCK_RESOLVE_TTL 60 // Default cache time to live (seconds)
+
+typedef struct resolve_entry_s {
+        struct resolve_entry_s *next;
+        char *name;
+        struct in_addr addr;
+        int err;         // errno of the last lookup (0 on success)
+        bool busy;       // Lookup in flight
+        unsigned nwait;  // Threads waiting for the lookup
+        time_t expires;  // CLOCK_MONOTONIC second the entry goes stale
+} resolve_entry_t;
+
+typedef struct resolve_job_s {
+        char *name;
+        sock_resolve_fn_t fn;
+        void *arg;
+} resolve_job_t;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond  = PTHREAD_COND_INITIALIZER;
+static resolve_entry_t *cache     = NULL;
+static unsigned cache_ttl         = SOCK_RESOLVE_TTL;
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+// LOCAL PROTOTYPES
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+static resolve_entry_t *cache_find(const char *name_, time_t now_);
+static bool cache_hit(const char *name_, struct in_addr *addr_);
+static int resolve_lookup(const char *name_, struct in_addr *addr_);
+static void *resolve_main(void *arg_);
+static time_t now_sec(void);
+
+//------------------------------------------------------------------------------
+// Resolve name_ (host name or dotted address) to an IPv4 address. Returns -1
+// with errno set on failure; ENOENT if the name does not exist.
+//------------------------------------------------------------------------------
+int sock_resolve(const char *name_, struct in_addr *addr_)
+{
+        resolve_entry_t *e;
+        time_t now = now_sec();
+        int err;
+
+        pthread_mutex_lock(&cache_lock);
+
+        if ((e = cache_find(name_, now)) == NULL) {
+                if ((e = calloc(1, sizeof(*e))) == NULL || (e->name = strdup(name_)) == NULL) {
+                        pthread_mutex_unlock(&cache_lock);
+                        free(e);
+                        return -1;
+                }
+                e->next = cache;
+                cache   = e;
+        }
+
+        if (e->busy) { // Share the lookup in flight
+                e->nwait++;
+                while (e->busy)
+                        pthread_cond_wait(&cache_cond, &cache_lock);
+                e->nwait--;
+        } else if (e->err || now >= e->expires) {
+                e->busy = true;
+                pthread_mutex_unlock(&cache_lock);
+                err = resolve_lookup(name_, &e->addr) < 0 ? errno : 0;
+                pthread_mutex_lock(&cache_lock);
+
+                e->err     = err;
+                e->expires = err ? 0 : now_sec() + cache_ttl;
+                e->busy    = false;
+                pthread_cond_broadcast(&cache_cond);
+        }
+
+        if ((err = e->err) == 0)
+                *addr_ = e->addr;
+        pthread_mutex_unlock(&cache_lock);
+
+        if (err) {
+                errno = err;
+                return -1;
+        }
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Resolve name_ without blocking the caller. fn_ (if not NULL) is called with
+// the result: right away on a cache hit, otherwise from a helper thread.
+// Passing fn_ = NULL just warms the cache.
+//------------------------------------------------------------------------------
+int sock_resolve_async(const char *name_, sock_resolve_fn_t fn_, void *arg_)
+{
+        resolve_job_t *job;
+        struct in_addr addr;
+        pthread_attr_t attr;
+        pthread_t thread;
+        int n;
+
+        if (cache_hit(name_, &addr)) {
+                if (fn_)
+                        fn_(name_, &addr, 0, arg_);
+                return 0;
+        }
+
+        if ((job = calloc(1, sizeof(*job))) == NULL || (job->name = strdup(name_)) == NULL) {
+                free(job);
+                return -1;
+        }
+        job->fn  = fn_;
+        job->arg = arg_;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        n = pthread_create(&thread, &attr, resolve_main, job);
+        pthread_attr_destroy(&attr);
+
+        if (n != 0) {
+                free(job->name);
+                free(job);
+                errno = n;
+                return -1;
+        }
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Set the time (seconds) resolved names are cached for; 0 disables caching
+//------------------------------------------------------------------------------
+void sock_resolve_ttl(unsigned ttl_)
+{
+        pthread_mutex_lock(&cache_lock);
+        cache_ttl = ttl_;
+        pthread_mutex_unlock(&cache_lock);
+}
+
+//------------------------------------------------------------------------------
+// Forget all cached names
+//------------------------------------------------------------------------------
+void sock_resolve_flush(void)
+{
+        resolve_entry_t *e;
+
+        pthread_mutex_lock(&cache_lock);
+        for (e = cache; e; e = e->next)
+                e->expires = 0;
+        cache_find(NULL, 0); // Free all idle entries
+        pthread_mutex_unlock(&cache_lock);
+}
+
+//------------------------------------------------------------------------------
+// Find the entry for name_, freeing stale entries of other names on the way.
+// Must be called with cache_lock held.
+//------------------------------------------------------------------------------
+static resolve_entry_t *cache_find(const char *name_, time_t now_)
+{
+        resolve_entry_t **p = &cache, *e;
+
+        while ((e = *p)) {
+                if (name_ && strcmp(e->name, name_) == 0)
+                        return e;
+
+                if (!e->busy && e->nwait == 0 && now_ >= e->expires) {
+                        *p = e->next;
+                        free(e->name);
+                        free(e);
+                } else {
+                        p = &e->next;
+                }
+        }
+        return NULL;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static bool cache_hit(const char *name_, struct in_addr *addr_)
+{
+        resolve_entry_t *e;
+        time_t now = now_sec();
+        bool hit   = false;
+
+        pthread_mutex_lock(&cache_lock);
+        if ((e = cache_find(name_, now)) && !e->busy && !e->err && now < e->expires) {
+                *addr_ = e->addr;
+                hit    = true;
+        }
+        pthread_mutex_unlock(&cache_lock);
+
+        return hit;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static int resolve_lookup(const char *name_, struct in_addr *addr_)
+{
+        struct addrinfo hints, *res;
+        int n;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family   = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+
+        if ((n = getaddrinfo(name_, NULL, &hints, &res)) != 0) {
+                switch (n) {
+                case EAI_SYSTEM:
+                        break;
+                case EAI_AGAIN:
+                        errno = EAGAIN;
+                        break;
+                case EAI_MEMORY:
+                        errno = ENOMEM;
+                        break;
+                default:
+                        errno = ENOENT;
+                        break;
+                }
+                return -1;
+        }
+
+        *addr_ = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+        freeaddrinfo(res);
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static void *resolve_main(void *arg_)
+{
+        resolve_job_t *job = (resolve_job_t *)arg_;
+        struct in_addr addr;
+        int err;
+
+        err = sock_resolve(job->name, &addr) < 0 ? errno : 0;
+        if (job->fn)
+                job->fn(job->name, err ? NULL : &addr, err, job->arg);
+
+        free(job->name);
+        free(job);
+
+        return NULL;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static time_t now_sec(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec;
+}
@@ -0,0 +1,628 @@
+/*
+ * Copyright (c) 2016-2017,2019 Jason Graham <jgraham@compukix.net>
+ *
+ * This file is part of libsockets.
+ *
+ * libsockets is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * libsockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsockets.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+// Shared memory transport for peers on the same host. The client creates a
+// memfd holding one single-producer/single-consumer byte ring per direction
+// and passes it over the Unix socket (SCM_RIGHTS); from then on the framed
+// byte stream goes through the rings and the socket is only watched to notice
+// the peer going away.
+//
+// Segment layout: a control page with the segment header and both ring
+// positions, then the data of ring 0 (client to server) and ring 1 (server to
+// client). Each data area is mapped twice back to back, so a read or write
+// never has to be split at the end of the ring. A side that finds its ring
+// empty (or full) spins briefly, then sleeps on a futex in the control page
+// that the other side only wakes when told someone is waiting.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "sockets_internal.h"
+
+#define SOCK_SHM_MAGIC 0x6d687331 // "1shm"
+#define SOCK_SHM_SPIN 1000        // Polls of an empty/full ring before sleeping (SMP)
+#define SOCK_SHM_WAIT_MS 100      // Sleep slice between checks of the peer
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() atomic_signal_fence(memory_order_seq_cst)
+#endif
+
+typedef struct shm_ring_s {
+        _Atomic uint64_t tail;      // Producer position (bytes ever written)
+        _Atomic uint32_t data_seq;  // Futex the consumer sleeps on
+        _Atomic uint32_t rx_wait;   // Consumer is (about to go) asleep
+        unsigned char pad0[48];
+        _Atomic uint64_t head;      // Consumer position (bytes ever read)
+        _Atomic uint32_t space_seq; // Futex the producer sleeps on when the ring is full
+        _Atomic uint32_t tx_wait;   // Producer is (about to go) asleep
+        unsigned char pad1[48];
+} shm_ring_t;
+
+typedef struct shm_ctrl_s {
+        uint32_t magic;
+        uint32_t pad;
+        uint64_t len;  // Length of each ring (power of 2, page multiple)
+        unsigned char pad0[48];
+        shm_ring_t ring[2];
+} shm_ctrl_t;
+
+struct sock_shm_s {
+        int sock;                // Unix socket the segment came over
+        shm_ctrl_t *ctrl;        // Control page
+        size_t page;             // Size of the control page mapping
+        size_t len;              // Ring length
+        int nspin;               // Polls of an empty/full ring before sleeping
+        shm_ring_t *tx;          // Ring written by this side
+        shm_ring_t *rx;          // Ring read by this side
+        unsigned char *tx_data;  // tx data, mapped twice
+        unsigned char *rx_data;  // rx data, mapped twice
+};
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+// LOCAL PROTOTYPES
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+static sock_shm_t *shm_map(int sock_, int memfd_, bool server_);
+static void *shm_map_ring(int memfd_, off_t offset_, size_t len_);
+static size_t shm_tx_space(sock_shm_t *this_, unsigned char **ptr_, const sock_deadline_t *dl_);
+static void shm_tx_commit(sock_shm_t *this_, size_t n_);
+static size_t shm_rx_data(sock_shm_t *this_, unsigned char **ptr_, const sock_deadline_t *dl_);
+static void shm_rx_consume(sock_shm_t *this_, size_t n_);
+static int shm_wait(sock_shm_t *this_, _Atomic uint64_t *pos_, uint64_t old_, _Atomic uint32_t *seq_,
+                    _Atomic uint32_t *wait_, const sock_deadline_t *dl_);
+static void shm_wake(_Atomic uint32_t *seq_, _Atomic uint32_t *wait_);
+static bool shm_peer_alive(const sock_shm_t *this_);
+
+//------------------------------------------------------------------------------
+// Client side: create a segment with rings of len_ bytes (rounded up to a
+// power of 2) and send it to the peer over socket sock_, attached to the
+// setup frame frame_
+//------------------------------------------------------------------------------
+sock_shm_t *sock_shm_offer(int sock_, const void *frame_, size_t frame_len_, size_t len_)
+{
+        sock_shm_t *this_ = NULL;
+        shm_ctrl_t *ctrl;
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t len  = page;
+        int memfd;
+
+        struct iovec iov;
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        union {
+                struct cmsghdr align;
+                char buf[CMSG_SPACE(sizeof(int))];
+        } ctl;
+        ssize_t n;
+
+        while (len < len_)
+                len *= 2;
+
+        if ((memfd = memfd_create("libsockets-shm", MFD_CLOEXEC)) < 0)
+                return NULL;
+        if (ftruncate(memfd, page + 2 * len) < 0)
+                goto fini;
+
+        // Initialize the control page
+        if ((ctrl = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0)) == MAP_FAILED)
+                goto fini;
+        ctrl->magic = SOCK_SHM_MAGIC;
+        ctrl->len   = len;
+        munmap(ctrl, page);
+
+        if ((this_ = shm_map(sock_, memfd, false)) == NULL)
+                goto fini;
+
+        iov.iov_base = (void *)frame_;
+        iov.iov_len  = frame_len_;
+
+        memset(&msg, 0, sizeof(msg));
+        memset(&ctl, 0, sizeof(ctl));
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+
+        cmsg             = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+        while ((n = sendmsg(sock_, &msg, MSG_NOSIGNAL)) < 0 &&
+               (errno == EINTR || (errno == EAGAIN && trans_wait(sock_, POLLOUT, NULL) == 0)))
+                ;
+        if (n != (ssize_t)frame_len_) { // The frame is tiny; a short send means the socket is broken
+                if (n >= 0)
+                        errno = ECOMM;
+                sock_shm_free(&this_);
+        }
+
+fini:
+        n = errno;
+        close(memfd); // The mappings (and the peer) keep the segment alive
+        errno = n;
+        return this_;
+}
+
+//------------------------------------------------------------------------------
+// Server side: receive the frame_len_ byte setup frame into frame_ from
+// socket sock_ and map the segment attached to it
+//------------------------------------------------------------------------------
+sock_shm_t *sock_shm_accept(int sock_, void *frame_, size_t frame_len_)
+{
+        sock_shm_t *this_;
+        int memfd = -1;
+        size_t len = 0;
+
+        struct iovec iov;
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        union {
+                struct cmsghdr align;
+                char buf[CMSG_SPACE(sizeof(int))];
+        } ctl;
+        ssize_t n;
+
+        while (len < frame_len_) {
+                iov.iov_base = frame_ + len;
+                iov.iov_len  = frame_len_ - len;
+
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov        = &iov;
+                msg.msg_iovlen     = 1;
+                msg.msg_control    = ctl.buf;
+                msg.msg_controllen = sizeof(ctl.buf);
+
+                if ((n = recvmsg(sock_, &msg, MSG_CMSG_CLOEXEC)) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN && trans_wait(sock_, POLLIN, NULL) == 0)
+                                continue;
+                        goto err;
+                } else if (n == 0) {
+                        errno = ECOMM;
+                        goto err;
+                }
+                len += n;
+
+                cmsg = CMSG_FIRSTHDR(&msg);
+                if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && memfd < 0)
+                        memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+        }
+
+        if (memfd < 0) {
+                errno = EPROTO;
+                return NULL;
+        }
+
+        this_ = shm_map(sock_, memfd, true);
+        n     = errno;
+        close(memfd);
+        errno = n;
+
+        return this_;
+
+err:
+        if (memfd >= 0)
+                close(memfd);
+        return NULL;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+void sock_shm_free(sock_shm_t **this_)
+{
+        sock_shm_t *s = *this_;
+
+        if (s) {
+                if (s->tx_data)
+                        munmap(s->tx_data, 2 * s->len);
+                if (s->rx_data)
+                        munmap(s->rx_data, 2 * s->len);
+                if (s->ctrl)
+                        munmap(s->ctrl, s->page);
+                free(s);
+        }
+        *this_ = NULL;
+}
+
+//------------------------------------------------------------------------------
+// Write all iovec segments to the ring, waiting for the peer to make room
+// as needed (until the deadline dl_, if any)
+//------------------------------------------------------------------------------
+ssize_t sock_shm_sendv(sock_shm_t *this_, const struct iovec *iov_, int iovcnt_, size_t *ntrans_,
+                       sock_deadline_t *dl_)
+{
+        unsigned char *p;
+        size_t len = 0, nt = 0;
+        size_t off = 0, k, m, c;
+        int i = 0;
+
+        while (1) {
+                while (i < iovcnt_ && off == iov_[i].iov_len) {
+                        i++;
+                        off = 0;
+                }
+                if (i == iovcnt_)
+                        break;
+
+                if ((k = shm_tx_space(this_, &p, dl_)) == 0)
+                        return -1;
+
+                // Fill the free space from as many segments as fit, so a small
+                // message is published (and its reader woken) once
+                for (m = 0; m < k && i < iovcnt_; m += c) {
+                        c = iov_[i].iov_len - off < k - m ? iov_[i].iov_len - off : k - m;
+                        memcpy(p + m, iov_[i].iov_base + off, c);
+                        if ((off += c) == iov_[i].iov_len) {
+                                i++;
+                                off = 0;
+                        }
+                }
+                shm_tx_commit(this_, m);
+                len += m;
+                nt++;
+                if (dl_)
+                        dl_->nbytes += m;
+        }
+
+        if (ntrans_)
+                *ntrans_ = nt;
+        return len;
+}
+
+//------------------------------------------------------------------------------
+// Read len_ bytes of file fd_ (from offset_) straight into the ring. Fails
+// with ENODATA if the file ends early.
+//------------------------------------------------------------------------------
+ssize_t sock_shm_sendfile(sock_shm_t *this_, int fd_, off_t offset_, size_t len_, size_t *ntrans_,
+                          sock_deadline_t *dl_)
+{
+        unsigned char *p;
+        size_t len = 0, nt = 0;
+        size_t k;
+        ssize_t n;
+
+        while (len < len_) {
+                if ((k = shm_tx_space(this_, &p, dl_)) == 0)
+                        return -1;
+                if (k > len_ - len)
+                        k = len_ - len;
+
+                nt++;
+                if ((n = pread(fd_, p, k, offset_ + len)) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                } else if (n == 0) {
+                        errno = ENODATA;
+                        return -1;
+                }
+                shm_tx_commit(this_, n);
+                len += n;
+                if (dl_)
+                        dl_->nbytes += n;
+        }
+
+        if (ntrans_)
+                *ntrans_ = nt;
+        return len;
+}
+
+//------------------------------------------------------------------------------
+// Read exactly n_ bytes from the ring into data_
+//------------------------------------------------------------------------------
+ssize_t sock_shm_recv(sock_shm_t *this_, void *data_, size_t n_, size_t *ntrans_, sock_deadline_t *dl_)
+{
+        unsigned char *p;
+        size_t len = 0, nt = 0;
+        size_t k;
+
+        while (len < n_) {
+                if ((k = shm_rx_data(this_, &p, dl_)) == 0)
+                        return -1;
+                if (k > n_ - len)
+                        k = n_ - len;
+
+                memcpy(data_ + len, p, k);
+                shm_rx_consume(this_, k);
+                len += k;
+                nt++;
+                if (dl_)
+                        dl_->nbytes += k;
+        }
+
+        if (ntrans_)
+                *ntrans_ = nt;
+        return len;
+}
+
+//------------------------------------------------------------------------------
+// Write the next len_ bytes of the ring to file fd_ at offset_, straight from
+// the shared mapping. Ring positions are not aligned, so O_DIRECT is cleared
+// for the duration.
+//------------------------------------------------------------------------------
+ssize_t sock_shm_recv_to_fd(sock_shm_t *this_, int fd_, off_t offset_, size_t len_, size_t *ntrans_,
+                            sock_deadline_t *dl_)
+{
+        unsigned char *p;
+        size_t len = 0, nt = 0;
+        size_t k;
+        ssize_t n, rc = -1;
+        int flags, err;
+
+        ERR_RET(flags, fcntl(fd_, F_GETFL));
+        if ((flags & O_DIRECT) && fcntl(fd_, F_SETFL, flags & ~O_DIRECT) < 0)
+                return -1;
+
+        while (len < len_) {
+                if ((k = shm_rx_data(this_, &p, dl_)) == 0)
+                        goto fini;
+                if (k > len_ - len)
+                        k = len_ - len;
+
+                nt++;
+                if ((n = pwrite(fd_, p, k, offset_ + len)) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        goto fini;
+                }
+                shm_rx_consume(this_, n);
+                len += n;
+                if (dl_)
+                        dl_->nbytes += n;
+        }
+        rc = len;
+
+fini:
+        if (flags & O_DIRECT) {
+                err = errno;
+                fcntl(fd_, F_SETFL, flags);
+                errno = err;
+        }
+        if (ntrans_)
+                *ntrans_ = nt;
+        return rc;
+}
+
+//------------------------------------------------------------------------------
+// Map the segment in memfd_; the server writes ring 1 and reads ring 0
+//------------------------------------------------------------------------------
+static sock_shm_t *shm_map(int sock_, int memfd_, bool server_)
+{
+        sock_shm_t *this_;
+        struct stat st;
+        size_t page = sysconf(_SC_PAGESIZE);
+
+        if ((this_ = calloc(1, sizeof(*this_))) == NULL)
+                return NULL;
+        this_->sock = sock_;
+        this_->page = page;
+
+        // Spinning only helps if the peer can run at the same time
+        this_->nspin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SOCK_SHM_SPIN : 0;
+
+        if ((this_->ctrl = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, memfd_, 0)) == MAP_FAILED) {
+                this_->ctrl = NULL;
+                goto err;
+        }
+
+        // Do not trust the peer's header beyond what the file can back
+        this_->len = this_->ctrl->len;
+        if (this_->ctrl->magic != SOCK_SHM_MAGIC || this_->len < page || (this_->len & (this_->len - 1)) ||
+            fstat(memfd_, &st) < 0 || (size_t)st.st_size != page + 2 * this_->len) {
+                errno = EPROTO;
+                goto err;
+        }
+
+        this_->tx = &this_->ctrl->ring[server_ ? 1 : 0];
+        this_->rx = &this_->ctrl->ring[server_ ? 0 : 1];
+
+        if ((this_->tx_data = shm_map_ring(memfd_, page + (server_ ? this_->len : 0), this_->len)) == NULL ||
+            (this_->rx_data = shm_map_ring(memfd_, page + (server_ ? 0 : this_->len), this_->len)) == NULL)
+                goto err;
+
+        return this_;
+
+err:
+        sock_shm_free(&this_);
+        return NULL;
+}
+
+//------------------------------------------------------------------------------
+// Map len_ bytes of memfd_ at offset_ twice in a row
+//------------------------------------------------------------------------------
+static void *shm_map_ring(int memfd_, off_t offset_, size_t len_)
+{
+        void *p;
+
+        if ((p = mmap(NULL, 2 * len_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+                return NULL;
+
+        if (mmap(p, len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memfd_, offset_) == MAP_FAILED ||
+            mmap(p + len_, len_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, memfd_, offset_) == MAP_FAILED) {
+                munmap(p, 2 * len_);
+                return NULL;
+        }
+
+        return p;
+}
+
+//------------------------------------------------------------------------------
+// Wait for free space in the tx ring; returns its length (0 on error) with
+// *ptr_ pointing at it. The indices live in memory the peer can write, so
+// any pair further apart than the ring fails with EPROTO.
+//------------------------------------------------------------------------------
+static size_t shm_tx_space(sock_shm_t *this_, unsigned char **ptr_, const sock_deadline_t *dl_)
+{
+        uint64_t tail = atomic_load_explicit(&this_->tx->tail, memory_order_relaxed);
+        uint64_t head;
+
+        while (1) {
+                head = atomic_load_explicit(&this_->tx->head, memory_order_acquire);
+                if (tail - head > this_->len) {
+                        errno = EPROTO;
+                        return 0;
+                }
+                if (tail - head < this_->len)
+                        break;
+                if (shm_wait(this_, &this_->tx->head, head, &this_->tx->space_seq, &this_->tx->tx_wait, dl_) < 0)
+                        return 0;
+        }
+
+        *ptr_ = this_->tx_data + (tail & (this_->len - 1));
+        return this_->len - (tail - head);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static void shm_tx_commit(sock_shm_t *this_, size_t n_)
+{
+        atomic_fetch_add_explicit(&this_->tx->tail, n_, memory_order_release);
+        shm_wake(&this_->tx->data_seq, &this_->tx->rx_wait);
+}
+
+//------------------------------------------------------------------------------
+// Wait for data in the rx ring; returns its length (0 on error) with *ptr_
+// pointing at it. Fails with EPROTO as shm_tx_space does.
+//------------------------------------------------------------------------------
+static size_t shm_rx_data(sock_shm_t *this_, unsigned char **ptr_, const sock_deadline_t *dl_)
+{
+        uint64_t head = atomic_load_explicit(&this_->rx->head, memory_order_relaxed);
+        uint64_t tail;
+
+        while (1) {
+                tail = atomic_load_explicit(&this_->rx->tail, memory_order_acquire);
+                if (tail - head > this_->len) {
+                        errno = EPROTO;
+                        return 0;
+                }
+                if (tail != head)
+                        break;
+                if (shm_wait(this_, &this_->rx->tail, tail, &this_->rx->data_seq, &this_->rx->rx_wait, dl_) < 0)
+                        return 0;
+        }
+
+        *ptr_ = this_->rx_data + (head & (this_->len - 1));
+        return tail - head;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static void shm_rx_consume(sock_shm_t *this_, size_t n_)
+{
+        atomic_fetch_add_explicit(&this_->rx->head, n_, memory_order_release);
+        shm_wake(&this_->rx->space_seq, &this_->rx->tx_wait);
+}
+
+//------------------------------------------------------------------------------
+// Wait until the peer moves *pos_ away from old_: spin for a while, then
+// announce the wait in *wait_ and sleep on the futex seq_. Fails with ECOMM
+// once the peer has closed its socket and with ETIMEDOUT once the deadline
+// dl_ (if any) has passed.
+//------------------------------------------------------------------------------
+static int shm_wait(sock_shm_t *this_, _Atomic uint64_t *pos_, uint64_t old_, _Atomic uint32_t *seq_,
+                    _Atomic uint32_t *wait_, const sock_deadline_t *dl_)
+{
+        struct timespec ts;
+        int64_t ms;
+        uint32_t seq;
+        int i;
+
+        for (i = 0; i < this_->nspin; i++) {
+                if (atomic_load_explicit(pos_, memory_order_acquire) != old_)
+                        return 0;
+                cpu_relax();
+        }
+
+        while (1) {
+                seq = atomic_load(seq_);
+                atomic_store(wait_, 1);
+                // Pairs with the fence in shm_wake: either the peer sees the flag or
+                // we see its update
+                if (atomic_load(pos_) != old_)
+                        break;
+
+                ms = SOCK_SHM_WAIT_MS;
+                if (dl_ && dl_->at) {
+                        if ((ms = dl_->at - sock_clock_ms()) <= 0) {
+                                atomic_store(wait_, 0);
+                                errno = ETIMEDOUT;
+                                return -1;
+                        }
+                        if (ms > SOCK_SHM_WAIT_MS)
+                                ms = SOCK_SHM_WAIT_MS;
+                }
+                ts.tv_sec  = ms / 1000;
+                ts.tv_nsec = (ms % 1000) * 1000000L;
+
+                if (syscall(SYS_futex, seq_, FUTEX_WAIT, seq, &ts, NULL, 0) < 0 && errno == ETIMEDOUT &&
+                    !shm_peer_alive(this_)) {
+                        atomic_store(wait_, 0);
+                        errno = ECOMM;
+                        return -1;
+                }
+                if (atomic_load(pos_) != old_)
+                        break;
+        }
+        atomic_store(wait_, 0);
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Wake the peer if it announced that it is waiting; called after publishing
+//------------------------------------------------------------------------------
+static void shm_wake(_Atomic uint32_t *seq_, _Atomic uint32_t *wait_)
+{
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(wait_, memory_order_relaxed)) {
+                atomic_fetch_add(seq_, 1);
+                syscall(SYS_futex, seq_, FUTEX_WAKE, 1, NULL, NULL, 0);
+        }
+}
+
+//------------------------------------------------------------------------------
+// The peer holds its end of the setup socket for as long as it uses the rings
+//------------------------------------------------------------------------------
+static bool shm_peer_alive(const sock_shm_t *this_)
+{
+        struct pollfd pfd = {this_->sock, POLLRDHUP, 0};
+
+        if (poll(&pfd, 1, 0) < 0)
+                return true;
+        return !(pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
@@ -0,0 +1,439 @@
+/*
+ * Copyright (c) 2016-2017,2019 Jason Graham <jgraham@compukix.net>
+ *
+ * This file is part of libsockets.
+ *
+ * libsockets is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * libsockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsockets.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+// io_uring transport backend for comm_channel_t. Each channel owns a small
+// ring with its socket registered as fixed file 0. Buffer 0 is a header slot
+// embedded in the ring and buffer 1 is the channel receive buffer. A send is
+// submitted as one linked chain (header and payload segments) and all of its
+// completions are reaped with a single io_uring_enter call.
+
+#include <assert.h>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "sockets_internal.h"
+
+#define SOCK_URING_ENTRIES 16  // Submission queue depth (max ops per batch)
+#define SOCK_URING_HDR_LEN 64  // Size of the registered header slot
+
+struct sock_uring_s {
+        int ring_fd; // io_uring instance
+        int fd;      // Channel socket; registered as fixed file 0
+
+        // Submission queue
+        void *sq_ptr;
+        size_t sq_len;
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        struct io_uring_sqe *sqes;
+        size_t sqes_len;
+
+        // Completion queue
+        void *cq_ptr;
+        size_t cq_len;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        struct io_uring_cqe *cqes;
+
+        struct iovec reg[2]; // Registered buffers: header slot and channel buffer
+        bool reg_ok;         // Buffers currently registered
+        unsigned char hdr[SOCK_URING_HDR_LEN] __attribute__((aligned(64)));
+};
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+// LOCAL PROTOTYPES
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+static inline int __io_uring_setup(unsigned entries_, struct io_uring_params *p_);
+static inline int __io_uring_enter(int fd_, unsigned to_submit_, unsigned min_complete_, unsigned flags_);
+static inline int __io_uring_register(int fd_, unsigned opcode_, const void *arg_, unsigned nargs_);
+
+static struct io_uring_sqe *uring_get_sqe(sock_uring_t *this_);
+static int uring_submit_wait(sock_uring_t *this_, unsigned n_, int *res_);
+
+//------------------------------------------------------------------------------
+// Returns 1 if the running kernel provides every opcode used by the backend.
+// The result is cached; setting LIBSOCKETS_IO_URING=0 in the environment
+// disables the backend at runtime.
+//------------------------------------------------------------------------------
+int sock_uring_probe(void)
+{
+        static atomic_int probed = -1;
+
+        const int ops[] = {IORING_OP_SEND, IORING_OP_RECV, IORING_OP_READ_FIXED};
+        struct io_uring_params p;
+        struct io_uring_probe *probe;
+        const char *env;
+        size_t probe_len;
+        int fd, ok;
+        size_t i;
+
+        if ((ok = atomic_load(&probed)) >= 0)
+                return ok;
+
+        ok = 0;
+
+        env = getenv("LIBSOCKETS_IO_URING");
+        if (env && strcmp(env, "0") == 0)
+                goto fini;
+
+        memset(&p, 0, sizeof(p));
+        if ((fd = __io_uring_setup(1, &p)) < 0)
+                goto fini;
+
+        probe_len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+        probe     = calloc(1, probe_len);
+        if (probe && __io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+                ok = 1;
+                for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+                        if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+                                ok = 0;
+                }
+        }
+        free(probe);
+        close(fd);
+
+fini:
+        atomic_store(&probed, ok);
+        return ok;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+sock_uring_t *sock_uring_alloc(int fd_)
+{
+        struct io_uring_params p;
+        sock_uring_t *this_ = calloc(1, sizeof(*this_));
+
+        if (!this_)
+                return NULL;
+
+        this_->fd = fd_;
+
+        memset(&p, 0, sizeof(p));
+        if ((this_->ring_fd = __io_uring_setup(SOCK_URING_ENTRIES, &p)) < 0)
+                goto err;
+
+        this_->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        this_->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (this_->cq_len > this_->sq_len)
+                        this_->sq_len = this_->cq_len;
+                this_->cq_len = 0;
+        }
+
+        this_->sq_ptr = mmap(NULL, this_->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             this_->ring_fd, IORING_OFF_SQ_RING);
+        if (this_->sq_ptr == MAP_FAILED)
+                goto err;
+
+        if (this_->cq_len) {
+                this_->cq_ptr = mmap(NULL, this_->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                     this_->ring_fd, IORING_OFF_CQ_RING);
+                if (this_->cq_ptr == MAP_FAILED)
+                        goto err;
+        } else {
+                this_->cq_ptr = this_->sq_ptr;
+        }
+
+        this_->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+        this_->sqes     = mmap(NULL, this_->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           this_->ring_fd, IORING_OFF_SQES);
+        if (this_->sqes == MAP_FAILED)
+                goto err;
+
+        this_->sq_head  = this_->sq_ptr + p.sq_off.head;
+        this_->sq_tail  = this_->sq_ptr + p.sq_off.tail;
+        this_->sq_mask  = this_->sq_ptr + p.sq_off.ring_mask;
+        this_->sq_array = this_->sq_ptr + p.sq_off.array;
+        this_->cq_head  = this_->cq_ptr + p.cq_off.head;
+        this_->cq_tail  = this_->cq_ptr + p.cq_off.tail;
+        this_->cq_mask  = this_->cq_ptr + p.cq_off.ring_mask;
+        this_->cqes     = this_->cq_ptr + p.cq_off.cqes;
+
+        if (__io_uring_register(this_->ring_fd, IORING_REGISTER_FILES, &this_->fd, 1) < 0)
+                goto err;
+
+        // Register the header slot; the channel buffer is added by sock_uring_register
+        if (sock_uring_register(this_, NULL, 0) < 0)
+                goto err;
+
+        return this_;
+
+err:
+        sock_uring_free(&this_);
+        return NULL;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+void sock_uring_free(sock_uring_t **this_)
+{
+        sock_uring_t *r = *this_;
+
+        if (!r)
+                return;
+
+        if (r->sqes && r->sqes != MAP_FAILED)
+                munmap(r->sqes, r->sqes_len);
+        if (r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+                munmap(r->cq_ptr, r->cq_len);
+        if (r->sq_ptr && r->sq_ptr != MAP_FAILED)
+                munmap(r->sq_ptr, r->sq_len);
+        if (r->ring_fd > 0)
+                close(r->ring_fd);
+
+        free(r);
+        *this_ = NULL;
+}
+
+//------------------------------------------------------------------------------
+// (Re)register the header slot and data_ as fixed buffers 0 and 1. Nothing is
+// done if data_ is already registered. If pinning data_ fails only the header
+// slot is registered and payload receives fall back to IORING_OP_RECV.
+//------------------------------------------------------------------------------
+int sock_uring_register(sock_uring_t *this_, void *data_, size_t len_)
+{
+        struct iovec reg[2];
+
+        if (this_->reg_ok && this_->reg[1].iov_base == data_ && this_->reg[1].iov_len == len_)
+                return 0;
+
+        if (this_->reg_ok)
+                __io_uring_register(this_->ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+
+        reg[0].iov_base = this_->hdr;
+        reg[0].iov_len  = sizeof(this_->hdr);
+        reg[1].iov_base = data_;
+        reg[1].iov_len  = len_;
+
+        if (data_ && __io_uring_register(this_->ring_fd, IORING_REGISTER_BUFFERS, reg, 2) == 0) {
+                memcpy(this_->reg, reg, sizeof(reg));
+                this_->reg_ok = true;
+                return 0;
+        }
+
+        memset(&reg[1], 0, sizeof(reg[1]));
+        memcpy(this_->reg, reg, sizeof(reg));
+        this_->reg_ok = __io_uring_register(this_->ring_fd, IORING_REGISTER_BUFFERS, reg, 1) == 0;
+
+        return this_->reg_ok ? 0 : -1;
+}
+
+//------------------------------------------------------------------------------
+// Send all iovec segments. Segments are submitted as a linked chain so they
+// reach the socket in order; a short send breaks the chain and the remainder
+// is resubmitted. Every segment but the last non-empty one carries MSG_MORE:
+// sent one by one, the payload would otherwise be held back by Nagle behind
+// the header.
+//------------------------------------------------------------------------------
+ssize_t sock_uring_sendv(sock_uring_t *this_, const struct iovec *iov_, int iovcnt_, size_t *ntrans_)
+{
+        struct iovec iov[SOCK_URING_ENTRIES];
+        int res[SOCK_URING_ENTRIES];
+        struct io_uring_sqe *sqe;
+        size_t len = 0, nt = 0;
+        int i, k, seg = 0, last = iovcnt_ - 1;
+        size_t off = 0; // Offset into iov_[seg]
+
+        while (last > 0 && iov_[last].iov_len == 0)
+                last--;
+
+        while (seg < iovcnt_) {
+                // Build the next batch from the unsent segments
+                for (k = 0; seg + k < iovcnt_ && k < SOCK_URING_ENTRIES; k++) {
+                        iov[k].iov_base = iov_[seg + k].iov_base + (k == 0 ? off : 0);
+                        iov[k].iov_len  = iov_[seg + k].iov_len - (k == 0 ? off : 0);
+                }
+
+                for (i = 0; i < k; i++) {
+                        sqe            = uring_get_sqe(this_);
+                        sqe->opcode    = IORING_OP_SEND;
+                        sqe->addr      = (unsigned long)iov[i].iov_base;
+                        sqe->msg_flags = MSG_WAITALL | (seg + i < last ? MSG_MORE : 0);
+                        sqe->fd        = 0;
+                        sqe->flags     = IOSQE_FIXED_FILE | (i < k - 1 ? IOSQE_IO_LINK : 0);
+                        sqe->len       = iov[i].iov_len;
+                        sqe->user_data = i;
+                }
+
+                if (uring_submit_wait(this_, k, res) < 0)
+                        return -1;
+                nt += k;
+
+                // Advance over the bytes that were sent in order
+                for (i = 0; i < k; i++) {
+                        if (res[i] == -ECANCELED || res[i] == -EINTR || res[i] == -EAGAIN)
+                                break;
+                        if (res[i] < 0) {
+                                errno = -res[i];
+                                return -1;
+                        }
+                        len += res[i];
+                        if ((size_t)res[i] < iov[i].iov_len) {
+                                off += res[i];
+                                break;
+                        }
+                        seg++;
+                        off = 0;
+                }
+        }
+
+        if (ntrans_)
+                *ntrans_ = nt;
+        return len;
+}
+
+//------------------------------------------------------------------------------
+// Receive exactly n_ bytes into data_. Data inside the registered channel
+// buffer is read with IORING_OP_READ_FIXED, small reads land in the header
+// slot and anything else uses IORING_OP_RECV with MSG_WAITALL.
+//------------------------------------------------------------------------------
+ssize_t sock_uring_recv(sock_uring_t *this_, void *data_, size_t n_, size_t *ntrans_)
+{
+        struct io_uring_sqe *sqe;
+        size_t len = 0, nt = 0;
+        bool in_reg, in_hdr;
+        int res;
+
+        in_reg = this_->reg_ok && this_->reg[1].iov_base && data_ >= this_->reg[1].iov_base &&
+                 data_ + n_ <= this_->reg[1].iov_base + this_->reg[1].iov_len;
+        in_hdr = !in_reg && this_->reg_ok && n_ <= sizeof(this_->hdr);
+
+        while (len < n_) {
+                sqe = uring_get_sqe(this_);
+                if (in_reg) {
+                        sqe->opcode    = IORING_OP_READ_FIXED;
+                        sqe->addr      = (unsigned long)(data_ + len);
+                        sqe->buf_index = 1;
+                } else if (in_hdr) {
+                        sqe->opcode    = IORING_OP_READ_FIXED;
+                        sqe->addr      = (unsigned long)(this_->hdr + len);
+                        sqe->buf_index = 0;
+                } else {
+                        sqe->opcode    = IORING_OP_RECV;
+                        sqe->addr      = (unsigned long)(data_ + len);
+                        sqe->msg_flags = MSG_WAITALL;
+                }
+                sqe->fd    = 0;
+                sqe->flags = IOSQE_FIXED_FILE;
+                sqe->len   = n_ - len;
+
+                if (uring_submit_wait(this_, 1, &res) < 0)
+                        return -1;
+                nt++;
+
+                if (res == -EINTR || res == -EAGAIN) {
+                        continue;
+                } else if (res < 0) {
+                        errno = -res;
+                        return -1;
+                } else if (res == 0) { // Peer disconnect (set as error)
+                        errno = ECOMM;
+                        return -1;
+                }
+                len += res;
+        }
+
+        if (in_hdr)
+                memcpy(data_, this_->hdr, n_);
+
+        if (ntrans_)
+                *ntrans_ = nt;
+        return len;
+}
+
+//------------------------------------------------------------------------------
+// Returns a zeroed submission queue entry; callers never queue more than
+// SOCK_URING_ENTRIES entries before submitting
+//------------------------------------------------------------------------------
+static struct io_uring_sqe *uring_get_sqe(sock_uring_t *this_)
+{
+        unsigned tail = *this_->sq_tail;
+        unsigned idx  = tail & *this_->sq_mask;
+        struct io_uring_sqe *sqe = &this_->sqes[idx];
+
+        memset(sqe, 0, sizeof(*sqe));
+        this_->sq_array[idx] = idx;
+        __atomic_store_n(this_->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        return sqe;
+}
+
+//------------------------------------------------------------------------------
+// Submit n_ queued entries and reap all of their completions with one
+// io_uring_enter call. res_[user_data] receives each result.
+//------------------------------------------------------------------------------
+static int uring_submit_wait(sock_uring_t *this_, unsigned n_, int *res_)
+{
+        unsigned head, tail, reaped = 0;
+        unsigned submit = n_;
+        struct io_uring_cqe *cqe;
+        int n;
+
+        while (reaped < n_) {
+                n = __io_uring_enter(this_->ring_fd, submit, n_ - reaped, IORING_ENTER_GETEVENTS);
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                submit -= (unsigned)n < submit ? (unsigned)n : submit;
+
+                head = *this_->cq_head;
+                tail = __atomic_load_n(this_->cq_tail, __ATOMIC_ACQUIRE);
+                for (; head != tail; head++) {
+                        cqe = &this_->cqes[head & *this_->cq_mask];
+                        assert(cqe->user_data < n_);
+                        res_[cqe->user_data] = cqe->res;
+                        reaped++;
+                }
+                __atomic_store_n(this_->cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Raw system call wrappers (no liburing dependency)
+//------------------------------------------------------------------------------
+static inline int __io_uring_setup(unsigned entries_, struct io_uring_params *p_)
+{
+        return (int)syscall(__NR_io_uring_setup, entries_, p_);
+}
+
+static inline int __io_uring_enter(int fd_, unsigned to_submit_, unsigned min_complete_, unsigned flags_)
+{
+        return (int)syscall(__NR_io_uring_enter, fd_, to_submit_, min_complete_, flags_, NULL, 0);
+}
+
+static inline int __io_uring_register(int fd_, unsigned opcode_, const void *arg_, unsigned nargs_)
+{
+        return (int)syscall(__NR_io_uring_register, fd_, opcode_, arg_, nargs_);
+}
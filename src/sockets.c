@@ -17,41 +17,34 @@
  * along with libsockets.  If not, see
  * <https://www.gnu.org/licenses/>.
  */
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
-#include <math.h>
-#include <netdb.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stddef.h>
+#include <sys/sendfile.h>
 #include <signal.h>
 #include <time.h>
 
-#include <libsockets/sockets.h>
-
 #include "global.h"
+#include "sockets_internal.h"
 
-#define set_bit(a, mask) ((a) |= (mask))
-#define unset_bit(a, mask) ((a) &= ((a) ^ (mask)))
-
-#define log2(a) (log((double)(a)) / log(2.0))
+#ifdef HAVE_LINUX_ERRQUEUE_H
+#include <linux/errqueue.h>
+#endif
 
-// Return-on-error function call macros
-#define ERR_RET(val, fun)                                                                                         \
-        val = fun;                                                                                                \
-        if (val < 0)                                                                                              \
-        return val
+#define SOCK_IOV_STACK 16 // Frame segments (header included) sent without a heap allocation
+#define SOCK_SHM_LEN (1 << 20) // Length of each shared memory ring
+#define SOCK_RA_LEN (64 * 1024) // Read-ahead buffer; reads of half of it or more bypass it
+#define SOCK_COMP_PROBE 4096    // Sample compressed first to rule out incompressible payloads
+#define SOCK_COMP_BACKOFF_MAX 64 // Most messages sent uncompressed after a miss
 
-typedef struct buffer_s {
-        size_t len; // Length (in bytes) of data
-        size_t n;   // Number of bytes used in data
-        void *data; // Data
-        size_t alloc_len;
-} buffer_t;
-
-typedef struct comm_channel_s {
-        int fd;                  // Socket file descriptor
-        socklen_t addr_len;      // Length of address
-        struct sockaddr_in addr; // Remote address
-        buffer_t buf;            // Internal buffer
-} comm_channel_t;
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define SOCK_HAVE_ZEROCOPY
+#endif
 
 //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 // LOCAL PROTOTYPES
@@ -60,7 +53,9 @@ typedef struct comm_channel_s {
 // static void sys_error(const char *msg);
 // static void error(const char *msg);
 
-static int __sock_server_open(sock_server_t *this_, uint16_t port_);
+static int __sock_server_ctor(sock_server_t *this_, const sock_addr_t *addr_, socklen_t len_,
+                              sock_server_t *worker_);
+static int __sock_server_open(sock_server_t *this_);
 static int __sock_server_close(sock_server_t *this_);
 static int __sock_server_accept(sock_server_t *this_);
 static ssize_t __sock_server_recv(sock_server_t *this_, sock_tcp_header_t *hdr_, void **msg_, size_t *len_);
@@ -75,26 +70,65 @@ static int __sock_client_connect_worker(sock_client_t *this_);
 static uint16_t get_sock_port(sock_server_t *this_);
 
 static ssize_t trans_stream_block(ssize_t (*method_)(int fd_, void *data_, size_t n_, int flags_), int fd_,
-                                  void *data_, size_t n_, size_t *ntrans_);
+                                  void *data_, size_t n_, size_t *ntrans_, sock_deadline_t *dl_, uint32_t *crc_);
 static ssize_t trans_socket(ssize_t (*method_)(int fd_, void *data_, size_t n_, int flags_), int fd_,
-                            sock_tcp_header_t *hdr_, void *data_, size_t len_, size_t *ntrans_);
-static inline ssize_t __send(int fd_, void *data_, size_t n_, int flags_);
+                            sock_tcp_header_t *hdr_, void *data_, size_t len_, size_t *ntrans_, sock_deadline_t *dl_,
+                            uint32_t *crc_);
+static ssize_t trans_sendv(int fd_, struct iovec *iov_, int iovcnt_, int flags_, size_t *ntrans_,
+                           uint32_t *nzc_, sock_deadline_t *dl_);
+static ssize_t trans_sendfile(int fd_, int in_fd_, off_t offset_, size_t len_, size_t *ntrans_,
+                              sock_deadline_t *dl_);
 static inline ssize_t __recv(int fd_, void *data_, size_t n_, int flags_);
+static uint32_t crc_iov(uint32_t crc_, const struct iovec *iov_, int iovcnt_);
+static void crc_trailer(uint32_t crc_, unsigned char *out_);
 
-static void buffer_ctor(buffer_t *this_, size_t size_);
-static int buffer_dtor(buffer_t *this_);
-static void buffer_resize(buffer_t *this_, size_t size_);
-static void buffer_clear(buffer_t *this_);
-
-static comm_channel_t *comm_channel_alloc(size_t buf_len_);
-static int comm_channel_free(comm_channel_t **this_);
-static int comm_channel_open(comm_channel_t *this_, const struct hostent *host_, uint16_t port_);
-static int comm_channel_close(comm_channel_t *this_);
+static int comm_channel_open(comm_channel_t *this_, const sock_addr_t *addr_, socklen_t len_);
 static int comm_channel_reopen(comm_channel_t *this_);
+static void comm_channel_handover(comm_channel_t *this_, comm_channel_t *from_);
 static ssize_t comm_channel_send(comm_channel_t *this_, const sock_tcp_header_t *hdr_, const void *msg_,
                                  size_t len_, size_t *ntrans_);
+static ssize_t comm_channel_writev(comm_channel_t *this_, struct iovec *iov_, int iovcnt_, size_t len_,
+                                   size_t *ntrans_);
+static ssize_t comm_channel_batch_add(comm_channel_t *this_, const struct iovec *iov_, int iovcnt_, size_t len_,
+                                      size_t *ntrans_);
+static bool comm_channel_comp_want(comm_channel_t *this_, size_t len_);
+static void *comm_channel_deflate(comm_channel_t *this_, const struct iovec *iov_, int iovcnt_, size_t len_,
+                                  size_t *zlen_, size_t *cap_);
+static ssize_t comm_channel_inflate(comm_channel_t *this_, size_t *ntrans_);
+static bool comm_channel_crc_want(const comm_channel_t *this_, size_t len_);
+static ssize_t comm_channel_crc_check(comm_channel_t *this_, size_t *ntrans_);
+static ssize_t comm_channel_sendfile_comp(comm_channel_t *this_, const struct iovec *iov_, int iovcnt_, int fd_,
+                                          off_t offset_, size_t len_, size_t *ntrans_);
+static ssize_t comm_channel_sendfile(comm_channel_t *this_, const struct iovec *iov_, int iovcnt_, int fd_,
+                                     off_t offset_, size_t len_, size_t *ntrans_);
+static ssize_t comm_channel_reply_wport(comm_channel_t *this_, const sock_tcp_header_t *req_, uint16_t wport_,
+                                        unsigned char accept_, size_t *ntrans_);
+static int comm_channel_shm_offer(comm_channel_t *this_);
+static int comm_channel_shm_accept(comm_channel_t *this_);
 static ssize_t comm_channel_recv(comm_channel_t *this_, sock_tcp_header_t *hdr_, void **msg_, size_t *len_,
                                  size_t *ntrans_);
+static ssize_t comm_channel_recv_into(comm_channel_t *this_, void *data_, size_t cap_, size_t *len_,
+                                      size_t *ntrans_);
+static ssize_t comm_channel_read(comm_channel_t *this_, void *data_, size_t n_, size_t *ntrans_);
+static size_t comm_channel_ra_take(comm_channel_t *this_, void *data_, size_t n_);
+static ssize_t comm_channel_ra_fill(comm_channel_t *this_, bool wait_, size_t *ntrans_);
+static ssize_t comm_channel_ra_read(comm_channel_t *this_, void *data_, size_t n_, size_t *ntrans_);
+static size_t comm_channel_ra_frame(const comm_channel_t *this_, sock_tcp_header_t *hdr_);
+static void comm_channel_reset(comm_channel_t *this_);
+static sock_deadline_t *comm_channel_arm(comm_channel_t *this_, sock_deadline_t *dl_, int ms_);
+static void comm_channel_zerocopy_reset(comm_channel_t *this_);
+static int comm_channel_stream_begin(comm_channel_t *this_);
+static ssize_t comm_channel_write_chunk(comm_channel_t *this_, const void *data_, size_t len_, size_t *ntrans_);
+static ssize_t comm_channel_stream_end(comm_channel_t *this_, size_t *ntrans_);
+static int comm_channel_read_chunk(comm_channel_t *this_, void **data_, size_t *len_, size_t *ntrans_);
+#ifdef SOCK_HAVE_ZEROCOPY
+static bool comm_channel_zerocopy_arm(comm_channel_t *this_);
+static ssize_t comm_channel_writev_zc(comm_channel_t *this_, struct iovec *iov_, int iovcnt_, size_t len_,
+                                      size_t *ntrans_, sock_deadline_t *dl_);
+#endif
+#ifdef HAVE_IO_URING
+static sock_uring_t *comm_channel_uring(comm_channel_t *this_);
+#endif
 
 //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 /// sock_server_t
@@ -105,6 +139,41 @@ static ssize_t comm_channel_recv(comm_channel_t *this_, sock_tcp_header_t *hdr_,
 //------------------------------------------------------------------------------
 int sock_server_ctor(sock_server_t *this_, uint16_t port_, sock_server_t *worker_)
 {
+        sock_addr_t addr;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.in.sin_family      = AF_INET;
+        addr.in.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.in.sin_port        = htons(port_);
+
+        return __sock_server_ctor(this_, &addr, sizeof(addr.in), worker_);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_server_ctor_unix(sock_server_t *this_, const char *addr_, sock_server_t *worker_)
+{
+        sock_addr_t addr;
+        socklen_t len;
+        int n;
+
+        ERR_RET(n, sock_addr_unix(&addr, &len, addr_));
+        if (n == 0) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        return __sock_server_ctor(this_, &addr, len, worker_);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static int __sock_server_ctor(sock_server_t *this_, const sock_addr_t *addr_, socklen_t len_,
+                              sock_server_t *worker_)
+{
+        sock_addr_t addr;
         int n;
 
         // Initialize
@@ -113,15 +182,24 @@ int sock_server_ctor(sock_server_t *this_, uint16_t port_, sock_server_t *worker
         // By default the parent, master, and client parent flags are set
         this_->flags = SOCK_SF_PARENT | SOCK_SF_MASTER;
 
-        // Open listening socket and construct client comm channel
-        ERR_RET(n, __sock_server_open(this_, port_));
+        // Construct client comm channel (it holds the tuning) and open listening socket
+        this_->addr      = *addr_;
+        this_->addr_len  = len_;
         this_->cc_client = comm_channel_alloc(0);
+        ERR_RET(n, __sock_server_open(this_));
 
         // External reference to the worker server
         if (worker_) {
                 this_->worker = worker_;
 
-                ERR_RET(n, sock_server_ctor(this_->worker, 0, NULL));
+                // The worker listens on any free TCP port; a Unix domain worker is
+                // not bound at all (it takes over the master's connections)
+                addr = *addr_;
+                if (addr.sa.sa_family == AF_UNIX)
+                        len_ = sizeof(sa_family_t);
+                else
+                        addr.in.sin_port = 0;
+                ERR_RET(n, __sock_server_ctor(this_->worker, &addr, len_, NULL));
 
                 unset_bit(this_->worker->flags, SOCK_SF_MASTER);
                 set_bit(this_->worker->flags, SOCK_SF_WORKER);
@@ -148,6 +226,11 @@ int sock_server_dtor(sock_server_t *this_)
         if (!this_)
                 return 0;
 
+        // Remove the socket file of a Unix domain server (not abstract, not the worker)
+        if (this_->addr.sa.sa_family == AF_UNIX && this_->addr.un.sun_path[0] &&
+            (this_->flags & (SOCK_SF_PARENT | SOCK_SF_MASTER)) == (SOCK_SF_PARENT | SOCK_SF_MASTER))
+                unlink(this_->addr.un.sun_path);
+
         ERR_RET(n, __sock_server_close(this_));
         ERR_RET(n, comm_channel_free(&this_->cc_client));
         if (this_->worker != this_)
@@ -163,13 +246,20 @@ int sock_server_dtor(sock_server_t *this_)
 //------------------------------------------------------------------------------
 int sock_server_bind(const sock_server_t *this_)
 {
-        return bind(this_->fd, (struct sockaddr *)&this_->addr, sizeof(this_->addr));
+        if (this_->addr.sa.sa_family == AF_UNIX && this_->addr.un.sun_path[0])
+                unlink(this_->addr.un.sun_path); // Stale socket file of a previous run
+
+        return bind(this_->fd, &this_->addr.sa, this_->addr_len);
 }
 
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
-int sock_server_listen(const sock_server_t *this_) { return listen(this_->fd, 5); }
+int sock_server_listen(const sock_server_t *this_)
+{
+        int backlog = this_->cc_client->opts.backlog;
+        return listen(this_->fd, backlog > 0 ? backlog : 5);
+}
 
 //------------------------------------------------------------------------------
 //
@@ -187,22 +277,38 @@ int sock_server_accept(sock_server_t *this_)
         // Recv the incomming wport request
         ERR_RET(n, __sock_server_recv(this_, &hdr, NULL, NULL));
 
-        if (hdr.opts & SOCK_OPTS_REQ_WPORT) {
+        if (hdr.opts & SOCK_OPTS_REQ_WPORT && this_->addr.sa.sa_family == AF_UNIX) {
+                // No worker address to connect to: the client stays on this
+                // connection, which the worker takes over. A peer on this
+                // host may move the data to shared memory.
+                ERR_RET(n, comm_channel_reply_wport(this_->cc_client, &hdr, 0,
+                                                   SOCK_OPTS_SHM | SOCK_OPTS_COMP | SOCK_OPTS_CRC, &this_->ntrans));
+                if (hdr.opts & SOCK_OPTS_SHM) {
+                        ERR_RET(n, comm_channel_shm_accept(this_->cc_client));
+                }
+                if (this_->worker != this_)
+                        comm_channel_handover(this_->worker->cc_client, this_->cc_client);
+        } else if (hdr.opts & SOCK_OPTS_REQ_WPORT) {
                 // Open a new socket for the worker
                 if (this_->worker != this_) {
                         if (this_->worker->fd == 0) { // Open worker listen socket if closed
-                                ERR_RET(n, __sock_server_open(this_->worker, 0));
+                                this_->worker->addr.in.sin_port = 0;
+                                ERR_RET(n, __sock_server_open(this_->worker));
                         }
                         ERR_RET(n, sock_server_bind(this_->worker));
                         ERR_RET(n, sock_server_listen(this_->worker));
                 }
 
                 wport = get_sock_port(this_->worker);
-                ERR_RET(n, __sock_server_send(this_, NULL, &wport, sizeof(wport)));
+                ERR_RET(n, comm_channel_reply_wport(this_->cc_client, &hdr, wport, SOCK_OPTS_COMP | SOCK_OPTS_CRC,
+                                                   &this_->ntrans));
 
-                // Start accepting on the worker port
+                // Start accepting on the worker port; it uses the header agreed on here
                 if (this_->worker != this_) {
                         ERR_RET(n, __sock_server_accept(this_->worker));
+                        this_->worker->cc_client->hdr_v2  = this_->cc_client->hdr_v2;
+                        this_->worker->cc_client->comp_ok = this_->cc_client->comp_ok;
+                        this_->worker->cc_client->crc_ok  = this_->cc_client->crc_ok;
                 }
         } else if (hdr.opts & SOCK_OPTS_SIGTERM) {
                 raise(SIGTERM);
@@ -213,6 +319,42 @@ int sock_server_accept(sock_server_t *this_)
         return 0;
 }
 
+//------------------------------------------------------------------------------
+// Answer the request on an accepted connection that is served in place: a
+// worker port request is answered with wport_. Returns the request option
+// (SOCK_OPTS_REQ_WPORT or SOCK_OPTS_SIGTERM); the caller acts on SIGTERM.
+//------------------------------------------------------------------------------
+int sock_server_handshake(sock_server_t *this_, uint16_t wport_)
+{
+        ssize_t n;
+        sock_tcp_header_t hdr;
+
+        ERR_RET(n, __sock_server_recv(this_, &hdr, NULL, NULL));
+
+        if (hdr.opts & SOCK_OPTS_REQ_WPORT) {
+                ERR_RET(n, comm_channel_reply_wport(this_->cc_client, &hdr, wport_, SOCK_OPTS_COMP | SOCK_OPTS_CRC,
+                                                   &this_->ntrans));
+                return SOCK_OPTS_REQ_WPORT;
+        } else if (hdr.opts & SOCK_OPTS_SIGTERM) {
+                return SOCK_OPTS_SIGTERM;
+        }
+
+        errno = EPROTO;
+        return -1;
+}
+
+//------------------------------------------------------------------------------
+// Header of the reply to the worker port request req_ (len_ payload bytes).
+// The reply itself always uses the v1 header; it agrees to the v2 header if
+// the client offered it, after which both ends switch.
+//------------------------------------------------------------------------------
+void sock_handshake_reply(const sock_tcp_header_t *req_, sock_tcp_header_t *reply_, size_t len_)
+{
+        memset(reply_, 0, sizeof(*reply_));
+        reply_->msg_len = len_;
+        reply_->opts    = req_->opts & SOCK_OPTS_HDR_V2;
+}
+
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
@@ -241,15 +383,13 @@ pid_t sock_server_fork(sock_server_t *this_)
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
-static int __sock_server_open(sock_server_t *this_, uint16_t port_)
+static int __sock_server_open(sock_server_t *this_)
 {
-        ERR_RET(this_->fd, socket(AF_INET, SOCK_STREAM, 0));
-
-        memset(&this_->addr, 0, sizeof(this_->addr));
+        if (this_->addr_len <= sizeof(sa_family_t)) // Unbound Unix domain worker
+                return 0;
 
-        this_->addr.sin_family      = AF_INET;
-        this_->addr.sin_addr.s_addr = htonl(INADDR_ANY);
-        this_->addr.sin_port        = htons(port_);
+        ERR_RET(this_->fd, socket(this_->addr.sa.sa_family, SOCK_STREAM, 0));
+        sock_opts_apply(&this_->cc_client->opts, this_->fd); // Best effort
 
         return 0;
 }
@@ -261,7 +401,7 @@ static int __sock_server_close(sock_server_t *this_)
 {
         int n;
 
-        if (this_->fd) {
+        if (this_->fd > 0) {
                 ERR_RET(this_->fd, close(this_->fd));
         }
 
@@ -279,6 +419,198 @@ ssize_t sock_server_send(sock_server_t *this_, const void *data_, size_t len_)
         return __sock_server_send(this_->worker, NULL, data_, len_);
 }
 
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_server_sendv(sock_server_t *this_, const struct iovec *iov_, int iovcnt_)
+{
+        return comm_channel_sendv(this_->worker->cc_client, NULL, iov_, iovcnt_, &this_->worker->ntrans);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_server_batch(sock_server_t *this_, size_t len_, int ms_, bool cork_)
+{
+        return comm_channel_batch(this_->worker->cc_client, len_, ms_, cork_);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_server_flush(sock_server_t *this_)
+{
+        return comm_channel_flush(this_->worker->cc_client, &this_->worker->ntrans);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_server_batch_timeout(const sock_server_t *this_)
+{
+        return comm_channel_batch_timeout(this_->worker->cc_client);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_server_sendfile(sock_server_t *this_, int fd_, off_t offset_, size_t len_)
+{
+        return comm_channel_sendfile(this_->worker->cc_client, NULL, 0, fd_, offset_, len_, &this_->worker->ntrans);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_server_sendfilev(sock_server_t *this_, const struct iovec *iov_, int iovcnt_, int fd_, off_t offset_,
+                          size_t len_)
+{
+        return comm_channel_sendfile(this_->worker->cc_client, iov_, iovcnt_, fd_, offset_, len_, &this_->worker->ntrans);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_server_stream_begin(sock_server_t *this_)
+{
+        return comm_channel_stream_begin(this_->worker->cc_client);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_server_write_chunk(sock_server_t *this_, const void *data_, size_t len_)
+{
+        return comm_channel_write_chunk(this_->worker->cc_client, data_, len_, &this_->worker->ntrans);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_server_stream_end(sock_server_t *this_)
+{
+        return comm_channel_stream_end(this_->worker->cc_client, &this_->worker->ntrans);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_server_read_chunk(sock_server_t *this_, void **data_, size_t *len_)
+{
+        return comm_channel_read_chunk(this_->worker->cc_client, data_, len_, &this_->worker->ntrans);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_server_recv_to_fd(sock_server_t *this_, int fd_, off_t offset_)
+{
+        return comm_channel_recv_to_fd(this_->worker->cc_client, fd_, offset_, &this_->worker->ntrans);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_server_zerocopy(sock_server_t *this_, size_t threshold_)
+{
+        return comm_channel_zerocopy(this_->worker->cc_client, threshold_);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_server_zerocopy_reap(sock_server_t *this_, int timeout_)
+{
+        return comm_channel_zerocopy_reap(this_->worker->cc_client, timeout_);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_server_deadline(sock_server_t *this_, int timeout_)
+{
+        return comm_channel_deadline(this_->worker->cc_client, timeout_);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+size_t sock_server_nbytes(const sock_server_t *this_)
+{
+        const comm_channel_t *c = this_->worker->cc_client;
+        return c->tx.nbytes + c->rx.nbytes;
+}
+
+//------------------------------------------------------------------------------
+// The tuning is kept by the client channels of the master and the worker, for
+// every connection accepted from now on; the listening sockets get it at once
+//------------------------------------------------------------------------------
+int sock_server_opts(sock_server_t *this_, const sock_opts_t *opts_)
+{
+        sock_server_t *s = this_;
+        int rc = 0;
+
+        while (1) {
+                s->cc_client->opts = *opts_;
+                if (s->fd > 0 && sock_opts_apply(opts_, s->fd) < 0)
+                        rc = -1;
+                if (s->worker == s || s->worker == NULL)
+                        break;
+                s = s->worker;
+        }
+        return rc;
+}
+
+//------------------------------------------------------------------------------
+// The limits are kept by the client channels of the master and the worker, so
+// they hold for every connection accepted from now on
+//------------------------------------------------------------------------------
+int sock_server_timeouts(sock_server_t *this_, int idle_, int xfer_)
+{
+        if (idle_ < 0 || xfer_ < 0) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        this_->cc_client->idle_ms         = idle_;
+        this_->cc_client->xfer_ms         = xfer_;
+        this_->worker->cc_client->idle_ms = idle_;
+        this_->worker->cc_client->xfer_ms = xfer_;
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Like the timeouts, the codec is kept by the client channels of the master
+// and the worker
+//------------------------------------------------------------------------------
+int sock_server_compress(sock_server_t *this_, const char *codec_, size_t min_)
+{
+        int n;
+
+        ERR_RET(n, comm_channel_compress(this_->cc_client, codec_, min_));
+        return comm_channel_compress(this_->worker->cc_client, codec_, min_);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_server_msg_max(sock_server_t *this_, uint64_t max_)
+{
+        this_->cc_client->msg_max         = max_;
+        this_->worker->cc_client->msg_max = max_;
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_server_checksum(sock_server_t *this_, bool on_)
+{
+        comm_channel_checksum(this_->cc_client, on_);
+        return comm_channel_checksum(this_->worker->cc_client, on_);
+}
+
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
@@ -287,6 +619,44 @@ ssize_t sock_server_recv(sock_server_t *this_, void **data_, size_t *len_)
         return __sock_server_recv(this_->worker, NULL, data_, len_);
 }
 
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_server_recv_into(sock_server_t *this_, void *data_, size_t cap_, size_t *len_)
+{
+        return comm_channel_recv_into(this_->worker->cc_client, data_, cap_, len_, &this_->worker->ntrans);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_server_recv_batch(sock_server_t *this_, struct iovec *msg_, size_t n_)
+{
+        return comm_channel_recv_batch(this_->worker->cc_client, msg_, n_, &this_->worker->ntrans);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_server_peek(sock_server_t *this_, size_t *len_)
+{
+        sock_server_t *w = this_->worker;
+        ssize_t n;
+
+        ERR_RET(n, comm_channel_recv_hdr(w->cc_client, NULL, &w->ntrans));
+        *len_ = w->cc_client->rx_pending;
+
+        return n;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_server_recv_payload(sock_server_t *this_, void *data_, size_t len_)
+{
+        return comm_channel_recv_payload(this_->worker->cc_client, data_, len_, &this_->worker->ntrans);
+}
+
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
@@ -294,7 +664,14 @@ static int __sock_server_accept(sock_server_t *this_)
 {
         comm_channel_t *c = this_->cc_client;
 
-        ERR_RET(c->fd, accept(this_->fd, (struct sockaddr *)&c->addr, &c->addr_len));
+        comm_channel_reset(c);
+
+        c->addr_len = sizeof(c->addr);
+        ERR_RET(c->fd, accept(this_->fd, &c->addr.sa, &c->addr_len));
+
+        // Mostly inherited from the listening socket, but not everywhere
+        sock_opts_apply(&c->opts, c->fd);
+        sock_opts_autosize(&c->opts, c->fd);
         return 0;
 }
 
@@ -341,11 +718,19 @@ int sock_client_ctor(sock_client_t *this_, const char *server_name_, uint16_t se
 
         this_->server_name = strdup(server_name_);
 
-        if ((this_->server_host = gethostbyname(server_name_)) == NULL)
-                return -1;
+        // Unix domain address, or host name (port server_port_)
+        ERR_RET(n, sock_addr_unix(&this_->server_addr, &this_->server_addr_len, server_name_));
+        this_->shm = n == 2;
+        if (n == 0) {
+                this_->server_addr.in.sin_family = AF_INET;
+                this_->server_addr.in.sin_port   = htons(server_port_);
+                this_->server_addr_len           = sizeof(this_->server_addr.in);
+                if (sock_resolve(server_name_, &this_->server_addr.in.sin_addr) < 0)
+                        return -1;
+        }
 
         this_->cc_master = comm_channel_alloc(0);
-        n                = comm_channel_open(this_->cc_master, this_->server_host, server_port_);
+        n                = comm_channel_open(this_->cc_master, &this_->server_addr, this_->server_addr_len);
 
         return n;
 }
@@ -376,8 +761,8 @@ int sock_client_connect(const sock_client_t *this_, unsigned char opts_)
 {
         int n = 0;
 
-        ERR_RET(n, connect(this_->cc_master->fd, (struct sockaddr *)&this_->cc_master->addr,
-                           sizeof(this_->cc_master->addr)));
+        ERR_RET(n, connect(this_->cc_master->fd, &this_->cc_master->addr.sa, this_->cc_master->addr_len));
+        sock_opts_autosize(&this_->cc_master->opts, this_->cc_master->fd);
 
         if (opts_ & SOCK_OPTS_REQ_WPORT || opts_ == 0) {
                 n = __sock_client_connect_worker((sock_client_t *)this_);
@@ -393,7 +778,7 @@ int sock_client_connect(const sock_client_t *this_, unsigned char opts_)
 //------------------------------------------------------------------------------
 int sock_client_open(sock_client_t *this_)
 {
-        return comm_channel_open(this_->cc_master, this_->server_host, ntohs(this_->cc_master->addr.sin_port));
+        return comm_channel_open(this_->cc_master, &this_->server_addr, this_->server_addr_len);
 }
 
 //------------------------------------------------------------------------------
@@ -402,10 +787,12 @@ int sock_client_open(sock_client_t *this_)
 int sock_client_close(sock_client_t *this_)
 {
         int n;
-        if (this_->cc_worker != this_->cc_master) {
+        if (this_->cc_worker && this_->cc_worker != this_->cc_master) {
                 ERR_RET(n, comm_channel_close(this_->cc_worker));
         }
-        ERR_RET(n, comm_channel_close(this_->cc_master));
+        if (this_->cc_master) {
+                ERR_RET(n, comm_channel_close(this_->cc_master));
+        }
 
         return 0;
 }
@@ -417,11 +804,14 @@ int sock_client_reconnect(sock_client_t *this_)
 {
         int n = 0;
 
-        ERR_RET(n, comm_channel_reopen(this_->cc_worker));
-
-        if (this_->cc_worker != this_->cc_master) {
-                ERR_RET(n, comm_channel_reopen(this_->cc_master));
+        // A separate worker channel is opened again by the worker port
+        // handshake, so only its old socket is closed here (what it had
+        // batched for the dead connection is dropped)
+        if (this_->cc_worker && this_->cc_worker != this_->cc_master) {
+                this_->cc_worker->wb.n = 0;
+                ERR_RET(n, comm_channel_close(this_->cc_worker));
         }
+        ERR_RET(n, comm_channel_reopen(this_->cc_master));
 
         return sock_client_connect(this_, 0);
 }
@@ -437,64 +827,298 @@ ssize_t sock_client_send(sock_client_t *this_, const void *msg_, size_t len_)
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
-ssize_t sock_client_recv(sock_client_t *this_, void **data_, size_t *len_)
+ssize_t sock_client_sendv(sock_client_t *this_, const struct iovec *iov_, int iovcnt_)
 {
-        return comm_channel_recv(this_->cc_worker, NULL, data_, len_, &this_->ntrans);
+        return comm_channel_sendv(this_->cc_worker, NULL, iov_, iovcnt_, &this_->ntrans);
 }
 
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
-int sock_client_send_sigterm(sock_client_t *this_)
+int sock_client_batch(sock_client_t *this_, size_t len_, int ms_, bool cork_)
 {
-        int n;
-
-        ERR_RET(n, sock_client_close(this_));
-        ERR_RET(n, sock_client_open(this_));
-
-        return sock_client_connect(this_, SOCK_OPTS_SIGTERM);
+        if (this_->cc_worker && this_->cc_worker != this_->cc_master &&
+            comm_channel_batch(this_->cc_worker, len_, ms_, cork_) < 0)
+                return -1;
+        return comm_channel_batch(this_->cc_master, len_, ms_, cork_);
 }
 
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
-static ssize_t __sock_client_req_wport(sock_client_t *this_, uint16_t *wport_)
+ssize_t sock_client_flush(sock_client_t *this_)
 {
-
-        ssize_t n = 0, _n = 0;
-        ;
-        size_t ntrans;
-        sock_tcp_header_t hdr;
-
-        void *msg;
-        size_t len;
-
-        // Set references for internal buffer
-        memset(&hdr, 0, sizeof(hdr));
-        hdr.opts = SOCK_OPTS_REQ_WPORT;
-
-        // Clear the buffer, so we send no data
-        buffer_clear(&this_->cc_master->buf);
-        ERR_RET(_n, comm_channel_send(this_->cc_master, &hdr, NULL, 0, &ntrans));
-        n             = _n;
-        this_->ntrans = ntrans;
-
-        // Get reply for the port
-        ERR_RET(_n, comm_channel_recv(this_->cc_master, &hdr, &msg, &len, &ntrans));
-        n += _n;
-        this_->ntrans += ntrans;
-
-        // Check expected message size
-        assert(hdr.msg_len == sizeof(uint16_t));
-        *wport_ = *(uint16_t *)msg;
-
-        return n;
+        return comm_channel_flush(this_->cc_worker ? this_->cc_worker : this_->cc_master, &this_->ntrans);
 }
 
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
-static ssize_t __sock_client_send_sigterm(sock_client_t *this_)
+int sock_client_batch_timeout(const sock_client_t *this_)
+{
+        return comm_channel_batch_timeout(this_->cc_worker ? this_->cc_worker : this_->cc_master);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_client_sendfile(sock_client_t *this_, int fd_, off_t offset_, size_t len_)
+{
+        return comm_channel_sendfile(this_->cc_worker, NULL, 0, fd_, offset_, len_, &this_->ntrans);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_client_sendfilev(sock_client_t *this_, const struct iovec *iov_, int iovcnt_, int fd_, off_t offset_,
+                          size_t len_)
+{
+        return comm_channel_sendfile(this_->cc_worker, iov_, iovcnt_, fd_, offset_, len_, &this_->ntrans);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_client_stream_begin(sock_client_t *this_)
+{
+        return comm_channel_stream_begin(this_->cc_worker);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_client_write_chunk(sock_client_t *this_, const void *data_, size_t len_)
+{
+        return comm_channel_write_chunk(this_->cc_worker, data_, len_, &this_->ntrans);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_client_stream_end(sock_client_t *this_)
+{
+        return comm_channel_stream_end(this_->cc_worker, &this_->ntrans);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_client_read_chunk(sock_client_t *this_, void **data_, size_t *len_)
+{
+        return comm_channel_read_chunk(this_->cc_worker, data_, len_, &this_->ntrans);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_client_recv_to_fd(sock_client_t *this_, int fd_, off_t offset_)
+{
+        return comm_channel_recv_to_fd(this_->cc_worker, fd_, offset_, &this_->ntrans);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_client_zerocopy(sock_client_t *this_, size_t threshold_)
+{
+        if (this_->cc_worker && this_->cc_worker != this_->cc_master &&
+            comm_channel_zerocopy(this_->cc_worker, threshold_) < 0)
+                return -1;
+        return comm_channel_zerocopy(this_->cc_master, threshold_);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_client_zerocopy_reap(sock_client_t *this_, int timeout_)
+{
+        return comm_channel_zerocopy_reap(this_->cc_worker ? this_->cc_worker : this_->cc_master, timeout_);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_client_opts(sock_client_t *this_, const sock_opts_t *opts_)
+{
+        int rc = 0;
+
+        this_->cc_master->opts = *opts_;
+        if (this_->cc_master->fd > 0 && sock_opts_apply(opts_, this_->cc_master->fd) < 0)
+                rc = -1;
+
+        if (this_->cc_worker && this_->cc_worker != this_->cc_master) {
+                this_->cc_worker->opts = *opts_;
+                if (this_->cc_worker->fd > 0 && sock_opts_apply(opts_, this_->cc_worker->fd) < 0)
+                        rc = -1;
+        }
+        return rc;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_client_compress(sock_client_t *this_, const char *codec_, size_t min_)
+{
+        int n;
+
+        ERR_RET(n, comm_channel_compress(this_->cc_master, codec_, min_));
+        if (this_->cc_worker && this_->cc_worker != this_->cc_master) {
+                ERR_RET(n, comm_channel_compress(this_->cc_worker, codec_, min_));
+        }
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_client_msg_max(sock_client_t *this_, uint64_t max_)
+{
+        if (this_->cc_worker)
+                this_->cc_worker->msg_max = max_;
+        this_->cc_master->msg_max = max_;
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_client_checksum(sock_client_t *this_, bool on_)
+{
+        if (this_->cc_worker && this_->cc_worker != this_->cc_master)
+                comm_channel_checksum(this_->cc_worker, on_);
+        return comm_channel_checksum(this_->cc_master, on_);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_client_deadline(sock_client_t *this_, int timeout_)
+{
+        if (this_->cc_worker && this_->cc_worker != this_->cc_master)
+                comm_channel_deadline(this_->cc_worker, timeout_);
+        return comm_channel_deadline(this_->cc_master, timeout_);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+size_t sock_client_nbytes(const sock_client_t *this_)
+{
+        const comm_channel_t *c = this_->cc_worker ? this_->cc_worker : this_->cc_master;
+        return c->tx.nbytes + c->rx.nbytes;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_client_recv(sock_client_t *this_, void **data_, size_t *len_)
+{
+        return comm_channel_recv(this_->cc_worker, NULL, data_, len_, &this_->ntrans);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_client_recv_into(sock_client_t *this_, void *data_, size_t cap_, size_t *len_)
+{
+        return comm_channel_recv_into(this_->cc_worker, data_, cap_, len_, &this_->ntrans);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_client_recv_batch(sock_client_t *this_, struct iovec *msg_, size_t n_)
+{
+        return comm_channel_recv_batch(this_->cc_worker, msg_, n_, &this_->ntrans);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_client_peek(sock_client_t *this_, size_t *len_)
+{
+        ssize_t n;
+
+        ERR_RET(n, comm_channel_recv_hdr(this_->cc_worker, NULL, &this_->ntrans));
+        *len_ = this_->cc_worker->rx_pending;
+
+        return n;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+ssize_t sock_client_recv_payload(sock_client_t *this_, void *data_, size_t len_)
+{
+        return comm_channel_recv_payload(this_->cc_worker, data_, len_, &this_->ntrans);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int sock_client_send_sigterm(sock_client_t *this_)
+{
+        int n;
+
+        ERR_RET(n, sock_client_close(this_));
+        ERR_RET(n, sock_client_open(this_));
+
+        return sock_client_connect(this_, SOCK_OPTS_SIGTERM);
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static ssize_t __sock_client_req_wport(sock_client_t *this_, uint16_t *wport_)
+{
+
+        ssize_t n = 0, _n = 0;
+        ;
+        size_t ntrans;
+        sock_tcp_header_t hdr;
+
+        void *msg;
+        size_t len;
+
+        // Set references for internal buffer; offer the v2 header,
+        // compression and checksums (servers that do not know them leave the
+        // bits unset in the reply)
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.opts = SOCK_OPTS_REQ_WPORT | SOCK_OPTS_HDR_V2 | SOCK_OPTS_COMP | SOCK_OPTS_CRC |
+                   (this_->shm ? SOCK_OPTS_SHM : 0);
+
+        // Clear the buffer, so we send no data
+        buffer_clear(&this_->cc_master->buf);
+        this_->cc_master->hdr_v2 = false;
+        ERR_RET(_n, comm_channel_send(this_->cc_master, &hdr, NULL, 0, &ntrans));
+        n             = _n;
+        this_->ntrans = ntrans;
+
+        // Get reply for the port
+        ERR_RET(_n, comm_channel_recv(this_->cc_master, &hdr, &msg, &len, &ntrans));
+        n += _n;
+        this_->ntrans += ntrans;
+
+        // Check expected message size
+        assert(hdr.msg_len == sizeof(uint16_t));
+        *wport_ = *(uint16_t *)msg;
+
+        this_->cc_master->hdr_v2  = (hdr.opts & SOCK_OPTS_HDR_V2) != 0;
+        this_->cc_master->comp_ok = (hdr.opts & SOCK_OPTS_COMP) != 0;
+        this_->cc_master->crc_ok  = (hdr.opts & SOCK_OPTS_CRC) != 0;
+
+        // The server agreed to shared memory: hand it the segment
+        if (this_->shm && hdr.opts & SOCK_OPTS_SHM) {
+                ERR_RET(_n, comm_channel_shm_offer(this_->cc_master));
+        }
+
+        return n;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static ssize_t __sock_client_send_sigterm(sock_client_t *this_)
 {
         sock_tcp_header_t hdr;
 
@@ -506,178 +1130,1892 @@ static ssize_t __sock_client_send_sigterm(sock_client_t *this_)
 }
 
 //------------------------------------------------------------------------------
-//
+//
+//------------------------------------------------------------------------------
+static int __sock_client_connect_worker(sock_client_t *this_)
+{
+        int n;
+        uint16_t wport = 0;
+        sock_addr_t addr;
+
+        n = __sock_client_req_wport(this_, &wport);
+
+        // Check if the master port was returned; Unix domain servers always
+        // serve the client on the master connection
+        if (this_->server_addr.sa.sa_family == AF_UNIX || wport == ntohs(this_->server_addr.in.sin_port)) {
+                this_->cc_worker = this_->cc_master;
+        } else {
+                if (!this_->cc_worker)
+                        this_->cc_worker = comm_channel_alloc(0);
+                this_->cc_worker->opts         = this_->cc_master->opts;
+                this_->cc_worker->codec        = this_->cc_master->codec;
+                this_->cc_worker->comp_min     = this_->cc_master->comp_min;
+                this_->cc_worker->crc          = this_->cc_master->crc;
+                this_->cc_worker->msg_max      = this_->cc_master->msg_max;
+                this_->cc_worker->zc_threshold = this_->cc_master->zc_threshold;
+                this_->cc_worker->batch_len    = this_->cc_master->batch_len;
+                this_->cc_worker->batch_ms     = this_->cc_master->batch_ms;
+                this_->cc_worker->batch_cork   = this_->cc_master->batch_cork;
+
+                addr             = this_->server_addr;
+                addr.in.sin_port = htons(wport);
+                ERR_RET(n, comm_channel_open(this_->cc_worker, &addr, this_->server_addr_len));
+                ERR_RET(n, connect(this_->cc_worker->fd, &this_->cc_worker->addr.sa, this_->cc_worker->addr_len));
+                sock_opts_autosize(&this_->cc_worker->opts, this_->cc_worker->fd);
+                this_->cc_worker->hdr_v2  = this_->cc_master->hdr_v2;
+                this_->cc_worker->comp_ok = this_->cc_master->comp_ok;
+                this_->cc_worker->crc_ok  = this_->cc_master->crc_ok;
+        }
+        return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// comm_channel_t
+////////////////////////////////////////////////////////////////////////////////
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+comm_channel_t *comm_channel_alloc(size_t buf_len_)
+{
+        comm_channel_t *this_ = calloc(1, sizeof(*this_));
+        buffer_ctor(&this_->buf, buf_len_);
+        this_->opts = *sock_opts_default();
+
+        return this_;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int comm_channel_free(comm_channel_t **this_)
+{
+        if (*this_) {
+#ifdef HAVE_IO_URING
+                sock_uring_free(&(*this_)->ring);
+#endif
+                sock_shm_free(&(*this_)->shm);
+                if ((*this_)->pipe[0]) {
+                        close((*this_)->pipe[0]);
+                        close((*this_)->pipe[1]);
+                }
+                buffer_dtor(&(*this_)->buf);
+                buffer_dtor(&(*this_)->ra);
+                buffer_dtor(&(*this_)->wb);
+                buffer_dtor(&(*this_)->zd);
+                free(*this_);
+        }
+        *this_ = NULL;
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static int comm_channel_open(comm_channel_t *this_, const sock_addr_t *addr_, socklen_t len_)
+
+{
+        this_->addr     = *addr_;
+        this_->addr_len = len_;
+
+        ERR_RET(this_->fd, socket(addr_->sa.sa_family, SOCK_STREAM, 0));
+        sock_opts_apply(&this_->opts, this_->fd); // Best effort
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+int comm_channel_close(comm_channel_t *this_)
+{
+        if (this_->wb.n && this_->fd > 0)
+                comm_channel_flush(this_, NULL); // Best effort
+        comm_channel_reset(this_);
+
+        if (this_->fd)
+                this_->fd = close(this_->fd);
+        return this_->fd;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static int comm_channel_reopen(comm_channel_t *this_)
+{
+        comm_channel_reset(this_);
+
+        if (this_->fd) {
+                ERR_RET(this_->fd, close(this_->fd));
+        }
+
+        ERR_RET(this_->fd, socket(this_->addr.sa.sa_family, SOCK_STREAM, 0));
+        sock_opts_apply(&this_->opts, this_->fd); // Best effort
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Move the connection of from_ (just accepted and answered) to this_, which is
+// assumed closed; from_ is left closed
+//------------------------------------------------------------------------------
+static void comm_channel_handover(comm_channel_t *this_, comm_channel_t *from_)
+{
+        comm_channel_reset(this_);
+
+        this_->fd       = from_->fd;
+        this_->addr     = from_->addr;
+        this_->addr_len = from_->addr_len;
+        this_->hdr_v2   = from_->hdr_v2;
+        this_->comp_ok  = from_->comp_ok;
+        this_->crc_ok   = from_->crc_ok;
+        this_->shm      = from_->shm;
+        this_->nonblock = from_->nonblock;
+
+        // Bytes the handshake read ahead belong to the connection
+        buffer_t ra = this_->ra;
+        this_->ra   = from_->ra;
+        this_->rpos = from_->rpos;
+        from_->ra   = ra;
+
+        from_->shm = NULL;
+        comm_channel_reset(from_);
+        from_->fd = 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static ssize_t comm_channel_send(comm_channel_t *this_, const sock_tcp_header_t *hdr_, const void *msg_,
+                                 size_t len_, size_t *ntrans_)
+{
+        buffer_t *buf = &this_->buf;
+
+        void *msg;
+        size_t len;
+
+        sock_tcp_header_t _hdr;
+        sock_tcp_header_t *hdr;
+
+        if (hdr_) { // Use provided header
+                hdr = (sock_tcp_header_t *)hdr_;
+        } else { // Construct header for the message
+                hdr = &_hdr;
+                memset(hdr, 0, sizeof(*hdr));
+                hdr->msg_len = len_;
+        }
+
+        if (msg_) {
+                msg = (void *)msg_;
+                len = len_;
+        } else { // Sending internal buffer
+                msg = buf->data;
+                len = buf->n;
+        }
+
+        struct iovec iov = {msg, len};
+        return comm_channel_sendv(this_, hdr, &iov, 1, ntrans_);
+}
+
+//------------------------------------------------------------------------------
+// Frame the iovec segments as one message and send header and payload with a
+// single sendmsg (or io_uring chain) where the socket accepts it all at once.
+// With batching on, messages shorter than the batch length are queued
+// instead.
+//------------------------------------------------------------------------------
+ssize_t comm_channel_sendv(comm_channel_t *this_, const sock_tcp_header_t *hdr_, const struct iovec *iov_, int iovcnt_,
+                           size_t *ntrans_)
+{
+        struct iovec _iov[SOCK_IOV_STACK];
+        struct iovec *iov = _iov;
+
+        sock_tcp_header_t _hdr;
+        sock_tcp_header_t *hdr;
+        unsigned char whdr[SOCK_HDR_MAX];
+        size_t whdr_len;
+
+        struct iovec ziov;
+        void *z = NULL;
+        size_t zcap = 0;
+        unsigned char trailer[SOCK_CRC_LEN];
+        int ntrailer = 0;
+
+        ssize_t n;
+        size_t len = 0;
+        size_t ntrans = 0, _ntrans = 0;
+        int i;
+
+        if (iovcnt_ < 0) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        for (i = 0; i < iovcnt_; i++)
+                len += iov_[i].iov_len;
+
+        if (hdr_) { // Use provided header
+                hdr = (sock_tcp_header_t *)hdr_;
+        } else { // Construct header for the message
+                hdr = &_hdr;
+                memset(hdr, 0, sizeof(*hdr));
+                hdr->msg_len = len;
+        }
+
+        // Send the payload compressed if that pays off
+        if (comm_channel_comp_want(this_, len) &&
+            (z = comm_channel_deflate(this_, iov_, iovcnt_, len, &ziov.iov_len, &zcap))) {
+                if (hdr != &_hdr) {
+                        _hdr = *hdr;
+                        hdr  = &_hdr;
+                }
+                ziov.iov_base = z;
+                hdr->msg_len  = len = ziov.iov_len;
+                set_bit(hdr->opts, SOCK_OPTS_COMP);
+                iov_    = &ziov;
+                iovcnt_ = 1;
+        }
+
+        if (comm_channel_crc_want(this_, len)) {
+                if (hdr != &_hdr) {
+                        _hdr = *hdr;
+                        hdr  = &_hdr;
+                }
+                set_bit(hdr->flags, SOCK_HF_CRC);
+                crc_trailer(crc_iov(0, iov_, iovcnt_), trailer);
+                ntrailer = 1;
+        }
+
+        if ((whdr_len = sock_hdr_encode(hdr, this_->hdr_v2, whdr)) == 0) {
+                n = -1;
+                goto fini;
+        }
+
+        if (iovcnt_ + 1 + ntrailer > SOCK_IOV_STACK) {
+                if ((iov = malloc((iovcnt_ + 1 + ntrailer) * sizeof(*iov))) == NULL) {
+                        iov = _iov;
+                        n   = -1;
+                        goto fini;
+                }
+        }
+
+        iov[0].iov_base = whdr;
+        iov[0].iov_len  = whdr_len;
+        memcpy(iov + 1, iov_, iovcnt_ * sizeof(*iov));
+        if (ntrailer) {
+                iov[iovcnt_ + 1].iov_base = trailer;
+                iov[iovcnt_ + 1].iov_len  = SOCK_CRC_LEN;
+                whdr_len += SOCK_CRC_LEN; // Framing overhead from here on
+        }
+
+        // Shared channels send from several threads and never batch
+        if (this_->batch_len && !this_->shared && whdr_len + len < this_->batch_len) {
+                n = comm_channel_batch_add(this_, iov, iovcnt_ + 1 + ntrailer, whdr_len + len, ntrans_);
+                goto fini;
+        }
+
+        // Anything batched goes first
+        if (this_->wb.n && (n = comm_channel_flush(this_, &ntrans)) < 0)
+                goto fini;
+
+        if ((n = comm_channel_writev(this_, iov, iovcnt_ + 1 + ntrailer, len, &_ntrans)) >= 0)
+                ntrans += _ntrans;
+        if (ntrans_)
+                *ntrans_ = ntrans;
+
+fini:
+        if (iov != _iov)
+                free(iov);
+        if (z)
+                sock_bufpool_put(z, zcap);
+
+        return n;
+}
+
+//------------------------------------------------------------------------------
+// Send the framed message iov_ (payload of len_ bytes) through the active
+// backend
+//------------------------------------------------------------------------------
+static ssize_t comm_channel_writev(comm_channel_t *this_, struct iovec *iov_, int iovcnt_, size_t len_,
+                                   size_t *ntrans_)
+{
+        sock_deadline_t *dl = comm_channel_arm(this_, &this_->tx, this_->xfer_ms);
+
+        if (this_->shm)
+                return sock_shm_sendv(this_->shm, iov_, iovcnt_, ntrans_, dl);
+#ifdef HAVE_IO_URING
+        sock_uring_t *ring;
+        if ((ring = comm_channel_uring(this_)))
+                return sock_uring_sendv(ring, iov_, iovcnt_, ntrans_);
+#endif
+#ifdef SOCK_HAVE_ZEROCOPY
+        if (this_->zc_threshold && len_ >= this_->zc_threshold && comm_channel_zerocopy_arm(this_))
+                return comm_channel_writev_zc(this_, iov_, iovcnt_, len_, ntrans_, dl);
+#endif
+        return trans_sendv(this_->fd, iov_, iovcnt_, 0, ntrans_, NULL, dl);
+}
+
+//------------------------------------------------------------------------------
+// Queue the framed message iov_ of len_ bytes in the batch, flushing first if
+// it would not fit and afterwards if the batch has reached its age limit
+//------------------------------------------------------------------------------
+static ssize_t comm_channel_batch_add(comm_channel_t *this_, const struct iovec *iov_, int iovcnt_, size_t len_,
+                                      size_t *ntrans_)
+{
+        ssize_t n;
+        size_t ntrans = 0, _ntrans = 0;
+        int i;
+
+        if (this_->wb.n + len_ > this_->batch_len) {
+                ERR_RET(n, comm_channel_flush(this_, &ntrans));
+        }
+
+        ERR_RET(n, buffer_resize(&this_->wb, this_->wb.n + len_)); // The appends cannot fail
+        if (this_->wb.n == 0)
+                this_->batch_at = sock_clock_ms();
+        for (i = 0; i < iovcnt_; i++)
+                buffer_append(&this_->wb, iov_[i].iov_base, iov_[i].iov_len);
+
+        if (this_->batch_ms && sock_clock_ms() - this_->batch_at >= this_->batch_ms) {
+                ERR_RET(n, comm_channel_flush(this_, &_ntrans));
+                ntrans += _ntrans;
+        }
+
+        if (ntrans_)
+                *ntrans_ = ntrans;
+        return len_;
+}
+
+//------------------------------------------------------------------------------
+// Whether a payload of len_ bytes is to be compressed. Zero-copy sends are
+// left alone (their point is not to copy the payload); after a miss the next
+// comp_skip messages are not tried.
+//------------------------------------------------------------------------------
+static bool comm_channel_comp_want(comm_channel_t *this_, size_t len_)
+{
+        if (!this_->codec || !this_->comp_ok || this_->shm || this_->shared || len_ == 0 || len_ < this_->comp_min ||
+            len_ > SOCK_COMP_MAX)
+                return false;
+#ifdef SOCK_HAVE_ZEROCOPY
+        if (this_->zc_threshold && len_ >= this_->zc_threshold)
+                return false;
+#endif
+        if (this_->comp_skip) {
+                this_->comp_skip--;
+                return false;
+        }
+        return true;
+}
+
+//------------------------------------------------------------------------------
+// Compress the len_ byte payload iov_ into a buffer pool block (capacity
+// *cap_) holding the SOCK_COMP_HDR prefix and the codec output, *zlen_ bytes
+// in all. Returns NULL if the payload does not shrink by at least 1/8; large
+// payloads are first judged by a sample from the middle. Every miss doubles
+// the number of messages then sent without trying.
+//------------------------------------------------------------------------------
+static void *comm_channel_deflate(comm_channel_t *this_, const struct iovec *iov_, int iovcnt_, size_t len_,
+                                  size_t *zlen_, size_t *cap_)
+{
+        const sock_codec_t *codec = this_->codec;
+        const unsigned char *in   = iov_[0].iov_base;
+        unsigned char *gather = NULL, *out;
+        size_t gcap = 0, off = 0;
+        ssize_t k;
+        int i;
+
+        if (iovcnt_ > 1) { // The codecs take contiguous input
+                if ((gather = sock_bufpool_get(len_, &gcap)) == NULL)
+                        return NULL;
+                for (i = 0; i < iovcnt_; i++) {
+                        memcpy(gather + off, iov_[i].iov_base, iov_[i].iov_len);
+                        off += iov_[i].iov_len;
+                }
+                in = gather;
+        }
+
+        if ((out = sock_bufpool_get(SOCK_COMP_HDR + len_, cap_)) == NULL)
+                goto fini;
+
+        if (len_ >= 16 * SOCK_COMP_PROBE &&
+            codec->compress(in + len_ / 2 - SOCK_COMP_PROBE / 2, SOCK_COMP_PROBE, out,
+                            SOCK_COMP_PROBE - SOCK_COMP_PROBE / 8) <= 0)
+                goto miss;
+        if ((k = codec->compress(in, len_, out + SOCK_COMP_HDR, len_ - len_ / 8)) <= 0)
+                goto miss;
+
+        out[0] = codec->id;
+        out[1] = len_;
+        out[2] = len_ >> 8;
+        out[3] = len_ >> 16;
+        out[4] = len_ >> 24;
+        *zlen_ = SOCK_COMP_HDR + k;
+
+        this_->comp_backoff = 0;
+        goto fini;
+
+miss:
+        sock_bufpool_put(out, *cap_);
+        out = NULL;
+
+        this_->comp_backoff = this_->comp_backoff == 0 ? 1 : 2 * this_->comp_backoff;
+        if (this_->comp_backoff > SOCK_COMP_BACKOFF_MAX)
+                this_->comp_backoff = SOCK_COMP_BACKOFF_MAX;
+        this_->comp_skip = this_->comp_backoff;
+
+fini:
+        if (gather)
+                sock_bufpool_put(gather, gcap);
+        return out;
+}
+
+//------------------------------------------------------------------------------
+// Whether a payload of len_ bytes (as sent) gets a CRC32C trailer. Empty
+// payloads never do, so that no message without payload has to be read
+// further; shared memory needs no checksum. Zero-copy sends copy the trailer
+// (see comm_channel_writev_zc).
+//------------------------------------------------------------------------------
+static bool comm_channel_crc_want(const comm_channel_t *this_, size_t len_)
+{
+        return this_->crc && this_->crc_ok && this_->hdr_v2 && !this_->shm && len_ > 0;
+}
+
+//------------------------------------------------------------------------------
+// Fail with EMSGSIZE if len_ bytes of payload are more than the channel may
+// buffer; checked wherever a received payload is allocated, so paths that
+// stream it elsewhere (recv_to_fd, recv_into) take any length
+//------------------------------------------------------------------------------
+int comm_channel_msg_check(const comm_channel_t *this_, uint64_t len_)
+{
+        if (len_ > (this_->msg_max ? this_->msg_max : SOCK_MSG_MAX)) {
+                errno = EMSGSIZE;
+                return -1;
+        }
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Read the trailer of the payload just completed and compare it with the
+// CRC32C accumulated while the payload was read. Fails with EBADMSG on a
+// mismatch.
+//------------------------------------------------------------------------------
+static ssize_t comm_channel_crc_check(comm_channel_t *this_, size_t *ntrans_)
+{
+        unsigned char trailer[SOCK_CRC_LEN];
+        uint32_t crc;
+        ssize_t n;
+
+        this_->rx_crc_on = false;
+        ERR_RET(n, comm_channel_read(this_, trailer, sizeof(trailer), ntrans_));
+
+        crc = trailer[0] | trailer[1] << 8 | trailer[2] << 16 | (uint32_t)trailer[3] << 24;
+        if (crc != this_->rx_crc) {
+                errno = EBADMSG;
+                return -1;
+        }
+        return n;
+}
+
+//------------------------------------------------------------------------------
+// Send CRC32C trailers with the messages sent on the channel once the peer
+// has agreed to them
+//------------------------------------------------------------------------------
+int comm_channel_checksum(comm_channel_t *this_, bool on_)
+{
+        this_->crc = on_;
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Compress the messages sent on the channel with the registered codec codec_
+// (NULL disables) when they are at least min_ bytes long and the peer agreed
+// to compression
+//------------------------------------------------------------------------------
+int comm_channel_compress(comm_channel_t *this_, const char *codec_, size_t min_)
+{
+        const sock_codec_t *codec = NULL;
+
+        if (codec_ && (codec = sock_codec_find(codec_)) == NULL) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        this_->codec        = codec;
+        this_->comp_min     = min_;
+        this_->comp_skip    = 0;
+        this_->comp_backoff = 0;
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Queue messages shorter than len_ bytes (header included) and send them
+// together with a single sendmsg once the next one would take the batch past
+// len_ bytes, the oldest has waited ms_ ms (checked on every send, or by the
+// caller through comm_channel_batch_timeout; 0 for no limit) or
+// comm_channel_flush is called. A receive flushes the batch before
+// waiting for the reply. With cork_ each flush is sent with TCP_CORK set so
+// that the batch goes out in full segments. len_ = 0 disables batching;
+// anything queued is sent first.
+//------------------------------------------------------------------------------
+int comm_channel_batch(comm_channel_t *this_, size_t len_, int ms_, bool cork_)
+{
+        if (ms_ < 0) {
+                errno = EINVAL;
+                return -1;
+        }
+        if (this_->wb.n && comm_channel_flush(this_, NULL) < 0)
+                return -1;
+
+        this_->batch_len  = len_;
+        this_->batch_ms   = ms_;
+        this_->batch_cork = cork_;
+
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Time left (ms) before the batch is due for flushing; -1 if it is empty or
+// has no age limit
+//------------------------------------------------------------------------------
+int comm_channel_batch_timeout(const comm_channel_t *this_)
+{
+        int64_t ms;
+
+        if (this_->wb.n == 0 || this_->batch_ms == 0)
+                return -1;
+        ms = this_->batch_at + this_->batch_ms - sock_clock_ms();
+        return ms > 0 ? (int)ms : 0;
+}
+
+//------------------------------------------------------------------------------
+// Send the batched messages. The batch is emptied even if this fails, the
+// connection being out of step then anyway.
+//------------------------------------------------------------------------------
+ssize_t comm_channel_flush(comm_channel_t *this_, size_t *ntrans_)
+{
+        struct iovec iov = {this_->wb.data, this_->wb.n};
+        bool cork        = this_->batch_cork && !this_->shm;
+        int on = 1, off = 0, err;
+        ssize_t n;
+
+        if (this_->wb.n == 0) {
+                if (ntrans_)
+                        *ntrans_ = 0;
+                return 0;
+        }
+
+        if (cork) // Fails harmlessly on AF_UNIX
+                setsockopt(this_->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+
+        n   = comm_channel_writev(this_, &iov, 1, 0, ntrans_);
+        err = errno;
+
+        if (cork) // Pushes out the final partial segment
+                setsockopt(this_->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+
+        this_->wb.n = 0;
+        errno       = err;
+        return n;
+}
+
+//------------------------------------------------------------------------------
+// Frame the iovec segments followed by len_ bytes of file fd_ (from offset_)
+// as one message. The header and segments are sent with MSG_MORE so they
+// share segments with the file data, which is moved by sendfile without
+// passing through user space. A CRC32C trailer is computed from the page
+// cache beforehand, and the socket corked until it is sent.
+//------------------------------------------------------------------------------
+static ssize_t comm_channel_sendfile(comm_channel_t *this_, const struct iovec *iov_, int iovcnt_, int fd_,
+                                     off_t offset_, size_t len_, size_t *ntrans_)
+{
+        struct iovec _iov[SOCK_IOV_STACK];
+        struct iovec *iov = _iov;
+
+        sock_tcp_header_t hdr;
+        unsigned char whdr[SOCK_HDR_MAX];
+        size_t whdr_len;
+        sock_deadline_t *dl;
+
+        unsigned char trailer[SOCK_CRC_LEN];
+        struct iovec tiov = {trailer, sizeof(trailer)};
+        uint32_t crc;
+        bool crc_on;
+        int on = 1, off = 0, err;
+
+        ssize_t n, _n;
+        size_t ntrans = 0, _ntrans = 0;
+        int i;
+
+        if (iovcnt_ < 0 || offset_ < 0) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (this_->wb.n) { // Batched messages go first
+                ERR_RET(n, comm_channel_flush(this_, NULL));
+        }
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_len = len_;
+        for (i = 0; i < iovcnt_; i++)
+                hdr.msg_len += iov_[i].iov_len;
+
+        if (comm_channel_comp_want(this_, hdr.msg_len))
+                return comm_channel_sendfile_comp(this_, iov_, iovcnt_, fd_, offset_, len_, ntrans_);
+
+        if ((crc_on = comm_channel_crc_want(this_, hdr.msg_len))) {
+                crc = crc_iov(0, iov_, iovcnt_);
+                ERR_RET(n, trans_crc(fd_, offset_, len_, &crc));
+                crc_trailer(crc, trailer);
+                set_bit(hdr.flags, SOCK_HF_CRC);
+        }
+
+        if ((whdr_len = sock_hdr_encode(&hdr, this_->hdr_v2, whdr)) == 0)
+                return -1;
+
+        if (iovcnt_ + 1 > SOCK_IOV_STACK) {
+                if ((iov = malloc((iovcnt_ + 1) * sizeof(*iov))) == NULL)
+                        return -1;
+        }
+
+        iov[0].iov_base = whdr;
+        iov[0].iov_len  = whdr_len;
+        memcpy(iov + 1, iov_, iovcnt_ * sizeof(*iov));
+
+        dl = comm_channel_arm(this_, &this_->tx, this_->xfer_ms);
+
+        if (crc_on) // Fails harmlessly on AF_UNIX
+                setsockopt(this_->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+
+        if (this_->shm)
+                n = sock_shm_sendv(this_->shm, iov, iovcnt_ + 1, &ntrans, dl);
+        else
+                n = trans_sendv(this_->fd, iov, iovcnt_ + 1, len_ || crc_on ? MSG_MORE : 0, &ntrans, NULL, dl);
+
+        if (iov != _iov)
+                free(iov);
+        if (n < 0)
+                goto fini;
+
+        if (this_->shm)
+                _n = sock_shm_sendfile(this_->shm, fd_, offset_, len_, &_ntrans, dl);
+        else
+                _n = trans_sendfile(this_->fd, fd_, offset_, len_, &_ntrans, dl);
+        if (_n < 0) {
+                n = _n;
+                goto fini;
+        }
+        n += _n;
+        ntrans += _ntrans;
+
+        if (crc_on) {
+                if ((_n = trans_sendv(this_->fd, &tiov, 1, 0, &_ntrans, NULL, dl)) < 0) {
+                        n = _n;
+                        goto fini;
+                }
+                n += _n;
+                ntrans += _ntrans;
+        }
+
+        if (ntrans_)
+                *ntrans_ = ntrans;
+
+fini:
+        if (crc_on) { // Pushes out the final partial segment
+                err = errno;
+                setsockopt(this_->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+                errno = err;
+        }
+        return n;
+}
+
+//------------------------------------------------------------------------------
+// comm_channel_sendfile for a compressed message: the file data is read into
+// memory for the codec, and sent from there uncompressed if it does not
+// compress
+//------------------------------------------------------------------------------
+static ssize_t comm_channel_sendfile_comp(comm_channel_t *this_, const struct iovec *iov_, int iovcnt_, int fd_,
+                                          off_t offset_, size_t len_, size_t *ntrans_)
+{
+        sock_tcp_header_t hdr;
+        unsigned char whdr[SOCK_HDR_MAX];
+        unsigned char trailer[SOCK_CRC_LEN];
+        struct iovec iov[3];
+        unsigned char *data, *z;
+        size_t cap, zcap, len = 0;
+        ssize_t n;
+        int i;
+
+        memset(&hdr, 0, sizeof(hdr));
+        for (i = 0; i < iovcnt_; i++)
+                hdr.msg_len += iov_[i].iov_len;
+
+        if ((data = sock_bufpool_get(hdr.msg_len + len_, &cap)) == NULL)
+                return -1;
+        for (i = 0; i < iovcnt_; i++) {
+                memcpy(data + len, iov_[i].iov_base, iov_[i].iov_len);
+                len += iov_[i].iov_len;
+        }
+        hdr.msg_len += len_;
+
+        while (len < hdr.msg_len) {
+                n = pread(fd_, data + len, hdr.msg_len - len, offset_);
+                if (n > 0) {
+                        len += n;
+                        offset_ += n;
+                } else if (n < 0 && errno == EINTR) {
+                        continue;
+                } else { // Shorter than len_
+                        if (n == 0)
+                                errno = EIO;
+                        n = -1;
+                        goto fini;
+                }
+        }
+
+        iov[1].iov_base = data;
+        iov[1].iov_len  = len;
+        if ((z = comm_channel_deflate(this_, iov + 1, 1, len, &iov[1].iov_len, &zcap))) {
+                iov[1].iov_base = z;
+                set_bit(hdr.opts, SOCK_OPTS_COMP);
+        }
+        hdr.msg_len = iov[1].iov_len;
+
+        iov[2].iov_base = trailer;
+        iov[2].iov_len  = 0;
+        if (comm_channel_crc_want(this_, hdr.msg_len)) {
+                crc_trailer(crc_iov(0, iov + 1, 1), trailer);
+                iov[2].iov_len = sizeof(trailer);
+                set_bit(hdr.flags, SOCK_HF_CRC);
+        }
+
+        iov[0].iov_base = whdr;
+        if ((iov[0].iov_len = sock_hdr_encode(&hdr, this_->hdr_v2, whdr)) == 0)
+                n = -1;
+        else
+                n = comm_channel_writev(this_, iov, 3, iov[1].iov_len, ntrans_);
+
+        if (z)
+                sock_bufpool_put(z, zcap);
+fini:
+        sock_bufpool_put(data, cap);
+        return n;
+}
+
+//------------------------------------------------------------------------------
+// Answer the worker port request req_ with wport_ and switch to the header
+// version agreed on. Of the other options offered, those in accept_ are
+// agreed to as well.
+//------------------------------------------------------------------------------
+static ssize_t comm_channel_reply_wport(comm_channel_t *this_, const sock_tcp_header_t *req_, uint16_t wport_,
+                                        unsigned char accept_, size_t *ntrans_)
+{
+        sock_tcp_header_t hdr;
+        ssize_t n;
+
+        sock_handshake_reply(req_, &hdr, sizeof(wport_));
+        hdr.opts |= req_->opts & accept_;
+
+        this_->hdr_v2 = false;
+        ERR_RET(n, comm_channel_send(this_, &hdr, &wport_, sizeof(wport_), ntrans_));
+        this_->hdr_v2  = (hdr.opts & SOCK_OPTS_HDR_V2) != 0;
+        this_->comp_ok = (hdr.opts & SOCK_OPTS_COMP) != 0;
+        this_->crc_ok  = (hdr.opts & SOCK_OPTS_CRC) != 0;
+
+        return n;
+}
+
+//------------------------------------------------------------------------------
+// Client side of the shared memory setup: create the rings and send them to
+// the server in an empty SOCK_OPTS_SHM message. All further messages go
+// through the rings.
+//------------------------------------------------------------------------------
+static int comm_channel_shm_offer(comm_channel_t *this_)
+{
+        sock_tcp_header_t hdr;
+        unsigned char whdr[SOCK_HDR_MAX];
+        size_t whdr_len;
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.opts = SOCK_OPTS_SHM;
+        whdr_len = sock_hdr_encode(&hdr, this_->hdr_v2, whdr);
+
+        if ((this_->shm = sock_shm_offer(this_->fd, whdr, whdr_len, SOCK_SHM_LEN)) == NULL)
+                return -1;
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Server side of the shared memory setup: receive the SOCK_OPTS_SHM message
+// and map the rings that come with it
+//------------------------------------------------------------------------------
+static int comm_channel_shm_accept(comm_channel_t *this_)
+{
+        sock_tcp_header_t hdr;
+        unsigned char whdr[SOCK_HDR_MAX], rhdr[SOCK_HDR_MAX];
+        size_t whdr_len;
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.opts = SOCK_OPTS_SHM;
+        whdr_len = sock_hdr_encode(&hdr, this_->hdr_v2, whdr);
+
+        if ((this_->shm = sock_shm_accept(this_->fd, rhdr, whdr_len)) == NULL)
+                return -1;
+        if (memcmp(rhdr, whdr, whdr_len) != 0) {
+                sock_shm_free(&this_->shm);
+                errno = EPROTO;
+                return -1;
+        }
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+//
+//------------------------------------------------------------------------------
+static ssize_t comm_channel_recv(comm_channel_t *this_, sock_tcp_header_t *hdr_, void **msg_, size_t *len_,
+                                 size_t *ntrans_)
+{
+        ssize_t n = 0, _n = 0;
+        size_t ntrans = 0, _ntrans = 0;
+
+        buffer_t *buf = &this_->buf;
+
+        sock_tcp_header_t _hdr;
+        sock_tcp_header_t *hdr;
+
+        if (hdr_) {
+                hdr = hdr_;
+        } else {
+                hdr = &_hdr;
+        }
+
+        // Read the header (unless already peeked)
+        ERR_RET(_n, comm_channel_recv_hdr(this_, hdr, &_ntrans));
+        n      = _n;
+        ntrans = _ntrans;
+
+        // A decompressed payload is handed over whole
+        if (this_->zpos == 0 && this_->zd.n && this_->zd.n == this_->rx_pending) {
+                buffer_t zd       = this_->zd;
+                this_->zd         = *buf;
+                this_->zd.n       = 0;
+                *buf              = zd;
+                this_->rx_pending = 0;
+                this_->rx_active  = false;
+                goto fini;
+        }
+
+        // Make sure that the buffer is large enough
+        ERR_RET(_n, comm_channel_msg_check(this_, this_->rx_pending));
+        ERR_RET(_n, buffer_resize(buf, this_->rx_pending));
+        buf->n = this_->rx_pending;
+
+        // Read the (remaining) message
+        ERR_RET(_n, comm_channel_recv_payload(this_, buf->data, buf->n, &_ntrans));
+        n += _n;
+        ntrans += _ntrans;
+
+fini:
+        // Provide reference to internal data
+        if (msg_) {
+                *msg_ = buf->data;
+                *len_ = buf->n;
+        }
+
+        if (ntrans_)
+                *ntrans_ = ntrans;
+
+        return n;
+}
+
+//------------------------------------------------------------------------------
+// Receive the next message straight into data_. If the message is larger than
+// cap_ nothing is read past the header: errno is set to EMSGSIZE, *len_ gives
+// the message length and the payload can be read with
+// comm_channel_recv_payload.
+//------------------------------------------------------------------------------
+static ssize_t comm_channel_recv_into(comm_channel_t *this_, void *data_, size_t cap_, size_t *len_,
+                                      size_t *ntrans_)
+{
+        ssize_t n = 0, _n = 0;
+        size_t ntrans = 0, _ntrans = 0;
+        size_t len;
+
+        ERR_RET(_n, comm_channel_recv_hdr(this_, NULL, &_ntrans));
+        n      = _n;
+        ntrans = _ntrans;
+
+        len = this_->rx_pending;
+        if (len_)
+                *len_ = len;
+
+        if (len > cap_) {
+                if (ntrans_)
+                        *ntrans_ = ntrans;
+                errno = EMSGSIZE;
+                return -1;
+        }
+
+        ERR_RET(_n, comm_channel_recv_payload(this_, data_, len, &_ntrans));
+        n += _n;
+        ntrans += _ntrans;
+
+        if (ntrans_)
+                *ntrans_ = ntrans;
+
+        return n;
+}
+
+//------------------------------------------------------------------------------
+// Read the header of the next message and make its payload pending. If a
+// header has already been read and its payload is still pending, it is
+// returned again and nothing is read.
+//------------------------------------------------------------------------------
+ssize_t comm_channel_recv_hdr(comm_channel_t *this_, sock_tcp_header_t *hdr_, size_t *ntrans_)
+{
+        unsigned char whdr[SOCK_HDR_MAX];
+        size_t whdr_len, need;
+        ssize_t n = 0, _n;
+        size_t ntrans = 0, _ntrans = 0;
+
+        if (!this_->rx_active) {
+                // The peer may be waiting for batched messages before it answers
+                if (this_->wb.n && !this_->shared) {
+                        ERR_RET(n, comm_channel_flush(this_, NULL));
+                }
+                comm_channel_arm(this_, &this_->rx, this_->idle_ms);
+
+                // A v2 header is read in two steps unless it is the shortest form
+                whdr_len = sock_hdr_len(this_->hdr_v2, NULL, 0);
+                ERR_RET(n, comm_channel_read(this_, whdr, whdr_len, &ntrans));
+                if ((need = sock_hdr_len(this_->hdr_v2, whdr, whdr_len)) > whdr_len) {
+                        ERR_RET(_n, comm_channel_read(this_, whdr + whdr_len, need - whdr_len, &_ntrans));
+                        n += _n;
+                        ntrans += _ntrans;
+                }
+                ERR_RET(_n, sock_hdr_decode(&this_->rx_hdr, this_->hdr_v2, whdr));
+                this_->rx_crc_on = (this_->rx_hdr.flags & SOCK_HF_CRC) != 0;
+                this_->rx_crc    = 0;
+                // Compressed payloads are made to look as sent (before compression
+                // is agreed the bit is the handshake offer)
+                if (this_->comp_ok && this_->rx_hdr.opts & SOCK_OPTS_COMP) {
+                        ERR_RET(_n, comm_channel_inflate(this_, &_ntrans));
+                        n += _n;
+                        ntrans += _ntrans;
+                }
+                if (this_->rx_crc_on && this_->rx_hdr.msg_len == 0) {
+                        ERR_RET(_n, comm_channel_crc_check(this_, &_ntrans));
+                        n += _n;
+                        ntrans += _ntrans;
+                }
+                this_->rx_active  = true;
+                this_->rx_pending = this_->rx_hdr.msg_len;
+        }
+
+        if (hdr_)
+                *hdr_ = this_->rx_hdr;
+        if (ntrans_)
+                *ntrans_ = ntrans;
+
+        return n;
+}
+
+//------------------------------------------------------------------------------
+// Receive the compressed payload of rx_hdr and decompress it into zd, from
+// where the payload reads take it; rx_hdr is changed to describe the original
+// message
+//------------------------------------------------------------------------------
+static ssize_t comm_channel_inflate(comm_channel_t *this_, size_t *ntrans_)
+{
+        sock_tcp_header_t *hdr = &this_->rx_hdr;
+        const sock_codec_t *codec;
+        unsigned char *z;
+        size_t cap, raw;
+        ssize_t n;
+
+        if (hdr->msg_len < SOCK_COMP_HDR || hdr->msg_len > SOCK_COMP_HDR + SOCK_COMP_MAX) {
+                errno = EPROTO;
+                return -1;
+        }
+        if ((z = sock_bufpool_get(hdr->msg_len, &cap)) == NULL)
+                return -1;
+
+        comm_channel_arm(this_, &this_->rx, this_->xfer_ms);
+        if ((n = comm_channel_read(this_, z, hdr->msg_len, ntrans_)) < 0)
+                goto fini;
+        if (this_->rx_crc_on && comm_channel_crc_check(this_, NULL) < 0) { // Before the codec sees it
+                n = -1;
+                goto fini;
+        }
+
+        raw = z[1] | z[2] << 8 | z[3] << 16 | (size_t)z[4] << 24;
+        if ((codec = sock_codec_get(z[0])) == NULL || raw > SOCK_COMP_MAX) {
+                errno = EPROTO;
+                n     = -1;
+                goto fini;
+        }
+        if ((n = comm_channel_msg_check(this_, raw)) < 0)
+                goto fini;
+
+        if ((n = buffer_resize(&this_->zd, raw)) < 0)
+                goto fini;
+        if (codec->decompress(z + SOCK_COMP_HDR, hdr->msg_len - SOCK_COMP_HDR, this_->zd.data, raw) != (ssize_t)raw) {
+                errno = EPROTO;
+                n     = -1;
+                goto fini;
+        }
+        this_->zd.n  = raw;
+        this_->zpos  = 0;
+        hdr->msg_len = raw;
+        unset_bit(hdr->opts, SOCK_OPTS_COMP);
+
+fini:
+        sock_bufpool_put(z, cap);
+        return n;
+}
+
+//------------------------------------------------------------------------------
+// Read the next len_ bytes of the pending payload into data_. The payload may
+// be consumed in any number of pieces; the message is complete once all of it
+// has been read.
+//------------------------------------------------------------------------------
+ssize_t comm_channel_recv_payload(comm_channel_t *this_, void *data_, size_t len_, size_t *ntrans_)
+{
+        ssize_t n;
+
+        if (!this_->rx_active || len_ > this_->rx_pending) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        comm_channel_arm(this_, &this_->rx, this_->xfer_ms);
+        ERR_RET(n, comm_channel_read(this_, data_, len_, ntrans_));
+
+        this_->rx_pending -= len_;
+        if (this_->rx_pending == 0) {
+                this_->rx_active = false;
+                if (this_->rx_crc_on && comm_channel_crc_check(this_, NULL) < 0)
+                        return -1;
+        }
+
+        return n;
+}
+
+//------------------------------------------------------------------------------
+// Start a chunked stream; the logical message is sent as any number of chunk
+// frames followed by an end-of-stream frame, so its length is not bounded by
+// the header length field
+//------------------------------------------------------------------------------
+static int comm_channel_stream_begin(comm_channel_t *this_)
+{
+        if (this_->tx_stream) {
+                errno = EINPROGRESS;
+                return -1;
+        }
+        this_->tx_stream = true;
+        return 0;
+}
+
+//------------------------------------------------------------------------------
+// Send data_ as the next chunk(s) of the stream; chunks larger than the
+// header length field allows are split
+//------------------------------------------------------------------------------
+static ssize_t comm_channel_write_chunk(comm_channel_t *this_, const void *data_, size_t len_, size_t *ntrans_)
+{
+        sock_tcp_header_t hdr;
+        ssize_t n = 0, _n;
+        size_t ntrans = 0, _ntrans = 0;
+        size_t len = 0;
+
+        if (!this_->tx_stream) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.opts = SOCK_OPTS_CHUNK;
+
+        do {
+                hdr.msg_len = len_ - len < UINT32_MAX ? len_ - len : UINT32_MAX;
+                ERR_RET(_n, comm_channel_send(this_, &hdr, data_ + len, hdr.msg_len, &_ntrans));
+                n += _n;
+                ntrans += _ntrans;
+                len += hdr.msg_len;
+        } while (len < len_);
+
+        if (ntrans_)
+                *ntrans_ = ntrans;
+        return n;
+}
+
+//------------------------------------------------------------------------------
+// Finish the stream with an empty end-of-stream chunk
+//------------------------------------------------------------------------------
+static ssize_t comm_channel_stream_end(comm_channel_t *this_, size_t *ntrans_)
+{
+        sock_tcp_header_t hdr;
+
+        if (!this_->tx_stream) {
+                errno = EINVAL;
+                return -1;
+        }
+        this_->tx_stream = false;
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.opts = SOCK_OPTS_CHUNK | SOCK_OPTS_EOS;
+
+        struct iovec iov = {NULL, 0};
+        return comm_channel_sendv(this_, &hdr, &iov, 0, ntrans_);
+}
+
+//------------------------------------------------------------------------------
+// Receive the next chunk of the incoming stream into the internal buffer.
+// Returns 1 with the chunk in *data_/*len_, or 0 once the stream has ended. A
+// plain message is read as a stream of a single chunk, so only as much memory
+// as the largest chunk is needed whatever the total length.
+//------------------------------------------------------------------------------
+static int comm_channel_read_chunk(comm_channel_t *this_, void **data_, size_t *len_, size_t *ntrans_)
+{
+        buffer_t *buf = &this_->buf;
+        sock_tcp_header_t hdr;
+        ssize_t n;
+        size_t ntrans = 0, _ntrans = 0;
+        int rc = -1;
+
+        if (this_->rx_stream == SOCK_RX_LAST) { // Previous chunk was the last one
+                this_->rx_stream = SOCK_RX_NONE;
+                rc               = 0;
+                goto fini;
+        }
+
+        ERR_RET(n, comm_channel_recv_hdr(this_, &hdr, &ntrans));
+
+        if (!(hdr.opts & SOCK_OPTS_CHUNK) && this_->rx_stream == SOCK_RX_STREAM) {
+                errno = EPROTO; // Plain message inside a stream
+                goto fini;
+        }
+
+        if (comm_channel_msg_check(this_, hdr.msg_len) < 0 || buffer_resize(buf, hdr.msg_len) < 0)
+                goto fini;
+        buf->n = hdr.msg_len;
+        if (hdr.msg_len > 0) {
+                if ((n = comm_channel_recv_payload(this_, buf->data, buf->n, &_ntrans)) < 0)
+                        goto fini;
+                ntrans += _ntrans;
+        } else {
+                this_->rx_active = false;
+        }
+
+        if ((hdr.opts & SOCK_OPTS_CHUNK) && (hdr.opts & SOCK_OPTS_EOS) && hdr.msg_len == 0) {
+                this_->rx_stream = SOCK_RX_NONE;
+                rc               = 0;
+                goto fini;
+        }
+
+        if (!(hdr.opts & SOCK_OPTS_CHUNK) || (hdr.opts & SOCK_OPTS_EOS))
+                this_->rx_stream = SOCK_RX_LAST;
+        else
+                this_->rx_stream = SOCK_RX_STREAM;
+
+        *data_ = buf->data;
+        *len_  = buf->n;
+        rc     = 1;
+
+fini:
+        if (rc == 0)
+                *len_ = 0;
+        if (ntrans_)
+                *ntrans_ = ntrans;
+        return rc;
+}
+
+//------------------------------------------------------------------------------
+// Clear the per-connection transfer state (on accept, close and reopen)
+//------------------------------------------------------------------------------
+static void comm_channel_reset(comm_channel_t *this_)
+{
+#ifdef HAVE_IO_URING
+        sock_uring_free(&this_->ring); // Bound to the previous socket
+#endif
+        this_->rx_active  = false;
+        this_->rx_pending = 0;
+        this_->rx_stream  = SOCK_RX_NONE;
+        this_->tx_stream  = false;
+        this_->hdr_v2     = false;
+        this_->comp_ok    = false;
+        this_->comp_skip  = 0;
+        this_->crc_ok     = false;
+        this_->rx_crc_on  = false;
+        this_->zd.n       = 0;
+        this_->zpos       = 0;
+        this_->shared     = false;
+        this_->deadline   = 0;
+        this_->nonblock   = false;
+        this_->ra.n       = 0;
+        this_->rpos       = 0;
+        this_->wb.n       = 0;
+        sock_shm_free(&this_->shm);
+        comm_channel_zerocopy_reset(this_);
+}
+
+//------------------------------------------------------------------------------
+// Set the deadline of the next transfer in dl_: the one set with
+// comm_channel_deadline if any, else ms_ from now (0 for no limit). The socket
+// is made non-blocking the first time a deadline is used.
+//------------------------------------------------------------------------------
+static sock_deadline_t *comm_channel_arm(comm_channel_t *this_, sock_deadline_t *dl_, int ms_)
+{
+        int flags;
+
+        dl_->at = this_->deadline ? this_->deadline : ms_ > 0 ? sock_clock_ms() + ms_ : 0;
+
+        if (dl_->at && !this_->nonblock && this_->fd > 0) {
+                if ((flags = fcntl(this_->fd, F_GETFL)) >= 0 && fcntl(this_->fd, F_SETFL, flags | O_NONBLOCK) == 0)
+                        this_->nonblock = true;
+        }
+        return dl_;
+}
+
+//------------------------------------------------------------------------------
+// Write the payload of the next message (or the rest of a peeked one) to fd_
+// starting at offset_, without passing it through the channel buffer. The
+// file is pre-sized with fallocate. O_DIRECT files, and payloads with a
+// CRC32C trailer, are written from aligned buffers by a helper thread; others
+// are filled with splice through the channel pipe.
+//------------------------------------------------------------------------------
+ssize_t comm_channel_recv_to_fd(comm_channel_t *this_, int fd_, off_t offset_, size_t *ntrans_)
+{
+        ssize_t n = 0, _n = 0;
+        size_t ntrans = 0, _ntrans = 0;
+        size_t len, pre;
+        const void *pre_data;
+        bool inflated;
+        int flags;
+        sock_deadline_t *dl;
+
+        ERR_RET(_n, comm_channel_recv_hdr(this_, NULL, &_ntrans));
+        n      = _n;
+        ntrans = _ntrans;
+
+        len = this_->rx_pending;
+        dl  = comm_channel_arm(this_, &this_->rx, this_->xfer_ms);
+
+        ERR_RET(flags, fcntl(fd_, F_GETFL));
+
+        // Reserve the blocks up front; not every file system supports it
+        if (len > 0 && fallocate(fd_, 0, offset_, len) < 0 && errno != EOPNOTSUPP && errno != ENOSYS)
+                return -1;
+
+        // The start of the payload may already have been read ahead; a
+        // decompressed payload is in memory whole
+        if ((inflated = this_->zpos < this_->zd.n)) {
+                pre_data = this_->zd.data + this_->zpos;
+                pre      = len;
+        } else {
+                pre_data = this_->ra.data + this_->rpos;
+                pre      = this_->ra.n - this_->rpos < len ? this_->ra.n - this_->rpos : len;
+        }
+
+        if (this_->shm) {
+                _n = sock_shm_recv_to_fd(this_->shm, fd_, offset_, len, &_ntrans, dl);
+        } else if (flags & O_DIRECT || this_->rx_crc_on) { // A checksum is taken in user space
+                _n = trans_direct(this_->fd, fd_, offset_, len, &_ntrans, dl, pre_data, pre,
+                                  this_->rx_crc_on ? &this_->rx_crc : NULL);
+        } else {
+                if (this_->pipe[0] == 0) {
+                        ERR_RET(_n, trans_pipe(this_->pipe));
+                }
+                _n = trans_splice(this_->fd, this_->pipe, fd_, offset_, len, &_ntrans, dl, pre_data, pre);
+                if (_n < 0) { // Data may be left in the pipe
+                        close(this_->pipe[0]);
+                        close(this_->pipe[1]);
+                        this_->pipe[0] = this_->pipe[1] = 0;
+                }
+        }
+        ntrans += _ntrans;
+        if (ntrans_)
+                *ntrans_ = ntrans;
+        if (_n < 0)
+                return _n;
+
+        n += _n;
+        if (inflated)
+                this_->zpos += pre;
+        else
+                this_->rpos += pre;
+        this_->rx_pending = 0;
+        this_->rx_active  = false;
+
+        if (this_->rx_crc_on && comm_channel_crc_check(this_, NULL) < 0)
+                return -1;
+
+        return n;
+}
+
+//------------------------------------------------------------------------------
+// Receive exactly n_ bytes from the channel through the active backend, by
+// the deadline armed in this_->rx. Bytes already read ahead are used first.
+// Small socket reads go through the read-ahead buffer, so the headers and
+// payloads of several small messages are received with a single recv.
+//------------------------------------------------------------------------------
+static ssize_t comm_channel_read(comm_channel_t *this_, void *data_, size_t n_, size_t *ntrans_)
+{
+        ssize_t n;
+        size_t k;
+
+        if (this_->zpos < this_->zd.n) { // Decompressed payload of the current message
+                k = this_->zd.n - this_->zpos < n_ ? this_->zd.n - this_->zpos : n_;
+                memcpy(data_, this_->zd.data + this_->zpos, k);
+                this_->zpos += k;
+                if (ntrans_)
+                        *ntrans_ = 0;
+                return k;
+        }
+
+        if ((k = comm_channel_ra_take(this_, data_, n_)) == n_) {
+                if (ntrans_)
+                        *ntrans_ = 0;
+                return k;
+        }
+        data_ += k;
+        n_ -= k;
+
+        if (this_->shm) {
+                n = sock_shm_recv(this_->shm, data_, n_, ntrans_, &this_->rx);
+                return n < 0 ? n : n + (ssize_t)k;
+        }
+#ifdef HAVE_IO_URING
+        sock_uring_t *ring;
+        if ((ring = comm_channel_uring(this_))) {
+                // Keep the internal buffer registered so payloads use fixed-buffer reads
+                if (data_ >= this_->buf.data && data_ < this_->buf.data + this_->buf.len)
+                        sock_uring_register(ring, this_->buf.data, this_->buf.len);
+                n = sock_uring_recv(ring, data_, n_, ntrans_);
+                if (n >= 0 && this_->rx_crc_on)
+                        this_->rx_crc = sock_crc32c(this_->rx_crc, data_, n_);
+                return n < 0 ? n : n + (ssize_t)k;
+        }
+#endif
+        if (n_ >= SOCK_RA_LEN / 2)
+                n = trans_socket(__recv, this_->fd, NULL, data_, n_, ntrans_, &this_->rx,
+                                 this_->rx_crc_on ? &this_->rx_crc : NULL);
+        else
+                n = comm_channel_ra_read(this_, data_, n_, ntrans_);
+        return n < 0 ? n : n + (ssize_t)k;
+}
+
+//------------------------------------------------------------------------------
+// Copy up to n_ read-ahead bytes to data_; returns the number copied
+//------------------------------------------------------------------------------
+static size_t comm_channel_ra_take(comm_channel_t *this_, void *data_, size_t n_)
+{
+        size_t k = this_->ra.n - this_->rpos;
+
+        if (k > n_)
+                k = n_;
+        if (k) {
+                memcpy(data_, this_->ra.data + this_->rpos, k);
+                this_->rpos += k;
+                if (this_->rx_crc_on)
+                        this_->rx_crc = sock_crc32c(this_->rx_crc, data_, k);
+        }
+        return k;
+}
+
+//------------------------------------------------------------------------------
+// Receive as much as fits into the read-ahead buffer with one recv. With
+// wait_ the buffer must be empty and the socket is waited on (by the deadline
+// in this_->rx), end of file being an error; otherwise only data already
+// queued is appended, leaving the buffered bytes in place, and 0 is returned
+// if there is none. Returns the number of bytes added.
+//------------------------------------------------------------------------------
+static ssize_t comm_channel_ra_fill(comm_channel_t *this_, bool wait_, size_t *ntrans_)
+{
+        buffer_t *ra = &this_->ra;
+        ssize_t n;
+        size_t nt = 0;
+
+        if (ra->data == NULL)
+                buffer_ctor(ra, SOCK_RA_LEN);
+        if (wait_) // Everything consumed: start over at the front
+                this_->rpos = ra->n = 0;
+
+        while (ra->n < ra->len) {
+                nt++;
+                n = recv(this_->fd, ra->data + ra->n, ra->len - ra->n, wait_ ? 0 : MSG_DONTWAIT);
+
+                if (n > 0) {
+                        ra->n += n;
+                        this_->rx.nbytes += n;
+                        break;
+                } else if (n == 0) { // Peer disconnect
+                        if (wait_) {
+                                errno = ECOMM;
+                                n     = -1;
+                        }
+                        break;
+                } else if (errno == EINTR) {
+                        continue;
+                } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        n = 0;
+                        if (!wait_)
+                                break;
+                        if (trans_wait(this_->fd, POLLIN, &this_->rx) == 0)
+                                continue;
+                        n = -1;
+                        break;
+                } else {
+                        if (errno != ETIMEDOUT)
+                                errno = ECOMM;
+                        break;
+                }
+        }
+        if (ntrans_)
+                *ntrans_ = nt;
+        return nt == 0 ? 0 : n;
+}
+
+//------------------------------------------------------------------------------
+// Receive exactly n_ bytes through the (empty) read-ahead buffer
+//------------------------------------------------------------------------------
+static ssize_t comm_channel_ra_read(comm_channel_t *this_, void *data_, size_t n_, size_t *ntrans_)
+{
+        size_t len = 0;
+        size_t nt = 0, _nt;
+
+        while (len < n_) {
+                if (comm_channel_ra_fill(this_, true, &_nt) < 0) {
+                        if (ntrans_)
+                                *ntrans_ = nt + _nt;
+                        return -1;
+                }
+                nt += _nt;
+                len += comm_channel_ra_take(this_, data_ + len, n_ - len);
+        }
+        if (ntrans_)
+                *ntrans_ = nt;
+        return len;
+}
+
+//------------------------------------------------------------------------------
+// Decode the header of the next frame into hdr_ if the frame (with any
+// trailer) has been read ahead completely; returns its length on the wire, or
+// 0 if more has to be
+// received (or the header is invalid, which a regular receive reports)
+//------------------------------------------------------------------------------
+static size_t comm_channel_ra_frame(const comm_channel_t *this_, sock_tcp_header_t *hdr_)
+{
+        const unsigned char *p = this_->ra.data + this_->rpos;
+        size_t avail           = this_->ra.n - this_->rpos;
+        size_t hlen            = sock_hdr_len(this_->hdr_v2, p, avail);
+        size_t tlen;
+
+        if (avail < hlen || sock_hdr_decode(hdr_, this_->hdr_v2, p) < 0)
+                return 0;
+        tlen = hdr_->flags & SOCK_HF_CRC ? SOCK_CRC_LEN : 0;
+        if (avail - hlen < hdr_->msg_len || avail - hlen - hdr_->msg_len < tlen)
+                return 0;
+        return hlen + hdr_->msg_len + tlen;
+}
+
+//------------------------------------------------------------------------------
+// Receive up to n_ messages: the next one, waiting for it as comm_channel_recv
+// does, and then every further message that has already arrived, without
+// waiting. msg_[i] points into the channel buffers and stays valid until the
+// next receive. Frames of a chunked stream end the batch (the first one fails
+// with EPROTO and is left pending), as do compressed messages after the
+// first. Returns the number of messages.
+//------------------------------------------------------------------------------
+ssize_t comm_channel_recv_batch(comm_channel_t *this_, struct iovec *msg_, size_t n_, size_t *ntrans_)
+{
+        sock_tcp_header_t hdr;
+        unsigned char trailer[SOCK_CRC_LEN];
+        ssize_t n;
+        size_t count = 0, flen, tlen;
+        size_t ntrans = 0, _ntrans = 0;
+        bool filled = false;
+
+        if (n_ == 0 || this_->rx_stream != SOCK_RX_NONE) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        // The first message may have to be waited for
+        ERR_RET(n, comm_channel_recv_hdr(this_, &hdr, &ntrans));
+        if (hdr.opts & SOCK_OPTS_CHUNK) {
+                errno = EPROTO;
+                goto fini;
+        }
+        if (this_->zpos < this_->zd.n) { // Decompressed
+                msg_[0].iov_base = this_->zd.data + this_->zpos;
+                msg_[0].iov_len  = this_->rx_pending;
+                this_->zpos += this_->rx_pending;
+                this_->rx_pending = 0;
+                this_->rx_active  = false;
+        } else if (this_->rx_pending + (this_->rx_crc_on ? SOCK_CRC_LEN : 0) <=
+                   this_->ra.n - this_->rpos) { // Already read ahead, trailer included
+                msg_[0].iov_base = this_->ra.data + this_->rpos;
+                msg_[0].iov_len  = this_->rx_pending;
+                this_->rpos += this_->rx_pending;
+                this_->rx_pending = 0;
+                this_->rx_active  = false;
+                if (this_->rx_crc_on) {
+                        this_->rx_crc = sock_crc32c(this_->rx_crc, msg_[0].iov_base, msg_[0].iov_len);
+                        if (comm_channel_crc_check(this_, NULL) < 0)
+                                goto fini;
+                }
+        } else {
+                if (comm_channel_msg_check(this_, this_->rx_pending) < 0 ||
+                    buffer_resize(&this_->buf, this_->rx_pending) < 0)
+                        goto fini;
+                this_->buf.n = this_->rx_pending;
+                if (comm_channel_recv_payload(this_, this_->buf.data, this_->buf.n, &_ntrans) < 0) {
+                        ntrans += _ntrans;
+                        goto fini;
+                }
+                ntrans += _ntrans;
+                msg_[0].iov_base = this_->buf.data;
+                msg_[0].iov_len  = this_->buf.n;
+        }
+        count = 1;
+
+        // Then whatever else is complete. The buffer is topped up once without
+        // moving the messages already returned.
+        while (count < n_ && !this_->shm && this_->fd > 0) {
+                if ((flen = comm_channel_ra_frame(this_, &hdr)) == 0) {
+                        if (filled || this_->ra.data == NULL)
+                                break;
+                        filled = true;
+                        if (comm_channel_ra_fill(this_, false, &_ntrans) <= 0)
+                                break;
+                        ntrans += _ntrans;
+                        continue;
+                }
+                if (hdr.opts & (SOCK_OPTS_CHUNK | SOCK_OPTS_COMP))
+                        break;
+
+                tlen                 = hdr.flags & SOCK_HF_CRC ? SOCK_CRC_LEN : 0;
+                msg_[count].iov_base = this_->ra.data + this_->rpos + flen - tlen - hdr.msg_len;
+                msg_[count].iov_len  = hdr.msg_len;
+                if (tlen) { // A bad frame is left for the next receive to report
+                        crc_trailer(sock_crc32c(0, msg_[count].iov_base, hdr.msg_len), trailer);
+                        if (memcmp(trailer, this_->ra.data + this_->rpos + flen - tlen, tlen) != 0)
+                                break;
+                }
+                this_->rpos += flen;
+                count++;
+        }
+
+fini:
+        if (ntrans_)
+                *ntrans_ = ntrans;
+        return count ? (ssize_t)count : -1;
+}
+
+//------------------------------------------------------------------------------
+// Make every following send and receive on the channel complete by timeout_
+// ms from now (a negative timeout_ removes the deadline); the byte counts of
+// both directions restart from 0
 //------------------------------------------------------------------------------
-static int __sock_client_connect_worker(sock_client_t *this_)
+int comm_channel_deadline(comm_channel_t *this_, int timeout_)
 {
-        int n;
-        uint16_t wport = 0;
-
-        n = __sock_client_req_wport(this_, &wport);
+        this_->deadline  = timeout_ < 0 ? 0 : sock_clock_ms() + timeout_;
+        this_->tx.nbytes = 0;
+        this_->rx.nbytes = 0;
 
-        // Check if the master port was returned
-        if (wport == ntohs(this_->cc_master->addr.sin_port)) {
-                this_->cc_worker = this_->cc_master;
-        } else {
-                if (!this_->cc_worker)
-                        this_->cc_worker = comm_channel_alloc(0);
-
-                ERR_RET(n, comm_channel_open(this_->cc_worker, this_->server_host, wport));
-                ERR_RET(n, connect(this_->cc_worker->fd, (struct sockaddr *)&this_->cc_worker->addr,
-                                   sizeof(this_->cc_worker->addr)));
-        }
-        return n;
+        return 0;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-/// comm_channel_t
-////////////////////////////////////////////////////////////////////////////////
-
 //------------------------------------------------------------------------------
-//
+// Enable MSG_ZEROCOPY sends for payloads of at least threshold_ bytes (0
+// disables). Fails with ENOTSUP/EOPNOTSUPP if the socket cannot do zero-copy.
 //------------------------------------------------------------------------------
-static comm_channel_t *comm_channel_alloc(size_t buf_len_)
+int comm_channel_zerocopy(comm_channel_t *this_, size_t threshold_)
 {
-        comm_channel_t *this_ = calloc(1, sizeof(*this_));
-        buffer_ctor(&this_->buf, buf_len_);
+#ifdef SOCK_HAVE_ZEROCOPY
+        this_->zc_threshold = threshold_;
+        if (threshold_ == 0)
+                return 0;
 
-        return this_;
+        if (this_->fd > 0 && !comm_channel_zerocopy_arm(this_)) {
+                this_->zc_threshold = 0;
+                return -1;
+        }
+        return 0;
+#else
+        if (threshold_ == 0)
+                return 0;
+        errno = ENOTSUP;
+        return -1;
+#endif
 }
 
 //------------------------------------------------------------------------------
-//
+// Read zero-copy completion notifications from the socket error queue,
+// waiting up to timeout_ ms (-1 blocks, 0 polls) for all of them. Returns the
+// number of zero-copy sends still referencing caller memory; when 0 every
+// buffer passed to a send may be reused.
 //------------------------------------------------------------------------------
-static int comm_channel_free(comm_channel_t **this_)
+ssize_t comm_channel_zerocopy_reap(comm_channel_t *this_, int timeout_)
 {
-        if (*this_) {
-                buffer_dtor(&(*this_)->buf);
-                free(*this_);
+#ifdef SOCK_HAVE_ZEROCOPY
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        struct sock_extended_err *serr;
+        struct pollfd pfd;
+        int n;
+
+        while (this_->zc_sent != this_->zc_done) {
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_control    = control;
+                msg.msg_controllen = sizeof(control);
+
+                if (recvmsg(this_->zc_fd, &msg, MSG_ERRQUEUE) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno != EAGAIN && errno != EWOULDBLOCK)
+                                return -1;
+                        if (timeout_ == 0)
+                                break;
+
+                        // The error queue signals POLLERR when a notification arrives
+                        pfd.fd     = this_->zc_fd;
+                        pfd.events = 0;
+                        n          = poll(&pfd, 1, timeout_);
+                        if (n < 0) {
+                                if (errno == EINTR)
+                                        continue;
+                                return -1;
+                        }
+                        if (n == 0 || !(pfd.revents & POLLERR))
+                                break;
+                        continue;
+                }
+
+                for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                        if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                              (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+                                continue;
+                        serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+                        if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                                continue;
+                        // Notifications cover the inclusive send id range [ee_info, ee_data]
+                        this_->zc_done += serr->ee_data - serr->ee_info + 1;
+                }
         }
-        *this_ = NULL;
+        return (uint32_t)(this_->zc_sent - this_->zc_done);
+#else
         return 0;
+#endif
 }
 
 //------------------------------------------------------------------------------
-//
+// Forget the zero-copy state of the current socket (the threshold is kept)
 //------------------------------------------------------------------------------
-static int comm_channel_open(comm_channel_t *this_, const struct hostent *host_, uint16_t port_)
+static void comm_channel_zerocopy_reset(comm_channel_t *this_)
+{
+        this_->zc_fd   = 0;
+        this_->zc_sent = 0;
+        this_->zc_done = 0;
+}
 
+#ifdef SOCK_HAVE_ZEROCOPY
+//------------------------------------------------------------------------------
+// Zero-copy send of the framed message iov_ (payload of len_ bytes). The
+// kernel reads pinned pages again after sendmsg returns (queued data,
+// retransmits), so only the caller's payload goes out with MSG_ZEROCOPY; the
+// header and a CRC trailer live on the sender's stack and are copied by
+// ordinary sends, MSG_MORE keeping them in the same segments as the payload.
+//------------------------------------------------------------------------------
+static ssize_t comm_channel_writev_zc(comm_channel_t *this_, struct iovec *iov_, int iovcnt_, size_t len_,
+                                      size_t *ntrans_, sock_deadline_t *dl_)
 {
-        this_->addr.sin_family = AF_INET;
+        ssize_t n, _n;
+        size_t ntrans = 0, _ntrans = 0;
+        size_t k = 0;
+        int end;
 
-        memcpy((char *)&this_->addr.sin_addr.s_addr, (char *)host_->h_addr, host_->h_length);
+        // Segments past the payload are the trailer
+        for (end = 1; end < iovcnt_ && k < len_; end++)
+                k += iov_[end].iov_len;
 
-        this_->addr.sin_port = htons(port_);
+        ERR_RET(n, trans_sendv(this_->fd, iov_, 1, MSG_MORE, &ntrans, NULL, dl_));
+        ERR_RET(_n, trans_sendv(this_->fd, iov_ + 1, end - 1, MSG_ZEROCOPY | (end < iovcnt_ ? MSG_MORE : 0), &_ntrans,
+                                &this_->zc_sent, dl_));
+        n += _n;
+        ntrans += _ntrans;
 
-        ERR_RET(this_->fd, socket(AF_INET, SOCK_STREAM, 0));
+        if (end < iovcnt_) {
+                ERR_RET(_n, trans_sendv(this_->fd, iov_ + end, iovcnt_ - end, 0, &_ntrans, NULL, dl_));
+                n += _n;
+                ntrans += _ntrans;
+        }
 
-        return 0;
+        if (ntrans_)
+                *ntrans_ = ntrans;
+        return n;
 }
 
 //------------------------------------------------------------------------------
-//
+// Enables SO_ZEROCOPY on the channel socket if not done already (the socket
+// changes on accept/reopen). Pending notifications are drained first so that
+// they do not build up against the socket option memory limit.
 //------------------------------------------------------------------------------
-static int comm_channel_close(comm_channel_t *this_)
+static bool comm_channel_zerocopy_arm(comm_channel_t *this_)
 {
-        if (this_->fd)
-                this_->fd = close(this_->fd);
-        return this_->fd;
+        int one = 1;
+
+        if (this_->zc_fd != this_->fd) {
+                comm_channel_zerocopy_reset(this_);
+                if (setsockopt(this_->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0)
+                        return false;
+                this_->zc_fd = this_->fd;
+        } else if (this_->zc_sent != this_->zc_done) {
+                comm_channel_zerocopy_reap(this_, 0);
+        }
+        return true;
 }
+#endif
 
+#ifdef HAVE_IO_URING
 //------------------------------------------------------------------------------
-//
+// Returns the io_uring backend for the channel socket, setting it up on first
+// use. NULL if io_uring is unavailable, in which case plain send/recv is used.
 //------------------------------------------------------------------------------
-static int comm_channel_reopen(comm_channel_t *this_)
+static sock_uring_t *comm_channel_uring(comm_channel_t *this_)
 {
-        if (this_->fd) {
-                ERR_RET(this_->fd, close(this_->fd));
+        int flags;
+
+        // Deadlines need non-blocking syscalls and poll
+        if (this_->nonblock)
+                return NULL;
+        if (this_->ring)
+                return this_->ring;
+
+        // The ring is single issuer; a shared channel uses plain syscalls
+        if (this_->fd <= 0 || this_->shared || !sock_uring_probe())
+                return NULL;
+
+        // A socket handed over non-blocking (e.g. by a pre-fork master) stays on syscalls
+        if ((flags = fcntl(this_->fd, F_GETFL)) < 0 || (flags & O_NONBLOCK)) {
+                this_->nonblock = true;
+                return NULL;
         }
 
-        ERR_RET(this_->fd, socket(AF_INET, SOCK_STREAM, 0));
-
-        return 0;
+        return (this_->ring = sock_uring_alloc(this_->fd));
 }
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+/// sock_tcp_header_t
+////////////////////////////////////////////////////////////////////////////////
 
 //------------------------------------------------------------------------------
-//
+// Write the wire form of hdr_ to out_ (at least SOCK_HDR_MAX bytes) and return
+// its length. Returns 0 with errno EMSGSIZE if the length does not fit the v1
+// header.
 //------------------------------------------------------------------------------
-static ssize_t comm_channel_send(comm_channel_t *this_, const sock_tcp_header_t *hdr_, const void *msg_,
-                                 size_t len_, size_t *ntrans_)
+size_t sock_hdr_encode(const sock_tcp_header_t *hdr_, bool v2_, unsigned char *out_)
 {
-        buffer_t *buf = &this_->buf;
-
-        void *msg;
-        size_t len;
-
-        sock_tcp_header_t _hdr;
-        sock_tcp_header_t *hdr;
-
-        if (hdr_) { // Use provided header
-                hdr = (sock_tcp_header_t *)hdr_;
-        } else { // Construct header for the message
-                hdr = &_hdr;
-                memset(hdr, 0, sizeof(*hdr));
-                hdr->msg_len = len_;
+        uint32_t len32;
+        unsigned char code;
+        size_t n, i;
+
+        if (!v2_) {
+                if (hdr_->msg_len > UINT32_MAX) {
+                        errno = EMSGSIZE;
+                        return 0;
+                }
+                len32 = hdr_->msg_len;
+                memset(out_, 0, SOCK_HDR_V1_LEN);
+                memcpy(out_, &len32, sizeof(len32));
+                out_[4] = hdr_->opts;
+                return SOCK_HDR_V1_LEN;
         }
 
-        if (msg_) {
-                msg = (void *)msg_;
-                len = len_;
-        } else { // Sending internal buffer
-                msg = buf->data;
-                len = buf->n;
+        if (hdr_->msg_len <= UINT8_MAX)
+                code = 0;
+        else if (hdr_->msg_len <= UINT16_MAX)
+                code = 1;
+        else if (hdr_->msg_len <= UINT32_MAX)
+                code = 2;
+        else
+                code = 3;
+
+        out_[0] = SOCK_HDR_V2_MAGIC;
+        out_[1] = hdr_->opts;
+        out_[2] = (hdr_->flags & ~SOCK_HF_LEN_MASK) | code;
+        n       = 3;
+
+        for (i = 0; i < (1u << code); i++)
+                out_[n++] = hdr_->msg_len >> (8 * i);
+
+        if (hdr_->flags & SOCK_HF_SID) {
+                for (i = 0; i < sizeof(uint32_t); i++)
+                        out_[n++] = hdr_->stream_id >> (8 * i);
         }
 
-        return trans_socket(__send, this_->fd, hdr, msg, len, ntrans_);
+        return n;
 }
 
 //------------------------------------------------------------------------------
-//
+// Length of the wire header starting with the n_ bytes in in_. For v2 the
+// first SOCK_HDR_V2_MIN bytes are needed to know it; with fewer, that minimum
+// is returned.
 //------------------------------------------------------------------------------
-static ssize_t comm_channel_recv(comm_channel_t *this_, sock_tcp_header_t *hdr_, void **msg_, size_t *len_,
-                                 size_t *ntrans_)
+size_t sock_hdr_len(bool v2_, const unsigned char *in_, size_t n_)
 {
-        ssize_t n = 0, _n = 0;
-        size_t ntrans = 0, _ntrans = 0;
-
-        buffer_t *buf = &this_->buf;
+        size_t len;
 
-        sock_tcp_header_t _hdr;
-        sock_tcp_header_t *hdr;
+        if (!v2_)
+                return SOCK_HDR_V1_LEN;
+        if (n_ < SOCK_HDR_V2_MIN)
+                return SOCK_HDR_V2_MIN;
 
-        if (hdr_) {
-                hdr = hdr_;
-        } else {
-                hdr = &_hdr;
-        }
+        len = 3 + (1u << (in_[2] & SOCK_HF_LEN_MASK));
+        if (in_[2] & SOCK_HF_SID)
+                len += sizeof(uint32_t);
 
-        // Read the header
-        ERR_RET(_n, trans_socket(__recv, this_->fd, NULL, hdr, sizeof(*hdr), &_ntrans));
-        n      = _n;
-        ntrans = _ntrans;
+        return len;
+}
 
-        // Make sure that the buffer is large enough
-        buffer_resize(buf, hdr->msg_len);
-        buf->n = hdr->msg_len;
+//------------------------------------------------------------------------------
+// Decode a complete wire header. Fails with EPROTO if a v2 header does not
+// start with the magic byte or sets reserved flag bits.
+//------------------------------------------------------------------------------
+int sock_hdr_decode(sock_tcp_header_t *hdr_, bool v2_, const unsigned char *in_)
+{
+        uint32_t len32;
+        size_t n, i;
 
-        // Read the message
-        ERR_RET(_n, trans_socket(__recv, this_->fd, NULL, buf->data, buf->n, &_ntrans));
-        n += _n;
-        ntrans += _ntrans;
+        memset(hdr_, 0, sizeof(*hdr_));
 
-        // Sanity check
-        assert(n == (hdr->msg_len + sizeof(*hdr)));
+        if (!v2_) {
+                memcpy(&len32, in_, sizeof(len32));
+                hdr_->msg_len = len32;
+                hdr_->opts    = in_[4];
+                return 0;
+        }
 
-        // Provide reference to internal data
-        if (msg_) {
-                *msg_ = buf->data;
-                *len_ = buf->n;
+        if (in_[0] != SOCK_HDR_V2_MAGIC || (in_[2] & ~SOCK_HF_DEFINED)) {
+                errno = EPROTO;
+                return -1;
         }
 
-        if (ntrans_)
-                *ntrans_ = ntrans;
+        hdr_->opts  = in_[1];
+        hdr_->flags = in_[2] & ~SOCK_HF_LEN_MASK;
+        n           = 3;
 
-        return n;
+        for (i = 0; i < (1u << (in_[2] & SOCK_HF_LEN_MASK)); i++)
+                hdr_->msg_len |= (uint64_t)in_[n++] << (8 * i);
+
+        if (hdr_->flags & SOCK_HF_SID) {
+                for (i = 0; i < sizeof(uint32_t); i++)
+                        hdr_->stream_id |= (uint32_t)in_[n++] << (8 * i);
+        }
+
+        return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -687,30 +3025,24 @@ static ssize_t comm_channel_recv(comm_channel_t *this_, sock_tcp_header_t *hdr_,
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
-static void buffer_ctor(buffer_t *this_, size_t len_)
+void buffer_ctor(buffer_t *this_, size_t len_)
 {
-        size_t len;
-        if (len_) {
-                len = len_;
-        } else {
-                len = 1; // 1 bytes
-        }
-        this_->len  = len;
         this_->n    = 0;
-        this_->data = calloc(len, 1);
+        this_->data = sock_bufpool_get(len_ ? len_ : 1, &this_->len);
         assert(this_->data);
 
-        this_->alloc_len += len;
+        this_->alloc_len += this_->len;
 }
 
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
-static int buffer_dtor(buffer_t *this_)
+int buffer_dtor(buffer_t *this_)
 {
         if (this_->data) {
                 this_->alloc_len -= this_->len;
-                free(this_->data);
+                sock_bufpool_put(this_->data, this_->len);
+                this_->data = NULL;
         }
         this_->len = 0;
         this_->n   = 0;
@@ -722,36 +3054,52 @@ static int buffer_dtor(buffer_t *this_)
 }
 
 //------------------------------------------------------------------------------
-//
+// Grow the buffer to hold at least min_len_ bytes, at least doubling it. The
+// used portion is kept; the new bytes are not initialized. Fails with ENOMEM,
+// leaving the buffer as it was.
 //------------------------------------------------------------------------------
-static void buffer_resize(buffer_t *this_, size_t min_len_)
+int buffer_resize(buffer_t *this_, size_t min_len_)
 {
-        if (this_->len >= min_len_)
-                return;
-
-        // Compute the new len as len = 2^n*this_->len >= min_len_
-        int n      = (int)ceil(log2(((double)min_len_) / this_->len));
-        size_t len = this_->len << n;
+        void *data;
+        size_t len;
 
-        assert(len > this_->len);
+        if (this_->len >= min_len_)
+                return 0;
 
-        this_->data = realloc(this_->data, len);
-        assert(this_->data);
+        if ((data = sock_bufpool_get(min_len_ > 2 * this_->len ? min_len_ : 2 * this_->len, &len)) == NULL) {
+                errno = ENOMEM;
+                return -1;
+        }
 
-        // Zero the new bytes
-        memset(this_->data + this_->len, 0, len - this_->len);
+        if (this_->n)
+                memcpy(data, this_->data, this_->n);
+        sock_bufpool_put(this_->data, this_->len);
 
         this_->alloc_len += (len - this_->len);
-        this_->len = len;
+        this_->data = data;
+        this_->len  = len;
+        return 0;
 }
 
 //------------------------------------------------------------------------------
 //
 //------------------------------------------------------------------------------
-static void buffer_clear(buffer_t *this_)
+void buffer_clear(buffer_t *this_)
 {
         this_->n = 0;
-        memset(this_->data, 0, this_->len);
+}
+
+//------------------------------------------------------------------------------
+// Appends len_ bytes to the used portion of the buffer, growing it as needed
+//------------------------------------------------------------------------------
+int buffer_append(buffer_t *this_, const void *data_, size_t len_)
+{
+        int n;
+
+        ERR_RET(n, buffer_resize(this_, this_->n + len_));
+        memcpy(this_->data + this_->n, data_, len_);
+        this_->n += len_;
+        return 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -766,8 +3114,52 @@ static uint16_t get_sock_port(sock_server_t *this_)
         socklen_t addr_len = sizeof(this_->addr);
         ;
 
-        getsockname(this_->fd, (struct sockaddr *)&this_->addr, &addr_len);
-        return ntohs(this_->addr.sin_port);
+        getsockname(this_->fd, &this_->addr.sa, &addr_len);
+        return ntohs(this_->addr.in.sin_port);
+}
+
+//------------------------------------------------------------------------------
+// Parse name_ as a Unix domain address ("unix:/path" or "unix:@name" for the
+// abstract namespace, or the same with "shm:"). Returns 1 (2 for "shm:") with
+// the address in addr_/len_, 0 if name_ is not a Unix domain address and -1
+// (ENAMETOOLONG or EINVAL) if it is invalid.
+//------------------------------------------------------------------------------
+int sock_addr_unix(sock_addr_t *addr_, socklen_t *len_, const char *name_)
+{
+        const char *path;
+        size_t len;
+        int rc;
+
+        if (strncmp(name_, SOCK_UNIX_PREFIX, strlen(SOCK_UNIX_PREFIX)) == 0) {
+                path = name_ + strlen(SOCK_UNIX_PREFIX);
+                rc   = 1;
+        } else if (strncmp(name_, SOCK_SHM_PREFIX, strlen(SOCK_SHM_PREFIX)) == 0) {
+                path = name_ + strlen(SOCK_SHM_PREFIX);
+                rc   = 2;
+        } else {
+                return 0;
+        }
+
+        if ((len = strlen(path)) == 0 || (path[0] == '@' && len == 1)) {
+                errno = EINVAL;
+                return -1;
+        } else if (len >= sizeof(addr_->un.sun_path)) {
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+
+        memset(addr_, 0, sizeof(*addr_));
+        addr_->un.sun_family = AF_UNIX;
+        memcpy(addr_->un.sun_path, path, len);
+
+        if (path[0] == '@') { // Abstract name: leading NUL, length given by the address length
+                addr_->un.sun_path[0] = '\0';
+                *len_                 = offsetof(struct sockaddr_un, sun_path) + len;
+        } else {
+                *len_ = offsetof(struct sockaddr_un, sun_path) + len + 1;
+        }
+
+        return rc;
 }
 
 //------------------------------------------------------------------------------
@@ -775,7 +3167,7 @@ static uint16_t get_sock_port(sock_server_t *this_)
 // Ensures that the entire stream block is recv.
 //------------------------------------------------------------------------------
 static ssize_t trans_stream_block(ssize_t (*method_)(int fd_, void *data_, size_t n_, int flags_), int fd_,
-                                  void *data_, size_t n_, size_t *ntrans_)
+                                  void *data_, size_t n_, size_t *ntrans_, sock_deadline_t *dl_, uint32_t *crc_)
 {
         ssize_t n;
         size_t len;
@@ -793,7 +3185,12 @@ static ssize_t trans_stream_block(ssize_t (*method_)(int fd_, void *data_, size_
                 nt++;
                 n = method_(fd_, data_ + len, n_ - len, 0);
 
-                if (n < 0) { // Error occurred
+                if (n < 0 && errno == EAGAIN) { // Non-blocking socket: wait for data
+                        if (trans_wait(fd_, POLLIN, dl_) == 0)
+                                continue;
+                        rc = -1;
+                        goto fini;
+                } else if (n < 0) { // Error occurred
                         rc = n;
                         goto fini;
                 } else if (n == 0 && n_ - len != 0) { // Peer disconnect (set as error)
@@ -803,7 +3200,11 @@ static ssize_t trans_stream_block(ssize_t (*method_)(int fd_, void *data_, size_
                         goto fini;
                 }
                 assert(n > 0);
+                if (crc_) // While the bytes just received are in the cache
+                        *crc_ = sock_crc32c(*crc_, data_ + len, n);
                 len += n;
+                if (dl_)
+                        dl_->nbytes += n;
                 if (len == n_) {
                         rc = len;
                         goto fini;
@@ -812,8 +3213,9 @@ static ssize_t trans_stream_block(ssize_t (*method_)(int fd_, void *data_, size_
 
 fini:
         if (len != n_) {
-                rc    = -1;
-                errno = ECOMM; // Set as communcation error
+                rc = -1;
+                if (errno != ETIMEDOUT)
+                        errno = ECOMM; // Set as communcation error
         }
         if (ntrans_)
                 *ntrans_ = nt;
@@ -824,19 +3226,20 @@ fini:
 //
 //------------------------------------------------------------------------------
 static ssize_t trans_socket(ssize_t (*method_)(int fd_, void *data_, size_t n_, int flags_), int fd_,
-                            sock_tcp_header_t *hdr_, void *data_, size_t len_, size_t *ntrans_)
+                            sock_tcp_header_t *hdr_, void *data_, size_t len_, size_t *ntrans_, sock_deadline_t *dl_,
+                            uint32_t *crc_)
 {
         ssize_t n = 0, _n = 0;
         size_t _ntrans = 0;
         size_t ntrans  = 0;
 
         if (hdr_) {
-                ERR_RET(_n, trans_stream_block(method_, fd_, hdr_, sizeof(*hdr_), &_ntrans));
+                ERR_RET(_n, trans_stream_block(method_, fd_, hdr_, sizeof(*hdr_), &_ntrans, dl_, NULL));
                 n      = _n;
                 ntrans = _ntrans;
         }
 
-        ERR_RET(_n, trans_stream_block(method_, fd_, data_, len_, &_ntrans));
+        ERR_RET(_n, trans_stream_block(method_, fd_, data_, len_, &_ntrans, dl_, crc_));
         n += _n;
         ntrans += _ntrans;
 
@@ -846,16 +3249,192 @@ static ssize_t trans_socket(ssize_t (*method_)(int fd_, void *data_, size_t n_,
 }
 
 //------------------------------------------------------------------------------
-// Local send wrapper procedure to have common send/recv prototypes
+// Performs consecutive sendmsg calls until every iovec segment is sent; iov_
+// is advanced in place past the bytes already sent. With MSG_ZEROCOPY in
+// flags_, *nzc_ is incremented for every call that queued data (each one is
+// later reported on the error queue); if the kernel refuses to pin more pages
+// (ENOBUFS) the remainder is sent with a copy. A non-blocking socket is
+// waited on until the deadline dl_ (if any).
 //------------------------------------------------------------------------------
-static inline ssize_t __send(int fd_, void *data_, size_t n_, int flags_)
+static ssize_t trans_sendv(int fd_, struct iovec *iov_, int iovcnt_, int flags_, size_t *ntrans_,
+                           uint32_t *nzc_, sock_deadline_t *dl_)
 {
-        ssize_t n = send(fd_, data_, n_, flags_);
-        return n;
+        struct msghdr msg;
+        ssize_t n;
+        size_t len = 0;
+        size_t nt  = 0;
+
+        ssize_t rc = 0;
+
+        memset(&msg, 0, sizeof(msg));
+
+        while (iovcnt_ > 0) {
+                if (iov_->iov_len == 0) { // Nothing left in this segment
+                        iov_++;
+                        iovcnt_--;
+                        continue;
+                }
+
+                msg.msg_iov    = iov_;
+                msg.msg_iovlen = iovcnt_ < IOV_MAX ? iovcnt_ : IOV_MAX;
+
+                nt++;
+                n = sendmsg(fd_, &msg, flags_);
+
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN && trans_wait(fd_, POLLOUT, dl_) == 0)
+                                continue;
+#ifdef SOCK_HAVE_ZEROCOPY
+                        if (errno == ENOBUFS && (flags_ & MSG_ZEROCOPY)) {
+                                flags_ &= ~MSG_ZEROCOPY;
+                                continue;
+                        }
+#endif
+                        rc = n;
+                        goto fini;
+                }
+                len += n;
+                if (dl_)
+                        dl_->nbytes += n;
+#ifdef SOCK_HAVE_ZEROCOPY
+                if (flags_ & MSG_ZEROCOPY)
+                        (*nzc_)++;
+#endif
+
+                // Advance over the completed segments and into a partial one
+                while (iovcnt_ > 0 && (size_t)n >= iov_->iov_len) {
+                        n -= iov_->iov_len;
+                        iov_++;
+                        iovcnt_--;
+                }
+                if (n > 0) {
+                        iov_->iov_base += n;
+                        iov_->iov_len -= n;
+                }
+        }
+        rc = len;
+
+fini:
+        if (ntrans_)
+                *ntrans_ = nt;
+        return rc;
+}
+
+//------------------------------------------------------------------------------
+// Performs consecutive sendfile calls until len_ bytes of in_fd_, starting at
+// offset_, have been sent (the file offset of in_fd_ is not changed). Fails
+// with ENODATA if the file ends first.
+//------------------------------------------------------------------------------
+static ssize_t trans_sendfile(int fd_, int in_fd_, off_t offset_, size_t len_, size_t *ntrans_,
+                              sock_deadline_t *dl_)
+{
+        ssize_t n;
+        size_t len = 0;
+        size_t nt  = 0;
+
+        ssize_t rc = 0;
+
+        while (len < len_) {
+                nt++;
+                n = sendfile(fd_, in_fd_, &offset_, len_ - len);
+
+                if (n < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        if (errno == EAGAIN && trans_wait(fd_, POLLOUT, dl_) == 0)
+                                continue;
+                        rc = n;
+                        goto fini;
+                }
+                if (n == 0) { // File shorter than requested
+                        errno = ENODATA;
+                        rc    = -1;
+                        goto fini;
+                }
+                len += n;
+                if (dl_)
+                        dl_->nbytes += n;
+        }
+        rc = len;
+
+fini:
+        if (ntrans_)
+                *ntrans_ = nt;
+        return rc;
 }
 
+//------------------------------------------------------------------------------
+// Local recv wrapper procedure matching the trans_stream_block method prototype
+//------------------------------------------------------------------------------
 static inline ssize_t __recv(int fd_, void *data_, size_t n_, int flags_)
 {
         ssize_t n = recv(fd_, data_, n_, flags_);
         return n;
 }
+
+//------------------------------------------------------------------------------
+// Continue the CRC32C crc_ over the iovec segments
+//------------------------------------------------------------------------------
+static uint32_t crc_iov(uint32_t crc_, const struct iovec *iov_, int iovcnt_)
+{
+        int i;
+
+        for (i = 0; i < iovcnt_; i++)
+                crc_ = sock_crc32c(crc_, iov_[i].iov_base, iov_[i].iov_len);
+        return crc_;
+}
+
+//------------------------------------------------------------------------------
+// Encode crc_ as a SOCK_HF_CRC trailer
+//------------------------------------------------------------------------------
+static void crc_trailer(uint32_t crc_, unsigned char *out_)
+{
+        out_[0] = crc_;
+        out_[1] = crc_ >> 8;
+        out_[2] = crc_ >> 16;
+        out_[3] = crc_ >> 24;
+}
+
+//------------------------------------------------------------------------------
+// Wait until the non-blocking socket fd_ is ready for events_. Fails with
+// ETIMEDOUT once the deadline dl_ has passed; without one (NULL or 0) it
+// waits indefinitely.
+//------------------------------------------------------------------------------
+int trans_wait(int fd_, short events_, const sock_deadline_t *dl_)
+{
+        struct pollfd pfd;
+        int64_t left;
+        int n, timeout;
+
+        while (1) {
+                timeout = -1;
+                if (dl_ && dl_->at) {
+                        if ((left = dl_->at - sock_clock_ms()) <= 0) {
+                                errno = ETIMEDOUT;
+                                return -1;
+                        }
+                        timeout = left < INT_MAX ? (int)left : INT_MAX;
+                }
+
+                pfd.fd      = fd_;
+                pfd.events  = events_;
+                pfd.revents = 0;
+                if ((n = poll(&pfd, 1, timeout)) > 0)
+                        return 0; // Errors and hang ups are reported by the next call
+                if (n < 0 && errno != EINTR)
+                        return -1;
+        }
+}
+
+//------------------------------------------------------------------------------
+// Milliseconds on CLOCK_MONOTONIC; the time base of all deadlines
+//------------------------------------------------------------------------------
+int64_t sock_clock_ms(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2016-2017,2019 Jason Graham <jgraham@compukix.net>
+ *
+ * This file is part of libsockets.
+ *
+ * libsockets is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * libsockets is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with libsockets.  If not, see
+ * <https://www.gnu.org/licenses/>.
+ */
+
+// Internal types and procedures shared between the library sources. Not
+// installed; the public interface is libsockets/sockets.h.
+
+#ifndef __SOCKETS_INTERNAL_H__
+#define __SOCKETS_INTERNAL_H__
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/uio.h>
+
+#include <libsockets/sockets.h>
+
+// Wire header layouts. v1 is the raw legacy struct in host byte order:
+//
+//   uint32_t msg_len, uint8_t opts, 3 bytes padding               (8 bytes)
+//
+// v2 is little endian with a length field only as wide as needed:
+//
+//   uint8_t magic (SOCK_HDR_V2_MAGIC), uint8_t opts, uint8_t flags,
+//   msg_len (1, 2, 4 or 8 bytes by flags & SOCK_HF_LEN_MASK),
+//   uint32_t stream_id (if flags & SOCK_HF_SID)                (4 - 15 bytes)
+//
+// With flags & SOCK_HF_CRC the payload is followed by its CRC32C (uint32_t,
+// little endian), which msg_len does not count. Flag bits not defined are
+// reserved and must be 0; headers with any of them set are refused.
+#define SOCK_HDR_V1_LEN 8
+#define SOCK_HDR_V2_MIN 4  // Bytes of a v2 header needed to know its length
+#define SOCK_HDR_MAX 16    // Buffer size large enough for any header
+#define SOCK_HDR_V2_MAGIC 0xA2
+#define SOCK_HF_LEN_MASK 0b0011
+#define SOCK_HF_DEFINED (SOCK_HF_LEN_MASK | SOCK_HF_SID | SOCK_HF_CRC)
+#define SOCK_CRC_LEN 4 // Length of a SOCK_HF_CRC trailer
+
+// Compressed payload (SOCK_OPTS_COMP): uint8_t codec id, uint32_t raw length
+// (little endian), then the codec output
+#define SOCK_COMP_HDR 5
+#define SOCK_COMP_MAX (16 << 20) // Largest message that is compressed
+
+// Receive side stream state (comm_channel_t::rx_stream)
+#define SOCK_RX_NONE 0   // Not inside a stream
+#define SOCK_RX_STREAM 1 // Inside a chunked stream
+#define SOCK_RX_LAST 2   // Last chunk delivered; the end is reported next
+
+#define set_bit(a, mask) ((a) |= (mask))
+#define unset_bit(a, mask) ((a) &= ((a) ^ (mask)))
+
+// Return-on-error function call macros
+#define ERR_RET(val, fun)                                                                                         \
+        val = fun;                                                                                                \
+        if (val < 0)                                                                                              \
+        return val
+
+typedef struct buffer_s {
+        size_t len; // Length (in bytes) of data
+        size_t n;   // Number of bytes used in data
+        void *data; // Data
+        size_t alloc_len;
+} buffer_t;
+
+// Deadline of a transfer in progress
+typedef struct sock_deadline_s {
+        int64_t at;    // CLOCK_MONOTONIC ms by which the transfer must be done (0: no limit)
+        size_t nbytes; // Bytes moved, counted up to the point of any failure
+} sock_deadline_t;
+
+typedef struct sock_uring_s sock_uring_t;
+typedef struct sock_shm_s sock_shm_t;
+
+typedef struct comm_channel_s {
+        int fd;                  // Socket file descriptor
+        socklen_t addr_len; // Length of address
+        sock_addr_t addr;   // Remote address
+        buffer_t buf;            // Internal buffer
+        buffer_t ra;             // Read-ahead: bytes received but not yet consumed are data[rpos, n)
+        size_t rpos;             // Consumed part of ra
+
+        sock_tcp_header_t rx_hdr; // Header of the message being received
+        size_t rx_pending;        // Payload bytes of rx_hdr not yet received
+        bool rx_active;           // rx_hdr has been read and its payload is pending
+        int rx_stream;            // SOCK_RX_* state of sock_*_read_chunk
+        bool tx_stream;           // A chunked stream is being sent
+
+        size_t zc_threshold; // Payload length from which MSG_ZEROCOPY is used (0 disables)
+        int zc_fd;           // Socket SO_ZEROCOPY has been enabled on (0 if none)
+        uint32_t zc_sent;    // Zero-copy sendmsg calls issued on zc_fd
+        uint32_t zc_done;    // Zero-copy sendmsg calls the kernel has released
+
+        int pipe[2]; // Pipe used to splice payloads into files ({0, 0} until needed)
+
+        sock_opts_t opts; // Tuning applied to the sockets of the channel
+
+        buffer_t wb;      // Batched output: framed messages not yet sent
+        size_t batch_len; // Batch messages, flushing before wb exceeds this many bytes (0: no batching)
+        int batch_ms;     // Flush once the oldest batched message is this old (0: no limit)
+        bool batch_cork;  // Send each flush with TCP_CORK set
+        int64_t batch_at; // When the oldest message in wb was queued (CLOCK_MONOTONIC ms)
+
+        const sock_codec_t *codec; // Codec sent messages are compressed with (NULL: none)
+        size_t comp_min;           // Smallest payload that is compressed
+        bool comp_ok;              // Compression agreed in the handshake
+        unsigned comp_skip;        // Messages still to send uncompressed after a miss
+        unsigned comp_backoff;     // Length of the next skip after a miss
+        buffer_t zd;               // Decompressed payload of the message being received
+        size_t zpos;               // Consumed part of zd
+
+        bool crc;        // Send CRC32C trailers
+        bool crc_ok;     // CRC32C trailers agreed in the handshake
+        bool rx_crc_on;  // The payload being received has a trailer, checked once it is complete
+        uint32_t rx_crc; // CRC32C of the payload received so far
+
+        bool hdr_v2;      // v2 wire header agreed in the handshake
+        uint64_t msg_max; // Longest payload accepted (0: SOCK_MSG_MAX)
+        bool shared; // Sent and received on by several threads at once (sock_mux_t)
+        sock_shm_t *shm; // Shared memory rings carrying the data (NULL when not in use)
+
+        int64_t deadline;   // Deadline set with sock_*_deadline (CLOCK_MONOTONIC ms, 0 if none)
+        int idle_ms;        // Limit on the wait for the next message header (0: none)
+        int xfer_ms;        // Limit on each send and each payload receive (0: none)
+        bool nonblock;      // fd has been made non-blocking for deadline waits
+        sock_deadline_t tx; // Deadline and progress of the send in progress
+        sock_deadline_t rx; // Deadline and progress of the receive in progress
+#ifdef HAVE_IO_URING
+        sock_uring_t *ring; // io_uring backend (NULL when not in use)
+#endif
+} comm_channel_t;
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+/// sock_server_t
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+int sock_server_handshake(sock_server_t *this_, uint16_t wport_);
+int sock_addr_unix(sock_addr_t *addr_, socklen_t *len_, const char *name_);
+void sock_handshake_reply(const sock_tcp_header_t *req_, sock_tcp_header_t *reply_, size_t len_);
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+/// sock_tcp_header_t
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+size_t sock_hdr_encode(const sock_tcp_header_t *hdr_, bool v2_, unsigned char *out_);
+size_t sock_hdr_len(bool v2_, const unsigned char *in_, size_t n_);
+int sock_hdr_decode(sock_tcp_header_t *hdr_, bool v2_, const unsigned char *in_);
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+/// buffer_t
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+void buffer_ctor(buffer_t *this_, size_t size_);
+int buffer_dtor(buffer_t *this_);
+int buffer_resize(buffer_t *this_, size_t size_);
+void buffer_clear(buffer_t *this_);
+int buffer_append(buffer_t *this_, const void *data_, size_t len_);
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+/// Message buffer pool (sock_bufpool.c)
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+void *sock_bufpool_get(size_t len_, size_t *cap_);
+void sock_bufpool_put(void *data_, size_t cap_);
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+/// Socket tuning (sock_opts.c)
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+int sock_opts_apply(const sock_opts_t *this_, int fd_);
+int sock_opts_autosize(const sock_opts_t *this_, int fd_);
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+/// Compression codecs (sock_codec.c)
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+const sock_codec_t *sock_codec_get(unsigned char id_);
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+/// comm_channel_t
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+comm_channel_t *comm_channel_alloc(size_t buf_len_);
+int comm_channel_free(comm_channel_t **this_);
+int comm_channel_close(comm_channel_t *this_);
+ssize_t comm_channel_sendv(comm_channel_t *this_, const sock_tcp_header_t *hdr_, const struct iovec *iov_, int iovcnt_,
+                           size_t *ntrans_);
+int comm_channel_batch(comm_channel_t *this_, size_t len_, int ms_, bool cork_);
+ssize_t comm_channel_flush(comm_channel_t *this_, size_t *ntrans_);
+int comm_channel_batch_timeout(const comm_channel_t *this_);
+int comm_channel_msg_check(const comm_channel_t *this_, uint64_t len_);
+ssize_t comm_channel_recv_hdr(comm_channel_t *this_, sock_tcp_header_t *hdr_, size_t *ntrans_);
+ssize_t comm_channel_recv_payload(comm_channel_t *this_, void *data_, size_t len_, size_t *ntrans_);
+ssize_t comm_channel_recv_batch(comm_channel_t *this_, struct iovec *msg_, size_t n_, size_t *ntrans_);
+int comm_channel_deadline(comm_channel_t *this_, int timeout_);
+int comm_channel_zerocopy(comm_channel_t *this_, size_t threshold_);
+int comm_channel_compress(comm_channel_t *this_, const char *codec_, size_t min_);
+int comm_channel_checksum(comm_channel_t *this_, bool on_);
+ssize_t comm_channel_zerocopy_reap(comm_channel_t *this_, int timeout_);
+ssize_t comm_channel_recv_to_fd(comm_channel_t *this_, int fd_, off_t offset_, size_t *ntrans_);
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+/// Socket to file transfers (sock_file.c)
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+int trans_pipe(int pipe_[2]);
+ssize_t trans_splice(int fd_, int pipe_[2], int out_fd_, off_t offset_, size_t len_, size_t *ntrans_,
+                     sock_deadline_t *dl_, const void *pre_, size_t npre_);
+ssize_t trans_direct(int fd_, int out_fd_, off_t offset_, size_t len_, size_t *ntrans_, sock_deadline_t *dl_,
+                     const void *pre_, size_t npre_, uint32_t *crc_);
+int trans_crc(int fd_, off_t offset_, size_t len_, uint32_t *crc_);
+int trans_wait(int fd_, short events_, const sock_deadline_t *dl_);
+int64_t sock_clock_ms(void);
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+/// sock_shm_t
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+sock_shm_t *sock_shm_offer(int sock_, const void *frame_, size_t frame_len_, size_t len_);
+sock_shm_t *sock_shm_accept(int sock_, void *frame_, size_t frame_len_);
+void sock_shm_free(sock_shm_t **this_);
+ssize_t sock_shm_sendv(sock_shm_t *this_, const struct iovec *iov_, int iovcnt_, size_t *ntrans_,
+                       sock_deadline_t *dl_);
+ssize_t sock_shm_sendfile(sock_shm_t *this_, int fd_, off_t offset_, size_t len_, size_t *ntrans_,
+                          sock_deadline_t *dl_);
+ssize_t sock_shm_recv(sock_shm_t *this_, void *data_, size_t n_, size_t *ntrans_, sock_deadline_t *dl_);
+ssize_t sock_shm_recv_to_fd(sock_shm_t *this_, int fd_, off_t offset_, size_t len_, size_t *ntrans_,
+                            sock_deadline_t *dl_);
+
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+/// sock_loop_t
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+int sock_loop_init(sock_loop_t *this_, uint16_t port_, sock_loop_fn_t on_msg_, void *arg_, bool reuseport_);
+
+#ifdef HAVE_IO_URING
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+/// sock_uring_t
+//::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
+
+int sock_uring_probe(void);
+sock_uring_t *sock_uring_alloc(int fd_);
+void sock_uring_free(sock_uring_t **this_);
+int sock_uring_register(sock_uring_t *this_, void *data_, size_t len_);
+ssize_t sock_uring_sendv(sock_uring_t *this_, const struct iovec *iov_, int iovcnt_, size_t *ntrans_);
+ssize_t sock_uring_recv(sock_uring_t *this_, void *data_, size_t n_, size_t *ntrans_);
+#endif
+
+#endif // __SOCKETS_INTERNAL_H__